@@ -0,0 +1,329 @@
+// Producers that read files asynchronously.  -*- c++ -*-
+//
+// ReadFileAsync(path) produces the contents of a file in chunks, like
+// ReadChunks, but reads them with several large reads in flight at
+// once, so that the device stays busy while the consumer parses. On
+// Linux, reads are queued with io_uring and the consumer's thread
+// only ever waits for the chunk it needs next. Where io_uring is
+// unavailable (old kernels, or sandboxes that forbid it), chunks are
+// read with pread on a helper thread instead.
+//
+// Chunks are read into a small pool of buffers that are recycled once
+// the consumer is done with them; as for the other chunk producers,
+// each chunk is valid only while the consumer it was passed to is
+// running.
+
+#ifndef ASYNC_FILE_PRODUCERS_H_
+#define ASYNC_FILE_PRODUCERS_H_
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "consumers_and_producers.h"
+
+// A minimal io_uring for reads, driven by raw system calls.
+class _Uring {
+public:
+  explicit _Uring(unsigned entries)
+      : fd_(-1), sq_ring_(MAP_FAILED), cq_ring_(MAP_FAILED),
+        sqes_(MAP_FAILED), pending_(0) {
+#ifdef __NR_io_uring_setup
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ < 0) {
+      return;
+    }
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes +
+        params.cq_entries * sizeof(io_uring_cqe);
+    sq_ring_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    cq_ring_ = ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED ||
+        sqes_ == MAP_FAILED) {
+      return;
+    }
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    sq_entries_ = params.sq_entries;
+#endif
+  }
+
+  ~_Uring() {
+    if (sqes_ != MAP_FAILED) ::munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED) ::munmap(cq_ring_, cq_size_);
+    if (sq_ring_ != MAP_FAILED) ::munmap(sq_ring_, sq_size_);
+    if (fd_ >= 0) ::close(fd_);
+  }
+  _Uring(const _Uring&) = delete;
+  _Uring& operator=(const _Uring&) = delete;
+
+  bool ok() const { return sqes_ != MAP_FAILED; }
+
+  // Queues a read. It is submitted by the next call to Wait.
+  void Read(int fd, char* buf, unsigned len, uint64_t offset,
+            uint64_t user_data) {
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes_) + index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++pending_;
+  }
+
+  // Submits queued reads and waits for at least one completion, which
+  // is returned in *user_data and *result (bytes read, or -errno).
+  void Wait(uint64_t* user_data, int* result) {
+    for (;;) {
+      unsigned head = *cq_head_;
+      if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        *user_data = cqe.user_data;
+        *result = cqe.res;
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return;
+      }
+      long n = ::syscall(__NR_io_uring_enter, fd_, pending_, 1,
+                         IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        throw std::runtime_error(std::string("io_uring_enter: ") +
+                                 std::strerror(errno));
+      }
+      if (n > 0) {
+        pending_ -= static_cast<unsigned>(n);
+      }
+    }
+  }
+
+  unsigned entries() const { return sq_entries_; }
+
+private:
+  int fd_;
+  void* sq_ring_;
+  void* cq_ring_;
+  void* sqes_;
+  size_t sq_size_ = 0;
+  size_t cq_size_ = 0;
+  size_t sqes_size_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+  unsigned pending_;  // Reads queued but not yet submitted.
+};
+
+// An open file that is closed when it goes out of scope.
+class _FileDescriptor {
+public:
+  explicit _FileDescriptor(const std::string& path)
+      : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC)), size_(0) {
+    struct stat st;
+    if (fd_ < 0 || ::fstat(fd_, &st) != 0) {
+      throw std::runtime_error("cannot open " + path + ": " +
+                               std::strerror(errno));
+    }
+    size_ = static_cast<uint64_t>(st.st_size);
+    ::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  ~_FileDescriptor() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+  _FileDescriptor(const _FileDescriptor&) = delete;
+  _FileDescriptor& operator=(const _FileDescriptor&) = delete;
+
+  int fd() const { return fd_; }
+  uint64_t size() const { return size_; }
+
+  // Reads len bytes at offset, retrying short reads.
+  void PRead(char* buf, size_t len, uint64_t offset) const {
+    while (len > 0) {
+      ssize_t n = ::pread(fd_, buf, len, static_cast<off_t>(offset));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        throw std::runtime_error(std::string("pread: ") +
+                                 (n < 0 ? std::strerror(errno) : "EOF"));
+      }
+      buf += n;
+      len -= static_cast<size_t>(n);
+      offset += static_cast<uint64_t>(n);
+    }
+  }
+
+private:
+  int fd_;
+  uint64_t size_;
+};
+
+// Reads chunks with io_uring. Chunk i is read into buffer i % depth.
+inline void _ReadChunksUring(const _FileDescriptor& file, _Uring* ring,
+                             size_t chunk_size, size_t depth,
+                             const Consumer<std::string_view>& c) {
+  const uint64_t size = file.size();
+  const uint64_t chunks = (size + chunk_size - 1) / chunk_size;
+  std::vector<std::vector<char>> pool(depth, std::vector<char>(chunk_size));
+  std::vector<size_t> done(depth, 0);  // Bytes read into each buffer.
+  // If the consumer throws, the kernel must be done writing into the
+  // pool before it is freed.
+  struct Drainer {
+    _Uring* ring;
+    size_t in_flight;
+    ~Drainer() {
+      uint64_t chunk;
+      int result;
+      try {
+        for (; in_flight > 0; --in_flight) {
+          ring->Wait(&chunk, &result);
+        }
+      } catch (const std::exception&) {
+      }
+    }
+  } drainer{ring, 0};
+  auto length = [&](uint64_t chunk) {
+    return static_cast<size_t>(
+        std::min<uint64_t>(chunk_size, size - chunk * chunk_size));
+  };
+  auto read = [&](uint64_t chunk) {
+    size_t slot = chunk % depth;
+    ring->Read(file.fd(), pool[slot].data() + done[slot],
+               static_cast<unsigned>(length(chunk) - done[slot]),
+               chunk * chunk_size + done[slot], chunk);
+    ++drainer.in_flight;
+  };
+  uint64_t submitted = 0;
+  for (; submitted < std::min<uint64_t>(depth, chunks); ++submitted) {
+    read(submitted);
+  }
+  for (uint64_t next = 0; next < chunks; ++next) {
+    size_t slot = next % depth;
+    while (done[slot] < length(next)) {
+      uint64_t chunk;
+      int result;
+      ring->Wait(&chunk, &result);
+      --drainer.in_flight;
+      size_t s = chunk % depth;
+      if (result == -EINVAL || result == -EOPNOTSUPP) {
+        // The kernel predates IORING_OP_READ; read this one ourselves.
+        file.PRead(pool[s].data() + done[s], length(chunk) - done[s],
+                   chunk * chunk_size + done[s]);
+        done[s] = length(chunk);
+      } else if (result <= 0) {
+        throw std::runtime_error(
+            std::string("read: ") +
+            (result < 0 ? std::strerror(-result) : "unexpected EOF"));
+      } else {
+        done[s] += static_cast<size_t>(result);
+        if (done[s] < length(chunk)) {
+          read(chunk);  // A short read; read the rest.
+        }
+      }
+    }
+    c(std::string_view(pool[slot].data(), length(next)));
+    done[slot] = 0;
+    if (submitted < chunks) {
+      read(submitted++);
+    }
+  }
+}
+
+// Reads chunks with pread on a helper thread.
+inline void _ReadChunksPRead(const _FileDescriptor& file, size_t chunk_size,
+                             size_t depth,
+                             const Consumer<std::string_view>& c) {
+  std::vector<std::vector<char>> pool(depth, std::vector<char>(chunk_size));
+  Buffer<std::pair<size_t, size_t>> full(depth);
+  Buffer<size_t> free(depth);
+  for (size_t i = 0; i < depth; ++i) {
+    free.Push(i);
+  }
+  _Feeder feeder([&] {
+    size_t slot;
+    for (uint64_t offset = 0; offset < file.size() && free.Pop(&slot);
+         offset += chunk_size) {
+      size_t len = static_cast<size_t>(
+          std::min<uint64_t>(chunk_size, file.size() - offset));
+      file.PRead(pool[slot].data(), len, offset);
+      if (!full.Push(std::make_pair(slot, len))) {
+        return;
+      }
+    }
+  }, &full);
+  struct Closer {
+    Buffer<std::pair<size_t, size_t>>* full;
+    Buffer<size_t>* free;
+    ~Closer() {
+      full->Close();
+      free->Close();
+    }
+  } closer{&full, &free};
+  std::pair<size_t, size_t> chunk;
+  while (full.Pop(&chunk)) {
+    c(std::string_view(pool[chunk.first].data(), chunk.second));
+    free.Push(chunk.first);
+  }
+  feeder.Join();
+}
+
+// Produces the contents of a file in chunks of up to chunk_size bytes,
+// with up to depth chunks being read ahead of the consumer. Set
+// use_io_uring to false to always use the pread fallback.
+inline Producer<std::string_view> ReadFileAsync(const std::string& path,
+                                                size_t chunk_size = 1 << 20,
+                                                size_t depth = 4,
+                                                bool use_io_uring = true) {
+  return [=](const Consumer<std::string_view>& c) {
+    _FileDescriptor file(path);
+    if (use_io_uring) {
+      _Uring ring(static_cast<unsigned>(depth));
+      if (ring.ok() && ring.entries() >= depth) {
+        _ReadChunksUring(file, &ring, chunk_size, depth, c);
+        return;
+      }
+    }
+    _ReadChunksPRead(file, chunk_size, depth, c);
+  };
+}
+
+#endif  // ASYNC_FILE_PRODUCERS_H_
@@ -0,0 +1,116 @@
+// Tests for producers that read files asynchronously.
+
+#include "async_file_producers.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "text_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Writes contents to a fresh temporary file and returns its path.
+string TempFile(const string& contents) {
+  static int n = 0;
+  string path = ::testing::TempDir() + "async_file_producers_test." +
+      std::to_string(::getpid()) + "." + std::to_string(n++);
+  std::FILE* f = std::fopen(path.c_str(), "wb");
+  std::fwrite(contents.data(), 1, contents.size(), f);
+  std::fclose(f);
+  return path;
+}
+
+string Concat(const Producer<std::string_view>& p) {
+  string s;
+  p([&](std::string_view chunk) { s.append(chunk.data(), chunk.size()); });
+  return s;
+}
+
+string Text() {
+  string text;
+  for (int i = 0; i < 50000; ++i) {
+    text += "line " + std::to_string(i * 7919 % 10007) + "\n";
+  }
+  return text;
+}
+
+}  // namespace
+
+TEST(ReadFileAsync, ReadsWholeFiles) {
+  const string text = Text();
+  const string path = TempFile(text);
+  for (bool use_io_uring : {true, false}) {
+    for (size_t chunk_size : {13u, 4096u, 10000u, 1u << 20}) {
+      for (size_t depth : {1u, 2u, 8u}) {
+        EXPECT_EQ(text, Concat(ReadFileAsync(path, chunk_size, depth,
+                                             use_io_uring)));
+      }
+    }
+  }
+  std::remove(path.c_str());
+}
+
+TEST(ReadFileAsync, ProducesChunksInOrder) {
+  const string path = TempFile("abcdefghij");
+  for (bool use_io_uring : {true, false}) {
+    vector<string> chunks;
+    ReadFileAsync(path, 3, 2, use_io_uring)([&](std::string_view chunk) {
+      chunks.emplace_back(chunk);
+    });
+    EXPECT_EQ((vector<string>{"abc", "def", "ghi", "j"}), chunks);
+  }
+  std::remove(path.c_str());
+}
+
+TEST(ReadFileAsync, ReadsEmptyFiles) {
+  const string path = TempFile("");
+  EXPECT_EQ("", Concat(ReadFileAsync(path)));
+  EXPECT_EQ("", Concat(ReadFileAsync(path, 1 << 20, 4, false)));
+  std::remove(path.c_str());
+}
+
+TEST(ReadFileAsync, FeedsLineProducers) {
+  const string path = TempFile(Text());
+  size_t lines = 0;
+  SplitLines(ReadFileAsync(path, 777, 3))([&](std::string_view line) {
+    EXPECT_EQ("line ", line.substr(0, 5));
+    ++lines;
+  });
+  EXPECT_EQ(50000u, lines);
+  std::remove(path.c_str());
+}
+
+TEST(ReadFileAsync, StopsWhenTheConsumerThrows) {
+  const string path = TempFile(Text());
+  for (bool use_io_uring : {true, false}) {
+    int chunks = 0;
+    EXPECT_THROW(ReadFileAsync(path, 100, 4, use_io_uring)(
+                     [&](std::string_view) {
+                       if (++chunks == 3) throw std::logic_error("stop");
+                     }),
+                 std::logic_error);
+    EXPECT_EQ(3, chunks);
+  }
+  std::remove(path.c_str());
+}
+
+TEST(ReadFileAsync, ThrowsOnMissingFiles) {
+  auto chunks = ReadFileAsync(::testing::TempDir() + "no/such/file");
+  EXPECT_THROW(chunks([](std::string_view) {}), std::runtime_error);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,201 @@
+// Bounded buffers for handing values between threads.  -*- c++ -*-
+//
+// A Buffer<T> is a bounded, blocking, multi-producer, multi-consumer
+// queue. Producers running on one thread can feed consumers running
+// on another through a buffer, which lets I/O, decompression, and
+// parsing overlap. Prefetch(p, n) does exactly that for a producer.
+
+#ifndef BUFFER_H_
+#define BUFFER_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "consumers_and_producers.h"
+
+template <typename T>
+class Buffer {
+public:
+  explicit Buffer(size_t capacity)
+      : capacity_(capacity), closed_(false), version_(0) {}
+  Buffer(const Buffer&) = delete;
+  Buffer& operator=(const Buffer&) = delete;
+
+  // Adds x to the buffer, waiting for room if the buffer is full.
+  // Returns false, dropping x, if the buffer has been closed.
+  bool Push(T x) {
+    std::unique_lock<std::mutex> lock(mu_);
+    not_full_.wait(lock, [this] {
+      return closed_ || items_.size() < capacity_;
+    });
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(std::move(x));
+    not_empty_.notify_one();
+    Changed(&lock);
+    return true;
+  }
+
+  // Removes the oldest value from the buffer into *x, waiting for one
+  // if the buffer is empty. Returns false if the buffer is empty and
+  // has been closed.
+  bool Pop(T* x) {
+    std::unique_lock<std::mutex> lock(mu_);
+    not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return false;
+    }
+    *x = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    Changed(&lock);
+    return true;
+  }
+
+  // Like Push and Pop, but never wait. They return false if they
+  // would have had to, and then store the buffer's version in
+  // *version, if given, for Watch.
+  bool TryPush(T x, uint64_t* version = nullptr) {
+    std::unique_lock<std::mutex> lock(mu_);
+    if (closed_ || items_.size() >= capacity_) {
+      if (version) *version = version_;
+      return false;
+    }
+    items_.push_back(std::move(x));
+    not_empty_.notify_one();
+    Changed(&lock);
+    return true;
+  }
+
+  bool TryPop(T* x, uint64_t* version = nullptr) {
+    std::unique_lock<std::mutex> lock(mu_);
+    if (items_.empty()) {
+      if (version) *version = version_;
+      return false;
+    }
+    *x = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    Changed(&lock);
+    return true;
+  }
+
+  // Closes the buffer. Later pushes fail; pops drain what is left.
+  void Close() {
+    std::unique_lock<std::mutex> lock(mu_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+    Changed(&lock);
+  }
+
+  // Calls wake once, on whatever thread next pushes or pops a value or
+  // closes the buffer. Returns false, and does not keep wake, if the
+  // buffer is closed or has changed since it was at version. Lets a
+  // task that cannot push or pop wait without holding a thread.
+  bool Watch(uint64_t version, std::function<void()> wake) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (closed_ || version_ != version) {
+      return false;
+    }
+    watchers_.push_back(std::move(wake));
+    return true;
+  }
+
+  bool closed() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return closed_;
+  }
+
+  size_t capacity() const { return capacity_; }
+
+private:
+  // Counts a change, and wakes the watchers, outside the lock.
+  void Changed(std::unique_lock<std::mutex>* lock) {
+    ++version_;
+    if (watchers_.empty()) {
+      return;
+    }
+    std::vector<std::function<void()>> watchers;
+    watchers.swap(watchers_);
+    lock->unlock();
+    for (auto& wake : watchers) {
+      wake();
+    }
+  }
+
+  const size_t capacity_;
+  mutable std::mutex mu_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<T> items_;
+  bool closed_;
+  uint64_t version_;  // Counts pushes, pops and closing.
+  std::vector<std::function<void()>> watchers_;
+};
+
+// Runs a function on a new thread that feeds a buffer, and joins the
+// thread when destroyed. If the function throws, the buffer is closed
+// and the exception is rethrown by Join().
+class _Feeder {
+public:
+  template <typename F, typename T>
+  _Feeder(const F& feed, Buffer<T>* buffer)
+      : thread_([this, feed, buffer] {
+          try {
+            feed();
+          } catch (...) {
+            error_ = std::current_exception();
+          }
+          buffer->Close();
+        }) {}
+  ~_Feeder() {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  void Join() {
+    thread_.join();
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+private:
+  std::exception_ptr error_;
+  std::thread thread_;
+};
+
+// Prefetching a producer runs it on a separate thread, up to capacity
+// values ahead of the consumer. Exceptions thrown by the producer are
+// rethrown to the consumer. If the consumer throws, the rest of the
+// producer's values are dropped.
+template <typename T>
+Producer<T> Prefetch(const Producer<T>& p, size_t capacity) {
+  return [=](const Consumer<T>& c) {
+    Buffer<T> buffer(capacity);
+    _Feeder feeder([&] { p([&](T x) { buffer.Push(std::move(x)); }); },
+                   &buffer);
+    struct Closer {
+      Buffer<T>* buffer;
+      ~Closer() { buffer->Close(); }
+    } closer{&buffer};
+    T x;
+    while (buffer.Pop(&x)) {
+      c(std::move(x));
+    }
+    feeder.Join();
+  };
+}
+
+#endif  // BUFFER_H_
@@ -0,0 +1,85 @@
+// Tests for bounded buffers.
+
+#include "buffer.h"
+
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::vector;
+
+TEST(Buffer, HandsValuesBetweenThreads) {
+  Buffer<int> buffer(2);
+  std::thread producer([&] {
+    for (int i = 0; i < 1000; ++i) {
+      ASSERT_TRUE(buffer.Push(i));
+    }
+    buffer.Close();
+  });
+  vector<int> values;
+  int x;
+  while (buffer.Pop(&x)) {
+    values.push_back(x);
+  }
+  producer.join();
+  ASSERT_EQ(1000u, values.size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(i, values[i]);
+  }
+}
+
+TEST(Buffer, TryPushAndTryPopNeverWait) {
+  Buffer<int> buffer(1);
+  int x;
+  EXPECT_FALSE(buffer.TryPop(&x));
+  EXPECT_TRUE(buffer.TryPush(1));
+  EXPECT_FALSE(buffer.TryPush(2));
+  buffer.Close();
+  EXPECT_FALSE(buffer.Push(3));
+  EXPECT_TRUE(buffer.TryPop(&x));
+  EXPECT_EQ(1, x);
+  EXPECT_FALSE(buffer.Pop(&x));
+}
+
+TEST(Buffer, PrefetchMustPreserveValues) {
+  Producer<int> ints = [](const Consumer<int>& c) {
+    for (int i = 0; i < 100; ++i) {
+      c(i);
+    }
+  };
+  vector<int> expected, prefetched;
+  ints([&](int i) { expected.push_back(i); });
+  Prefetch(ints, 3)([&](int i) { prefetched.push_back(i); });
+  EXPECT_EQ(expected, prefetched);
+}
+
+TEST(Buffer, PrefetchMustPropagateExceptions) {
+  Producer<int> failing = [](const Consumer<int>& c) {
+    c(1);
+    throw std::runtime_error("producer failed");
+  };
+  vector<int> values;
+  EXPECT_THROW(Prefetch(failing, 3)([&](int i) { values.push_back(i); }),
+               std::runtime_error);
+  EXPECT_EQ(vector<int>({1}), values);
+
+  Producer<int> endless = [](const Consumer<int>& c) {
+    for (int i = 0; i < 100000; ++i) {
+      c(i);
+    }
+  };
+  EXPECT_THROW(Prefetch(endless, 3)([](int i) {
+                 if (i == 10) throw std::logic_error("consumer failed");
+               }),
+               std::logic_error);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
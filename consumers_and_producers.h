@@ -3,10 +3,14 @@
 #ifndef CONSUMERS_AND_PRODUCERS_H_
 #define CONSUMERS_AND_PRODUCERS_H_
 
+#include <cstddef>
 #include <functional>
+#include <memory>
+#include <memory_resource>
 #include <tuple>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 
 //==============================================================================
@@ -38,30 +42,37 @@ struct _TupleHelper {
     };
   }
 
-  // Convert a function that accepts a series of arguments into
-  // a function that accepts those arguments as a tuple.
   // Case 1: The function already accepts a tuple: return it as is.
+  // (This case is preferred, for single-element tuples can be called
+  // either way.)
   template <typename F, typename... Types,
             typename = decltype(std::declval<F>()(
                 std::declval<std::tuple<Types...>>()))>
-  static F Uncurry(F f) {
+  static F _Uncurry(F f, int) {
     return f;
   }
   // Case 2: wrap the function within with logic that unpacks
   // an argument tuple.
   template <typename F, typename... Types,
             typename R = decltype(std::declval<F>()(std::declval<Types>()...))>
-  static std::function<R(std::tuple<Types...>)> Uncurry(F f) {
+  static std::function<R(std::tuple<Types...>)> _Uncurry(F f, long) {
     return _UncurryIndexed(typename gens<sizeof...(Types)>::type(),
                            type_pack<R, Types...>(),
 			   f);
   }
 
+  // Convert a function that accepts a series of arguments into
+  // a function that accepts those arguments as a tuple.
+  template <typename F, typename... Types>
+  static auto Uncurry(F f) -> decltype(_Uncurry<F, Types...>(f, 0)) {
+    return _Uncurry<F, Types...>(f, 0);
+  }
+
   template <typename F, typename... Funs, typename... Vals, int... Indices,
 	    typename R = decltype(std::declval<F>()(
 		std::declval<Funs>()(std::declval<Vals>())...))>
   static R _ApplyElementwiseIndexed(
-      F f, seq<Indices...>, std::tuple<Vals...> tup, Funs... funs) {
+      F f, seq<Indices...>, std::tuple<Vals...> tup, const Funs&... funs) {
     return f(funs(std::get<Indices>(tup))...);
   }
 
@@ -70,7 +81,8 @@ struct _TupleHelper {
   template <typename F, typename... Funs, typename... Vals,
 	    typename R = decltype(std::declval<F>()(
 		std::declval<Funs>()(std::declval<Vals>())...))>
-  static R ApplyElementwise(F f, std::tuple<Vals...> tup, Funs... funs) {
+  static R ApplyElementwise(F f, std::tuple<Vals...> tup,
+                           const Funs&... funs) {
     return _ApplyElementwiseIndexed(f, typename gens<sizeof...(Vals)>::type(),
 				    tup, funs...);
   }
@@ -83,16 +95,122 @@ struct _TupleHelper {
 // Let's introduce a lightweight notation for function types.
 template <typename A, typename B> using Fn = std::function<B(A)>;
 
+// Pipeline nodes are allocated from the current thread's memory
+// resource, which is the global heap unless a MemoryResourceScope says
+// otherwise. Short-lived pipelines can thus be built, and run, in an
+// arena such as a std::pmr::monotonic_buffer_resource and released in
+// one go. The resource must outlive every pipeline built in it.
+inline std::pmr::memory_resource*& _CurrentMemoryResource() {
+  static thread_local std::pmr::memory_resource* resource =
+      std::pmr::new_delete_resource();
+  return resource;
+}
+
+inline std::pmr::memory_resource* CurrentMemoryResource() {
+  return _CurrentMemoryResource();
+}
+
+// Makes a resource the current thread's for as long as it is in scope.
+class MemoryResourceScope {
+public:
+  explicit MemoryResourceScope(std::pmr::memory_resource* resource)
+      : previous_(_CurrentMemoryResource()) {
+    _CurrentMemoryResource() = resource;
+  }
+  ~MemoryResourceScope() { _CurrentMemoryResource() = previous_; }
+  MemoryResourceScope(const MemoryResourceScope&) = delete;
+  MemoryResourceScope& operator=(const MemoryResourceScope&) = delete;
+private:
+  std::pmr::memory_resource* previous_;
+};
+
+// An allocator that draws from a memory resource. Unlike
+// std::pmr::polymorphic_allocator, it constructs values plainly,
+// without passing itself on to allocator-aware members (which would
+// otherwise, e.g., offer it to the producers in a std::tuple).
+template <typename T>
+struct _ResourceAllocator {
+  typedef T value_type;
+  explicit _ResourceAllocator(std::pmr::memory_resource* r) : resource(r) {}
+  template <typename U>
+  _ResourceAllocator(const _ResourceAllocator<U>& that)
+      : resource(that.resource) {}
+  T* allocate(size_t n) {
+    return static_cast<T*>(resource->allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T* p, size_t n) {
+    resource->deallocate(p, n * sizeof(T), alignof(T));
+  }
+  template <typename U>
+  bool operator==(const _ResourceAllocator<U>& that) const {
+    return resource == that.resource;
+  }
+  template <typename U>
+  bool operator!=(const _ResourceAllocator<U>& that) const {
+    return resource != that.resource;
+  }
+  std::pmr::memory_resource* resource;
+};
+
+// Consumers and producers are immutable, and hold their functions
+// through shared, reference-counted nodes. Copying one, however deeply
+// composed, is O(1), and every copy shares the same underlying node.
+template <typename F>
+std::shared_ptr<const F> _Share(const F& f) {
+  return std::allocate_shared<F>(
+      _ResourceAllocator<F>(_CurrentMemoryResource()), f);
+}
+
+// A node holding a callable of any type. Unlike a std::function, which
+// would allocate a second time for any but the smallest callables, the
+// callable is stored inline in the node.
+//
+// Copies of a consumer or producer share its node, and may run on
+// different threads, so the callable must be callable as const: a
+// mutable lambda, whose state every copy would share, is rejected.
+// Callables that keep state should keep it outside the closure, e.g.
+// in a fresh producer per run.
+template <typename Sig> class _Callable;
+template <typename R, typename... Args>
+class _Callable<R(Args...)> {
+public:
+  virtual ~_Callable() {}
+  virtual R operator()(Args... args) const = 0;
+};
+
+template <typename F, typename Sig> class _CallableNode;
+template <typename F, typename R, typename... Args>
+class _CallableNode<F, R(Args...)> : public _Callable<R(Args...)> {
+  static_assert(std::is_invocable_r<R, const F&, Args...>::value,
+                "consumers and producers need callables that are const; "
+                "keep mutable state outside the closure");
+public:
+  explicit _CallableNode(const F& f) : f_(f) {}
+  R operator()(Args... args) const override {
+    return f_(std::forward<Args>(args)...);
+  }
+private:
+  const F f_;
+};
+
+template <typename Sig, typename F>
+std::shared_ptr<const _Callable<Sig>> _MakeCallable(const F& f) {
+  return std::allocate_shared<_CallableNode<F, Sig>>(
+      _ResourceAllocator<_CallableNode<F, Sig>>(_CurrentMemoryResource()),
+      f);
+}
+
 // A consumer is a value sink. It can be called on values of type T
 // to consume them.
 template <typename T>
 class Consumer {
 public:
   typedef T value_type;
-  template <typename F> Consumer(const F& f) : f_(f) {}
-  void operator()(value_type t) const { f_(t); }
+  template <typename F> Consumer(const F& f)
+      : f_(_MakeCallable<void(value_type)>(f)) {}
+  void operator()(value_type t) const { (*f_)(t); }
 private:
-  Fn<value_type, void> f_;
+  std::shared_ptr<const _Callable<void(value_type)>> f_;
 };
 
 // Specialize tuple consumers to let them also be constructed from
@@ -102,10 +220,11 @@ class Consumer<std::tuple<Types...>> {
 public:
   typedef std::tuple<Types...> value_type;
   template <typename F> Consumer(const F& f)
-      : f_(_TupleHelper::Uncurry<F, Types...>(f)) {}
-  void operator()(value_type t) const { f_(t); }
+      : f_(_MakeCallable<void(value_type)>(
+            _TupleHelper::Uncurry<F, Types...>(f))) {}
+  void operator()(value_type t) const { (*f_)(t); }
 private:
-  Fn<value_type, void> f_;
+  std::shared_ptr<const _Callable<void(value_type)>> f_;
 };
 
 // A producer is a value source. It can be called on a corresponding
@@ -116,13 +235,17 @@ template <typename T>
 class Producer {
 public:
   typedef T value_type;
-  template <typename F> Producer(const F& f) : f_(f) {}
-  void operator()(Consumer<T> c) const { f_(c); }
+  template <typename F> Producer(const F& f)
+      : f_(_MakeCallable<void(const Consumer<T>&)>(f)) {}
+  void operator()(const Consumer<T>& c) const { (*f_)(c); }
 private:
-  Fn<const Consumer<T>&, void> f_;
+  std::shared_ptr<const _Callable<void(const Consumer<T>&)>> f_;
 };
 
-// A filter takes an A and from it produces Bs.
+// A filter takes an A and from it produces Bs. Filters are plain
+// functions; the combinators below capture their filter operands in
+// shared nodes, so copying a composed filter copies only its
+// outermost closure.
 template <typename A, typename B> using Filter = Fn<A, Producer<B>>;
 //
 // Filters are the building blocks of most pipelines. As we will see
@@ -153,6 +276,15 @@ Effect Fuse(const Producer<T>& p, const Consumer<T>& c) {
   return [=] { p(c); };
 }
 
+// An effect that runs another with a resource made current, so that
+// whatever the pipeline builds as it runs is allocated from it.
+inline Effect RunIn(std::pmr::memory_resource* resource, const Effect& e) {
+  return [=] {
+    MemoryResourceScope scope(resource);
+    e();
+  };
+}
+
 // Producer composition is value serial and forms a monoid:
 //   PZero()(c)          === { Empty effect }
 //   (PZero() + p)(c)    === p(c)
@@ -185,6 +317,64 @@ Consumer<T> operator+(const Consumer<T>& c1, const Consumer<T>& c2) {
   return [=](T t) { c1(t); c2(t); };
 }
 
+// The n-ary forms of composition, for when there are many operands.
+// Folding n operands with (+) nests n closures, each holding a copy of
+// everything to its left; these instead hold the operands side by side
+// and run them in a flat loop.
+//   PConcat({p1, ..., pn})(c) === (p1 + ... + pn)(c)
+//   p(CFanout({c1, ..., cn})) === p(c1 + ... + cn)
+template <typename T>
+Producer<T> PConcat(std::vector<Producer<T>> ps) {
+  return [ps = std::move(ps)](const Consumer<T>& c) {
+    for (const auto& p : ps) {
+      p(c);
+    }
+  };
+}
+
+template <typename T>
+Consumer<T> CFanout(std::vector<Consumer<T>> cs) {
+  return [cs = std::move(cs)](T t) {
+    for (const auto& c : cs) {
+      c(t);
+    }
+  };
+}
+
+// Where (+) and CFanout send every value to every consumer, Partition
+// and Route send each value to exactly one, having looked at it once.
+// Partition(pred, ct, cf) passes the values that satisfy pred to ct
+// and the others to cf, testing each value once.
+template <typename T, typename Pred>
+Consumer<T> Partition(const Pred& pred, const Consumer<T>& c_true,
+                      const Consumer<T>& c_false) {
+  return [=](T t) {
+    if (pred(t)) {
+      c_true(t);
+    } else {
+      c_false(t);
+    }
+  };
+}
+
+// Routes each value to the consumer whose index the selector returns,
+// through a table of consumers. Values routed out of range are dropped.
+template <typename T, typename Selector>
+Consumer<T> Route(const Selector& selector, std::vector<Consumer<T>> cs) {
+  return [=, cs = std::move(cs)](T t) {
+    size_t i = static_cast<size_t>(selector(t));
+    if (i < cs.size()) {
+      cs[i](t);
+    }
+  };
+}
+
+template <typename T, typename Selector, typename... Consumers>
+Consumer<T> Route(const Selector& selector, const Consumer<T>& c0,
+                  const Consumers&... cs) {
+  return Route(selector, std::vector<Consumer<T>>{c0, Consumer<T>(cs)...});
+}
+
 // Producers are functors (i.e., value containers supporting a map function).
 template <typename A, typename B>
 Producer<B> Fmap(const Fn<A, B>& f, const Producer<A>& p) {
@@ -214,9 +404,15 @@ Producer<A> PJoin(Producer<Producer<A>> p_PA) {
   };
 }
 
+// Law: PBind(p, f) === PJoin(Fmap(f, p)). Binding directly saves the
+// intermediate producer of producers and the consumer PJoin makes for
+// it on every run.
 template <typename A, typename B>
 Producer<B> PBind(const Producer<A>& p, const Filter<A, B>& f) {
-  return PJoin(Fmap(f, p));
+  auto f_node = _Share(f);
+  return [=](const Consumer<B>& c) {
+    p([&](A x) { (*f_node)(x)(c); });
+  };
 }
 
 // Infix version of bind.
@@ -279,7 +475,14 @@ Producer<std::tuple<Args...>> PCross(Producer<Args>... ps) {
 // underlying Producer monad.)
 template <typename A, typename B, typename C>
 Filter<A, C> KleisliComposition(const Filter<A, B>& f, const Filter<B, C>& g) {
-  return [=](A x) { return f(x) | g; };
+  auto f_node = _Share(f);
+  auto g_node = _Share(g);
+  return [=](A x) -> Producer<C> {
+    Producer<B> p = (*f_node)(x);
+    return [=](const Consumer<C>& c) {
+      p([&](B y) { (*g_node)(y)(c); });
+    };
+  };
 }
 
 // The infix version of KleisliComposition is used to chain filters.
@@ -293,7 +496,9 @@ Filter<A, C> operator*(const Filter<A, B>& f, const Filter<B, C>& g) {
 // Law: (filter1 + filter2)(x) = filter1(x) + filter2(x)
 template <typename A, typename B>
 Filter<A, B> operator+(const Filter<A, B>& f, const Filter<A, B>& g) {
-  return [=](A x) { return f(x) + g(x); };
+  auto f_node = _Share(f);
+  auto g_node = _Share(g);
+  return [=](A x) { return (*f_node)(x) + (*g_node)(x); };
 }
 
 // Some more template boilerplate, to prepare for filter cross products.
@@ -320,11 +525,14 @@ template <
   typename In = std::tuple<typename _filter_input<FilterTypes>::type...>,
   typename Out = _filter_outputs_product<FilterTypes...> >
 Filter<In, Out> FCross(FilterTypes... filters) {
+  auto nodes = _Share(std::make_tuple(filters...));
   return [=](const In& tup) {
-    return _TupleHelper::ApplyElementwise(
-	PCross<typename FilterTypes::result_type::value_type...>,
-	tup,
-	filters...);
+    return std::apply([&](const FilterTypes&... fs) {
+      return _TupleHelper::ApplyElementwise(
+	  PCross<typename FilterTypes::result_type::value_type...>,
+	  tup,
+	  fs...);
+    }, *nodes);
   };
 }
 
@@ -335,8 +543,159 @@ template <typename... FilterTypes>
 Filter<_common_filter_input<FilterTypes...>,
        _filter_outputs_product<FilterTypes...> >
 FFork(FilterTypes... filters) {
+  auto nodes = _Share(std::make_tuple(filters...));
+  return [=](const _common_filter_input<FilterTypes...>& x) {
+    return std::apply([&](const FilterTypes&... fs) {
+      return PCross(fs(x)...);
+    }, *nodes);
+  };
+}
+
+// By-reference cross products. PCross and FFork copy every value into
+// the tuples they emit, which suits consumers that store them. For
+// consumers that merely look, PCrossRef and FForkRef instead emit
+// tuples of references to the values as the producers passed them,
+// valid only while the consumer runs. The loops are nested directly,
+// with one consumer per level built once per run.
+// Law: PCrossRef(p, q)(c) === PCross(p, q)(c), for consumers c that
+//      do not hold on to their tuples.
+template <typename T>
+using _Ref = const typename std::decay<T>::type&;
+
+template <typename... Args>
+using RefTuple = std::tuple<_Ref<Args>...>;
+
+// Builds the consumer for level I of the nest, whose values are the
+// I-th elements of the tuples, and passes it to then.
+template <size_t I, typename Ps, typename Ptrs, typename Row, typename Then>
+void _CrossRefLevel(const Ps& ps, Ptrs* ptrs, const Consumer<Row>& c,
+                    const Then& then) {
+  typedef typename std::tuple_element<I, Ps>::type::value_type T;
+  if constexpr (I + 1 == std::tuple_size<Ps>::value) {
+    Consumer<T> last = [&](_Ref<T> x) {
+      std::get<I>(*ptrs) = &x;
+      std::apply([&](auto*... xs) { c(Row(*xs...)); }, *ptrs);
+    };
+    then(last);
+  } else {
+    typedef typename std::tuple_element<I + 1, Ps>::type::value_type U;
+    _CrossRefLevel<I + 1>(ps, ptrs, c, [&](const Consumer<U>& next) {
+      Consumer<T> level = [&](_Ref<T> x) {
+        std::get<I>(*ptrs) = &x;
+        std::get<I + 1>(ps)(next);
+      };
+      then(level);
+    });
+  }
+}
+
+template <typename... Args>
+Producer<RefTuple<Args...>> PCrossRef(Producer<Args>... ps) {
+  static_assert(sizeof...(Args) > 0, "PCrossRef needs a producer");
+  typedef RefTuple<Args...> Row;
+  auto nodes = _Share(std::make_tuple(ps...));
+  return [=](const Consumer<Row>& c) {
+    std::tuple<typename std::decay<Args>::type const*...> ptrs;
+    _CrossRefLevel<0>(*nodes, &ptrs, c, [&](const auto& first) {
+      std::get<0>(*nodes)(first);
+    });
+  };
+}
+
+// Law: FForkRef(g, h)(x) === PCrossRef(g(x), h(x))
+template <typename... FilterTypes>
+Filter<_common_filter_input<FilterTypes...>,
+       RefTuple<typename FilterTypes::result_type::value_type...> >
+FForkRef(FilterTypes... filters) {
+  auto nodes = _Share(std::make_tuple(filters...));
   return [=](const _common_filter_input<FilterTypes...>& x) {
-    return PCross(filters(x)...);
+    return std::apply([&](const FilterTypes&... fs) {
+      return PCrossRef(fs(x)...);
+    }, *nodes);
+  };
+}
+
+//==============================================================================
+// STREAMING FILTERS
+//==============================================================================
+
+// A consumer reference is a non-owning, non-allocating reference to a
+// callable that consumes Ts. It must not outlive what it refers to.
+template <typename T>
+class ConsumerRef {
+public:
+  template <typename F, typename = typename std::enable_if<
+                          !std::is_same<F, ConsumerRef>::value>::type>
+  ConsumerRef(const F& f) : obj_(&f), call_(&Call<F>) {}
+  ConsumerRef(const ConsumerRef&) = default;
+  void operator()(T x) const { call_(obj_, std::forward<T>(x)); }
+private:
+  template <typename F>
+  static void Call(const void* obj, T x) {
+    (*static_cast<const F*>(obj))(std::forward<T>(x));
+  }
+  const void* obj_;
+  void (*call_)(const void*, T);
+};
+
+// A streaming filter is a filter in "consumer transformer" form: rather
+// than returning a producer of the Bs it makes from an A, it writes
+// them straight into a downstream consumer. Binding and chaining
+// streaming filters thus allocates nothing per value, whereas every
+// call of an ordinary filter allocates the producer it returns.
+template <typename A, typename B>
+using StreamFilter = std::function<void(A, ConsumerRef<B>)>;
+
+// Streaming filters and ordinary ones convert into each other.
+template <typename A, typename B>
+StreamFilter<A, B> Streaming(const Filter<A, B>& f) {
+  auto f_node = _Share(f);
+  return [=](A x, ConsumerRef<B> c) { (*f_node)(x)([&](B y) { c(y); }); };
+}
+
+template <typename A, typename B>
+Filter<A, B> AsFilter(const StreamFilter<A, B>& f) {
+  auto f_node = _Share(f);
+  return [=](A x) -> Producer<B> {
+    return [=](const Consumer<B>& c) { (*f_node)(x, c); };
+  };
+}
+
+// Laws, for a streaming filter s of ordinary filter f:
+//   p | s                 === p | AsFilter(s)
+//   s1 * s2               === Streaming(AsFilter(s1) * AsFilter(s2))
+//   s1 + s2               === Streaming(AsFilter(s1) + AsFilter(s2))
+template <typename A, typename B>
+Producer<B> PBind(const Producer<A>& p, const StreamFilter<A, B>& f) {
+  auto f_node = _Share(f);
+  return [=](const Consumer<B>& c) {
+    p([&](A x) { (*f_node)(x, c); });
+  };
+}
+
+template <typename A, typename B>
+Producer<B> operator|(const Producer<A>& p, const StreamFilter<A, B>& f) {
+  return PBind(p, f);
+}
+
+template <typename A, typename B, typename C>
+StreamFilter<A, C> operator*(const StreamFilter<A, B>& f,
+                             const StreamFilter<B, C>& g) {
+  auto f_node = _Share(f);
+  auto g_node = _Share(g);
+  return [=](A x, ConsumerRef<C> c) {
+    (*f_node)(x, [&](B y) { (*g_node)(y, c); });
+  };
+}
+
+template <typename A, typename B>
+StreamFilter<A, B> operator+(const StreamFilter<A, B>& f,
+                             const StreamFilter<A, B>& g) {
+  auto f_node = _Share(f);
+  auto g_node = _Share(g);
+  return [=](A x, ConsumerRef<B> c) {
+    (*f_node)(x, c);
+    (*g_node)(x, c);
   };
 }
 
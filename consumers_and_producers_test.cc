@@ -2,7 +2,10 @@
 
 #include "consumers_and_producers.h"
 
+#include <algorithm>
+#include <cstdlib>
 #include <functional>
+#include <memory_resource>
 #include <utility>
 #include <vector>
 
@@ -10,6 +13,33 @@
 
 using std::vector;
 
+namespace {
+
+// A memory resource that counts its allocations, to check which
+// combinators allocate nodes.
+class CountingResource : public std::pmr::memory_resource {
+public:
+  size_t allocations = 0;
+  size_t live = 0;
+private:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    ++allocations;
+    ++live;
+    alignment = std::max(alignment, sizeof(void*));
+    return std::aligned_alloc(alignment,
+                              (bytes + alignment - 1) / alignment * alignment);
+  }
+  void do_deallocate(void* p, size_t, size_t) override {
+    --live;
+    std::free(p);
+  }
+  bool do_is_equal(const memory_resource& that) const noexcept override {
+    return this == &that;
+  }
+};
+
+}  // namespace
+
 template<typename T>
 Producer<T> Produce(vector<T> ts) {
   return {
@@ -91,6 +121,183 @@ TEST_F(CPTest, ProducerMustObeyMonoidLaws) {
   }
 }
 
+TEST_F(CPTest, NAryCompositionMustMatchFoldedComposition) {
+  EXPECT_EQ(Fusing(PZero<Value>(), consumers_[1]),
+            Fusing(PConcat<Value>({}), consumers_[1]));
+  EXPECT_EQ(Fusing(producers_[2], CZero<Value>()),
+            Fusing(producers_[2], CFanout<Value>({})));
+  for (const auto& p : producers_) {
+    for (const auto& c : consumers_) {
+      for (const auto& p1 : producers_) {
+        for (const auto& p2 : producers_) {
+          EXPECT_EQ(Fusing(p + p1 + p2, c),
+                    Fusing(PConcat<Value>({p, p1, p2}), c));
+        }
+      }
+      for (const auto& c1 : consumers_) {
+        for (const auto& c2 : consumers_) {
+          EXPECT_EQ(Fusing(p, c + c1 + c2),
+                    Fusing(p, CFanout<Value>({c, c1, c2})));
+        }
+      }
+    }
+  }
+  // Hundreds of operands are no trouble.
+  vector<Producer<Value>> many(500, producers_[1]);
+  EXPECT_EQ(500u, Fusing(PConcat(many), consumers_[1]).size());
+}
+
+namespace {
+
+// A filter that counts how many times it has been copied.
+struct CountingFilter {
+  explicit CountingFilter(int* copies) : copies(copies) {}
+  CountingFilter(const CountingFilter& that) : copies(that.copies) {
+    ++*copies;
+  }
+  Producer<int> operator()(int x) const { return PUnit(x + 1); }
+  int* copies;
+};
+
+}  // namespace
+
+TEST(SharedNodes, CopyingComposedFiltersDoesNotCopyTheirParts) {
+  int copies = 0;
+  Filter<int, int> leaf = CountingFilter(&copies);
+  Filter<int, int> pipeline = leaf;
+  for (int i = 0; i < 100; ++i) {
+    pipeline = i % 3 == 0 ? pipeline * leaf :
+               i % 3 == 1 ? pipeline + leaf :
+               Filter<int, int>(FFork(pipeline, leaf) *
+                   Filter<std::tuple<int, int>, int>(
+                       [](std::tuple<int, int> t) {
+                         return PUnit(std::get<0>(t));
+                       }));
+  }
+  // Building the pipeline copies the leaf once per use, not once per
+  // use per level of nesting.
+  EXPECT_LE(copies, 400);
+  Producer<int> p = pipeline(0);
+  copies = 0;
+  vector<Filter<int, int>> copied(1000, pipeline);
+  vector<Producer<int>> producers(1000, p);
+  EXPECT_EQ(0, copies);
+  int n = 0;
+  producers.back()([&](int) { ++n; });
+  EXPECT_GT(n, 0);
+}
+
+TEST(StreamFilters, MatchOrdinaryFilters) {
+  StreamFilter<int, int> twice = [](int x, ConsumerRef<int> c) {
+    c(x);
+    c(x);
+  };
+  StreamFilter<int, int> plus_ten = [](int x, ConsumerRef<int> c) {
+    c(x + 10);
+  };
+  Filter<int, int> twice_f = AsFilter(twice);
+  Filter<int, int> plus_ten_f = AsFilter(plus_ten);
+  auto p = Produce<int>({1, 2, 3});
+  auto collect = [](const Producer<int>& q) {
+    vector<int> xs;
+    q([&](int x) { xs.push_back(x); });
+    return xs;
+  };
+  EXPECT_EQ(collect(p | twice_f), collect(p | twice));
+  EXPECT_EQ(collect(p | (twice_f * plus_ten_f)),
+            collect(p | (twice * plus_ten)));
+  EXPECT_EQ(collect(p | (twice_f + plus_ten_f)),
+            collect(p | (twice + plus_ten)));
+  EXPECT_EQ(collect(p | twice_f * plus_ten_f),
+            collect(p | Streaming(twice_f * plus_ten_f)));
+  EXPECT_EQ((vector<int>{11, 11, 12, 12, 13, 13}),
+            collect(p | twice * plus_ten));
+}
+
+TEST(StreamFilters, ChainWithoutAllocatingPerValue) {
+  vector<int> xs(1000, 1);
+  auto p = Produce<int>(xs);
+  StreamFilter<int, int> s = [](int x, ConsumerRef<int> c) { c(x + 1); };
+  Filter<int, int> f = [](int x) { return PUnit(x + 1); };
+  int sum = 0;
+  Consumer<int> add = [&](int x) { sum += x; };
+  CountingResource resource;
+  MemoryResourceScope scope(&resource);
+
+  auto streaming = p | s * s * s;
+  size_t before = resource.allocations;
+  streaming(add);
+  EXPECT_LT(resource.allocations - before, 10u);
+  EXPECT_EQ(4000, sum);
+
+  auto ordinary = p | f * f * f;
+  before = resource.allocations;
+  ordinary(add);
+  EXPECT_GE(resource.allocations - before, 1000u);
+  EXPECT_EQ(8000, sum);
+}
+
+TEST(MemoryResources, PipelinesAreBuiltAndRunInTheCurrentResource) {
+  CountingResource resource;
+  int sum = 0;
+  {
+    Effect run;
+    {
+      MemoryResourceScope scope(&resource);
+      vector<Producer<int>> parts;
+      parts.reserve(100);
+      for (int i = 1; i <= 100; ++i) {
+        parts.push_back(PUnit(i) + PZero<int>());
+      }
+      Producer<int> p = PConcat(parts);
+      Consumer<int> c = [&sum](int x) { sum += x; };
+      p(c);
+      run = Fuse(p, c);
+    }
+    EXPECT_GT(resource.allocations, 300u);
+    EXPECT_EQ(std::pmr::new_delete_resource(), CurrentMemoryResource());
+
+    // Effects can also run in a resource.
+    size_t nodes = resource.allocations;
+    RunIn(&resource, [&] {
+      EXPECT_EQ(static_cast<std::pmr::memory_resource*>(&resource),
+                CurrentMemoryResource());
+      Consumer<int> c = [](int) {};
+      run();
+    })();
+    EXPECT_EQ(nodes + 1, resource.allocations);
+  }
+  EXPECT_EQ(2 * 5050, sum);
+  EXPECT_EQ(0u, resource.live);
+}
+
+TEST(Routing, SendsEachValueToExactlyOneConsumer) {
+  vector<int> evens, odds;
+  int tests = 0;
+  auto p = Produce<int>({1, 2, 3, 4, 5});
+  p(Partition([&](int x) { ++tests; return x % 2 == 0; },
+              Consumer<int>([&](int x) { evens.push_back(x); }),
+              Consumer<int>([&](int x) { odds.push_back(x); })));
+  EXPECT_EQ((vector<int>{2, 4}), evens);
+  EXPECT_EQ((vector<int>{1, 3, 5}), odds);
+  EXPECT_EQ(5, tests);
+
+  vector<vector<int>> routed(3);
+  int selections = 0;
+  auto to = [&](size_t i) {
+    return Consumer<int>([&routed, i](int x) { routed[i].push_back(x); });
+  };
+  Produce<int>({0, 1, 2, 3, 4, 5, 6, 7})(
+      Route([&](int x) { ++selections; return x % 4; }, to(0), to(1), to(2)));
+  EXPECT_EQ((vector<vector<int>>{{0, 4}, {1, 5}, {2, 6}}), routed);
+  EXPECT_EQ(8, selections);  // Values routed out of range are dropped.
+
+  routed.assign(3, {});
+  Produce<int>({5, 6, 7})(
+      Route([](int x) { return x - 5; }, vector<Consumer<int>>{to(2), to(0)}));
+  EXPECT_EQ((vector<vector<int>>{{6}, {}, {5}}), routed);
+}
+
 // Monad laws.
 //   Left identity:   return a >>= f  ≡ f a
 //   Right identity:  m >>= return    ≡ m
@@ -201,6 +408,57 @@ TEST_F(CPTest, ProducersAndFiltersMustSupportCrossProducts) {
   FCross(f123, fabc);
 }
 
+TEST_F(CPTest, ReferenceCrossProductsMustMatchCrossProducts) {
+  vector<std::string> names = {"ann", "bob"};
+  vector<int> numbers = {1, 2, 3};
+  Producer<const std::string&> produce_names =
+      [&](const Consumer<const std::string&>& c) {
+        for (const auto& name : names) c(name);
+      };
+  Producer<int> produce_numbers = Produce<int>(numbers);
+
+  using T = std::tuple<std::string, int>;
+  vector<T> by_value, by_ref;
+  // PCross builds its tuples from the values it is given, so the
+  // expected products come from a producer of copies: a PCross of a
+  // producer of references would hold on to dangling ones.
+  PCross(Produce<std::string>(names), produce_numbers)(
+      [&](const std::string& s, int n) { by_value.emplace_back(s, n); });
+  int aliased = 0;
+  PCrossRef(produce_names, produce_numbers)(
+      [&](const std::string& s, const int& n) {
+        aliased += &s == &names[0] || &s == &names[1];
+        by_ref.emplace_back(s, n);
+      });
+  EXPECT_EQ(by_value, by_ref);
+  EXPECT_EQ(6, aliased);  // The names were never copied.
+
+  // Three-way products, and products of one.
+  vector<std::tuple<int, int, int>> triples;
+  PCrossRef(produce_numbers, produce_numbers, produce_numbers)(
+      [&](const int& a, const int& b, const int& c) {
+        triples.emplace_back(a, b, c);
+      });
+  EXPECT_EQ(27u, triples.size());
+  EXPECT_EQ(std::make_tuple(2, 1, 3), triples[9 + 2]);
+  int count = 0;
+  PCrossRef(produce_numbers)([&](std::tuple<const int&>) { ++count; });
+  EXPECT_EQ(3, count);
+  PCrossRef(produce_numbers, PZero<int>())([&](RefTuple<int, int>) {
+    FAIL();
+  });
+
+  // Forked reference products.
+  Filter<int, const std::string&> f_names = [&](int) {
+    return produce_names;
+  };
+  Filter<int, int> f_numbers = [&](int) { return produce_numbers; };
+  by_ref.clear();
+  FForkRef(f_names, f_numbers)(0)(
+      [&](const std::string& s, const int& n) { by_ref.emplace_back(s, n); });
+  EXPECT_EQ(by_value, by_ref);
+}
+
 
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,247 @@
+// Streaming decompression of producers of byte chunks.  -*- c++ -*-
+//
+// Decompress(chunks) turns a producer of compressed byte chunks into
+// a producer of decompressed ones. Decompression runs on a separate
+// thread, a few chunks ahead of the consumer, so it overlaps with
+// whatever parsing the consumer does. Output chunks are written into
+// a small pool of buffers that are recycled once the consumer is done
+// with them; thus, as for the other chunk and line producers, each
+// chunk is valid only while the consumer it was passed to is running.
+//
+// gzip (and zlib) streams are decompressed with zlib. zstd streams
+// are decompressed with libzstd when it is available at build time,
+// i.e., when <zstd.h> can be included; link with -lz and, for zstd,
+// -lzstd.
+
+#ifndef DECOMPRESS_H_
+#define DECOMPRESS_H_
+
+#include <zlib.h>
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define PIPELINES_HAVE_ZSTD 1
+#endif
+
+#include "buffer.h"
+#include "consumers_and_producers.h"
+
+enum class Compression {
+  kAuto,  // Detect gzip or zstd from the stream's magic number.
+  kGzip,  // gzip or zlib.
+  kZstd,
+};
+
+// A streaming decompressor.
+class _Inflater {
+public:
+  virtual ~_Inflater() {}
+
+  // Decompresses as much of *in as fits into out, and advances *in
+  // past the input used. Returns the number of bytes written to out.
+  // Throws std::runtime_error on corrupt input.
+  virtual size_t Inflate(std::string_view* in, char* out, size_t size) = 0;
+
+  // Whether the input seen so far ends at the end of a stream.
+  virtual bool complete() const = 0;
+
+  // Makes an inflater for format, detecting it from the start of the
+  // stream, which must hold kMagicSize bytes unless the stream is
+  // shorter, if format is Compression::kAuto.
+  static std::unique_ptr<_Inflater> Make(Compression format,
+                                         std::string_view start);
+
+  static constexpr size_t kMagicSize = 4;
+};
+
+class _GzipInflater : public _Inflater {
+public:
+  _GzipInflater() : complete_(false) {
+    stream_ = z_stream();
+    // Accept gzip and zlib headers alike.
+    if (inflateInit2(&stream_, 15 + 32) != Z_OK) {
+      throw std::runtime_error("cannot initialize zlib");
+    }
+  }
+  ~_GzipInflater() { inflateEnd(&stream_); }
+
+  size_t Inflate(std::string_view* in, char* out, size_t size) override {
+    if (complete_ && !in->empty()) {
+      // Another member of a multi-member gzip file.
+      inflateReset(&stream_);
+      complete_ = false;
+    }
+    stream_.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(in->data()));
+    stream_.avail_in = static_cast<uInt>(in->size());
+    stream_.next_out = reinterpret_cast<Bytef*>(out);
+    stream_.avail_out = static_cast<uInt>(size);
+    int status = inflate(&stream_, Z_NO_FLUSH);
+    if (status == Z_STREAM_END) {
+      complete_ = true;
+    } else if (status != Z_OK && status != Z_BUF_ERROR) {
+      throw std::runtime_error(std::string("gzip: ") +
+                               (stream_.msg ? stream_.msg : "corrupt data"));
+    }
+    in->remove_prefix(in->size() - stream_.avail_in);
+    return size - stream_.avail_out;
+  }
+
+  bool complete() const override { return complete_; }
+
+private:
+  z_stream stream_;
+  bool complete_;
+};
+
+#ifdef PIPELINES_HAVE_ZSTD
+class _ZstdInflater : public _Inflater {
+public:
+  _ZstdInflater() : stream_(ZSTD_createDStream()), complete_(true) {
+    if (!stream_) {
+      throw std::runtime_error("cannot initialize zstd");
+    }
+  }
+  ~_ZstdInflater() { ZSTD_freeDStream(stream_); }
+
+  size_t Inflate(std::string_view* in, char* out, size_t size) override {
+    ZSTD_inBuffer input = { in->data(), in->size(), 0 };
+    ZSTD_outBuffer output = { out, size, 0 };
+    size_t hint = ZSTD_decompressStream(stream_, &output, &input);
+    if (ZSTD_isError(hint)) {
+      throw std::runtime_error(std::string("zstd: ") +
+                               ZSTD_getErrorName(hint));
+    }
+    complete_ = hint == 0;
+    in->remove_prefix(input.pos);
+    return output.pos;
+  }
+
+  bool complete() const override { return complete_; }
+
+private:
+  ZSTD_DStream* stream_;
+  bool complete_;
+};
+#endif  // PIPELINES_HAVE_ZSTD
+
+inline std::unique_ptr<_Inflater> _Inflater::Make(
+    Compression format, std::string_view start) {
+  static const char kZstdMagic[] = "\x28\xb5\x2f\xfd";
+  if (format == Compression::kAuto) {
+    format = start.substr(0, kMagicSize) ==
+        std::string_view(kZstdMagic, kMagicSize) ?
+        Compression::kZstd : Compression::kGzip;
+  }
+  if (format == Compression::kZstd) {
+#ifdef PIPELINES_HAVE_ZSTD
+    return std::unique_ptr<_Inflater>(new _ZstdInflater);
+#else
+    throw std::runtime_error("zstd support was not compiled in");
+#endif
+  }
+  return std::unique_ptr<_Inflater>(new _GzipInflater);
+}
+
+// Decompresses a producer of compressed chunks. The output is
+// produced in chunks of up to chunk_size bytes, with up to depth
+// chunks decompressed ahead of the consumer. Corrupt or truncated
+// input causes std::runtime_error to be thrown to the consumer.
+inline Producer<std::string_view> Decompress(
+    const Producer<std::string_view>& compressed,
+    Compression format = Compression::kAuto,
+    size_t chunk_size = 1 << 16, size_t depth = 4) {
+  return [=](const Consumer<std::string_view>& c) {
+    // Chunks are passed by index into the pool of buffers: full ones
+    // to the consumer along with their sizes, and free ones back.
+    std::vector<std::vector<char>> pool(depth,
+                                        std::vector<char>(chunk_size));
+    Buffer<std::pair<size_t, size_t>> full(depth);
+    Buffer<size_t> free(depth);
+    for (size_t i = 0; i < depth; ++i) {
+      free.Push(i);
+    }
+    _Feeder feeder([&] {
+      std::unique_ptr<_Inflater> inflater;
+      size_t chunk = 0;
+      size_t used = 0;
+      bool have_chunk = free.Pop(&chunk);
+      auto inflate = [&](std::string_view in) {
+        while (have_chunk) {
+          if (used == chunk_size) {
+            have_chunk = full.Push(std::make_pair(chunk, used)) &&
+                free.Pop(&chunk);
+            used = 0;
+            continue;
+          }
+          size_t before = in.size();
+          size_t written = inflater->Inflate(&in, pool[chunk].data() + used,
+                                             chunk_size - used);
+          used += written;
+          if (used == chunk_size) {
+            continue;  // There may be more output pending.
+          }
+          if (in.empty()) {
+            return;  // Everything that can be decompressed has been.
+          }
+          if (written == 0 && in.size() == before && !inflater->complete()) {
+            throw std::runtime_error("compressed stream makes no progress");
+          }
+        }
+      };
+      // The start of the stream, held back until it is long enough to
+      // tell its format.
+      std::string start;
+      compressed([&](std::string_view in) {
+        if (!inflater) {
+          if (!start.empty() || (format == Compression::kAuto &&
+                                 in.size() < _Inflater::kMagicSize)) {
+            start.append(in.data(), in.size());
+            if (format == Compression::kAuto &&
+                start.size() < _Inflater::kMagicSize) {
+              return;
+            }
+            in = start;
+          }
+          inflater = _Inflater::Make(format, in);
+        }
+        inflate(in);
+      });
+      if (!inflater && !start.empty()) {
+        // The whole stream is shorter than a magic number.
+        inflater = _Inflater::Make(format, start);
+        inflate(start);
+      }
+      if (inflater && !inflater->complete()) {
+        throw std::runtime_error("truncated compressed stream");
+      }
+      if (have_chunk && used > 0) {
+        full.Push(std::make_pair(chunk, used));
+      }
+    }, &full);
+    struct Closer {
+      Buffer<std::pair<size_t, size_t>>* full;
+      Buffer<size_t>* free;
+      ~Closer() {
+        full->Close();
+        free->Close();
+      }
+    } closer{&full, &free};
+    std::pair<size_t, size_t> chunk;
+    while (full.Pop(&chunk)) {
+      c(std::string_view(pool[chunk.first].data(), chunk.second));
+      free.Push(chunk.first);
+    }
+    feeder.Join();
+  };
+}
+
+#endif  // DECOMPRESS_H_
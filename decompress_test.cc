@@ -0,0 +1,125 @@
+// Tests for streaming decompression.
+
+#include "decompress.h"
+
+#include <zlib.h>
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "text_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Compresses text in gzip format.
+string Gzip(const string& text) {
+  z_stream stream = z_stream();
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+               Z_DEFAULT_STRATEGY);
+  string out(deflateBound(&stream, text.size()) + 32, '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text.data()));
+  stream.avail_in = text.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+  stream.avail_out = out.size();
+  deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+// Produces data in chunks of the given size.
+Producer<std::string_view> Chunks(const string& data, size_t size) {
+  return [=](const Consumer<std::string_view>& c) {
+    for (size_t i = 0; i < data.size(); i += size) {
+      c(std::string_view(data).substr(i, size));
+    }
+  };
+}
+
+string Concat(const Producer<std::string_view>& p) {
+  string s;
+  p([&](std::string_view chunk) { s.append(chunk.data(), chunk.size()); });
+  return s;
+}
+
+string Text() {
+  string text;
+  for (int i = 0; i < 20000; ++i) {
+    text += "line " + std::to_string(i * 7919 % 10007) + "\n";
+  }
+  return text;
+}
+
+}  // namespace
+
+TEST(Decompress, InflatesGzipStreams) {
+  const string text = Text();
+  const string gz = Gzip(text);
+  for (size_t in_size : {1u, 7u, 4096u, 1u << 20}) {
+    for (size_t out_size : {1u, 100u, 1u << 16}) {
+      EXPECT_EQ(text, Concat(Decompress(Chunks(gz, in_size),
+                                        Compression::kGzip, out_size, 3)));
+    }
+  }
+  EXPECT_EQ(text, Concat(Decompress(Chunks(gz, 1000))));
+  EXPECT_EQ("", Concat(Decompress(Chunks("", 1000))));
+}
+
+TEST(Decompress, InflatesMultiMemberGzipFiles) {
+  EXPECT_EQ("one\ntwo\n",
+            Concat(Decompress(Chunks(Gzip("one\n") + Gzip("two\n"), 3))));
+}
+
+TEST(Decompress, FeedsLineProducers) {
+  const string text = Text();
+  vector<string> expected, lines;
+  SplitLines(Chunks(text, 1000))([&](std::string_view line) {
+    expected.emplace_back(line);
+  });
+  SplitLines(Decompress(Chunks(Gzip(text), 999), Compression::kAuto, 333))(
+      [&](std::string_view line) { lines.emplace_back(line); });
+  EXPECT_EQ(20000u, lines.size());
+  EXPECT_EQ(expected, lines);
+}
+
+TEST(Decompress, RejectsCorruptAndTruncatedStreams) {
+  const string gz = Gzip(Text());
+  EXPECT_THROW(Concat(Decompress(Chunks(gz.substr(0, gz.size() / 2), 100))),
+               std::runtime_error);
+  EXPECT_THROW(Concat(Decompress(Chunks("this is not gzip data", 100))),
+               std::runtime_error);
+#ifndef PIPELINES_HAVE_ZSTD
+  EXPECT_THROW(Concat(Decompress(Chunks("\x28\xb5\x2f\xfd", 100))),
+               std::runtime_error);
+#endif
+}
+
+TEST(Decompress, DetectsFormatsSplitAcrossChunks) {
+  const string text = Text();
+  for (size_t in_size : {1u, 2u, 3u}) {
+    EXPECT_EQ(text, Concat(Decompress(Chunks(Gzip(text), in_size))));
+    // A zstd magic number is never mistaken for a gzip header, however
+    // it is split; here, it starts a truncated zstd stream.
+    try {
+      Concat(Decompress(Chunks("\x28\xb5\x2f\xfd", in_size)));
+      ADD_FAILURE() << "no exception for chunks of " << in_size;
+    } catch (const std::runtime_error& e) {
+      EXPECT_EQ(string::npos, string(e.what()).find("gzip")) << e.what();
+    }
+  }
+  // Streams shorter than a magic number still reach the inflater.
+  EXPECT_THROW(Concat(Decompress(Chunks("\x1f", 1))), std::runtime_error);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
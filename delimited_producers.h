@@ -0,0 +1,233 @@
+// Producers that parse delimiter-separated files.  -*- c++ -*-
+//
+// ReadDelimited<Ts...>(path, sep) parses a CSV, TSV, or similar file
+// straight into std::tuple<Ts...> values, the same tuple shape that
+// PCross and FFork produce, so tabular data can feed a pipeline
+// without a separate parsing pass. For example:
+//
+//   // Columns 0 and 3 of a comma-separated file, as name and age.
+//   auto people =
+//       ReadDelimited<std::string, int>("people.csv", ',', {0, 3});
+//
+// Only the projected columns are converted; the others are skipped
+// over without being looked at beyond finding where they end.
+//
+// Fields may be quoted with double quotes, in which case they may
+// contain separators, newlines, and doubled "" quotes. Arithmetic
+// columns are converted with std::from_chars. std::string_view
+// columns are views into the mapped file (or, for fields with
+// escaped quotes, into a scratch buffer) that are valid only while
+// the consumer runs. Blank lines are skipped. Malformed files cause
+// std::runtime_error to be thrown.
+
+#ifndef DELIMITED_PRODUCERS_H_
+#define DELIMITED_PRODUCERS_H_
+
+#include <charconv>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "text_producers.h"
+
+// Converts the text of a field into a T. Specialize for your own types.
+template <typename T, typename Enable = void>
+struct FieldParser;
+
+template <typename T>
+struct FieldParser<
+    T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+  static bool Parse(std::string_view text, T* x) {
+    const char* end = text.data() + text.size();
+    std::from_chars_result result = std::from_chars(text.data(), end, *x);
+    return result.ec == std::errc() && result.ptr == end;
+  }
+};
+
+template <>
+struct FieldParser<std::string> {
+  static bool Parse(std::string_view text, std::string* x) {
+    x->assign(text.data(), text.size());
+    return true;
+  }
+};
+
+template <>
+struct FieldParser<std::string_view> {
+  static bool Parse(std::string_view text, std::string_view* x) {
+    *x = text;
+    return true;
+  }
+};
+
+template <typename... Ts>
+class _DelimitedParser {
+public:
+  typedef std::tuple<Ts...> Row;
+
+  _DelimitedParser(char sep, const std::vector<int>& columns)
+      : sep_(sep), line_(1) {
+    std::vector<int> cols = columns;
+    if (cols.empty()) {
+      for (size_t i = 0; i < sizeof...(Ts); ++i) {
+        cols.push_back(static_cast<int>(i));
+      }
+    }
+    if (cols.size() != sizeof...(Ts)) {
+      throw std::invalid_argument(
+          "ReadDelimited needs one column index per tuple element");
+    }
+    for (size_t i = 0; i < cols.size(); ++i) {
+      if (cols[i] < 0) {
+        throw std::invalid_argument("negative column index");
+      }
+      if (slots_.size() <= static_cast<size_t>(cols[i])) {
+        slots_.resize(cols[i] + 1, -1);
+      }
+      if (slots_[cols[i]] >= 0) {
+        throw std::invalid_argument("duplicate column index");
+      }
+      slots_[cols[i]] = static_cast<int>(i);
+    }
+    scratch_.resize(sizeof...(Ts) + 1);  // One more for skipped columns.
+  }
+
+  void Parse(const char* p, const char* end, const Consumer<Row>& c) {
+    Row row;
+    while (p < end) {
+      if (*p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n')) {
+        p += *p == '\n' ? 1 : 2;  // Skip blank lines.
+        ++line_;
+        continue;
+      }
+      size_t column = 0;
+      bool end_of_row = false;
+      while (!end_of_row) {
+        std::string_view field;
+        if (p < end && *p == '"') {
+          p = ParseQuoted(p + 1, end, column, &field);
+          if (p + 1 < end && p[0] == '\r' && p[1] == '\n') {
+            ++p;
+          }
+        } else {
+          const char* stop = _FindEither(p, end, sep_, '\n');
+          field = std::string_view(p, stop - p);
+          p = stop;
+        }
+        if (p == end || *p == '\n') {
+          end_of_row = true;
+          if (!field.empty() && field.back() == '\r') {
+            field.remove_suffix(1);
+          }
+        } else if (*p != sep_) {
+          Fail("expected a separator after a quoted field");
+        }
+        if (column < slots_.size() && slots_[column] >= 0) {
+          Convert(slots_[column], field, &row);
+        }
+        ++column;
+        if (p < end) {
+          ++p;  // Skip the separator or newline.
+        }
+      }
+      if (column < slots_.size()) {
+        Fail("expected at least " + std::to_string(slots_.size()) +
+             " columns but found " + std::to_string(column));
+      }
+      c(row);
+      ++line_;
+    }
+  }
+
+private:
+  // Parses a quoted field whose opening quote precedes p, and returns
+  // a pointer just past its closing quote.
+  const char* ParseQuoted(const char* p, const char* end, size_t column,
+                          std::string_view* field) {
+    const char* start = p;
+    std::string* scratch = nullptr;
+    for (;;) {
+      const char* quote = _FindByte(p, end, '"');
+      if (quote == end) {
+        Fail("unterminated quoted field");
+      }
+      for (const char* q = p; q < quote; ++q) {
+        line_ += *q == '\n';
+      }
+      if (quote + 1 < end && quote[1] == '"') {
+        // An escaped quote. From here on, the field must be unescaped
+        // into a scratch buffer.
+        if (!scratch) {
+          int slot = column < slots_.size() ? slots_[column] : -1;
+          scratch = &scratch_[slot >= 0 ? slot : sizeof...(Ts)];
+          scratch->assign(start, quote + 1);
+        } else {
+          scratch->append(p, quote + 1);
+        }
+        p = quote + 2;
+        continue;
+      }
+      if (scratch) {
+        scratch->append(p, quote);
+        *field = *scratch;
+      } else {
+        *field = std::string_view(start, quote - start);
+      }
+      return quote + 1;
+    }
+  }
+
+  template <size_t I>
+  static bool ConvertAt(std::string_view text, Row* row) {
+    typedef typename std::tuple_element<I, Row>::type T;
+    return FieldParser<T>::Parse(text, &std::get<I>(*row));
+  }
+
+  template <size_t... Is>
+  static bool Convert(int slot, std::string_view text, Row* row,
+                      std::index_sequence<Is...>) {
+    typedef bool (*Converter)(std::string_view, Row*);
+    static const Converter converters[] = { &ConvertAt<Is>... };
+    return converters[slot](text, row);
+  }
+
+  void Convert(int slot, std::string_view text, Row* row) {
+    if (!Convert(slot, text, row, std::index_sequence_for<Ts...>())) {
+      Fail("cannot convert \"" + std::string(text) + "\"");
+    }
+  }
+
+  [[noreturn]] void Fail(const std::string& message) {
+    throw std::runtime_error("line " + std::to_string(line_) + ": " +
+                             message);
+  }
+
+  char sep_;
+  size_t line_;
+  std::vector<int> slots_;  // Maps file columns to tuple elements.
+  std::vector<std::string> scratch_;
+};
+
+// Produces the rows of a delimiter-separated file as tuples. The
+// tuple's elements are taken from the given columns of the file, or
+// from its leading columns if none are given.
+template <typename... Ts>
+Producer<std::tuple<Ts...>> ReadDelimited(const std::string& path,
+                                          char sep = ',',
+                                          std::vector<int> columns = {}) {
+  static_assert(sizeof...(Ts) > 0, "ReadDelimited needs at least one column");
+  // Check the columns now, rather than when the producer runs.
+  _DelimitedParser<Ts...> check(sep, columns);
+  return [=](const Consumer<std::tuple<Ts...>>& c) {
+    MappedFile file(path);
+    _DelimitedParser<Ts...> parser(sep, columns);
+    parser.Parse(file.data(), file.data() + file.size(), c);
+  };
+}
+
+#endif  // DELIMITED_PRODUCERS_H_
@@ -0,0 +1,102 @@
+// Tests for producers that parse delimiter-separated files.
+
+#include "delimited_producers.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Writes contents to a fresh temporary file and returns its path.
+string TempFile(const string& contents) {
+  static int n = 0;
+  string path = ::testing::TempDir() + "delimited_producers_test." +
+      std::to_string(::getpid()) + "." + std::to_string(n++);
+  std::FILE* f = std::fopen(path.c_str(), "wb");
+  std::fwrite(contents.data(), 1, contents.size(), f);
+  std::fclose(f);
+  return path;
+}
+
+template <typename... Ts>
+vector<std::tuple<Ts...>> Rows(const string& contents, char sep = ',',
+                               vector<int> columns = {}) {
+  string path = TempFile(contents);
+  // Removes the file even when reading it throws.
+  struct Remover {
+    const string& path;
+    ~Remover() { std::remove(path.c_str()); }
+  } remover{path};
+  vector<std::tuple<Ts...>> rows;
+  ReadDelimited<Ts...>(path, sep, columns)([&](const std::tuple<Ts...>& r) {
+    rows.push_back(r);
+  });
+  return rows;
+}
+
+using SID = std::tuple<string, int, double>;
+
+}  // namespace
+
+TEST(ReadDelimited, ParsesTypedColumns) {
+  EXPECT_EQ(vector<SID>({SID{"a", 1, 1.5}, SID{"b", -2, 0}}),
+            (Rows<string, int, double>("a,1,1.5\nb,-2,0\n")));
+  // Tabs, CRLF line endings, blank lines, and no final newline.
+  EXPECT_EQ(vector<SID>({SID{"a", 1, 1.5}, SID{"b", -2, 0}}),
+            (Rows<string, int, double>("a\t1\t1.5\r\n\r\n\nb\t-2\t0",
+                                       '\t')));
+}
+
+TEST(ReadDelimited, ParsesQuotedFields) {
+  using S2 = std::tuple<string, string>;
+  EXPECT_EQ(vector<S2>({S2{"a,b", "say \"hi\""}, S2{"two\nlines", ""}}),
+            (Rows<string, string>("\"a,b\",\"say \"\"hi\"\"\"\n"
+                                  "\"two\nlines\",\"\"\r\n")));
+}
+
+TEST(ReadDelimited, ProjectsColumns) {
+  using IS = std::tuple<int, string>;
+  // Column 1 is never converted, so it may hold anything.
+  EXPECT_EQ(vector<IS>({IS{3, "x"}, IS{6, "y"}}),
+            (Rows<int, string>("x,junk,3\n\"y\",\"ju\"\"nk\",6\n", ',',
+                               {2, 0})));
+}
+
+TEST(ReadDelimited, ScansLongRows) {
+  string contents;
+  vector<std::tuple<string, int>> expected;
+  for (int i = 0; i < 50; ++i) {
+    expected.emplace_back(string(i, 'z'), i);
+    contents += string(i, 'z') + "," + std::to_string(i) + "\n";
+  }
+  EXPECT_EQ(expected, (Rows<string, int>(contents)));
+}
+
+TEST(ReadDelimited, RejectsMalformedFiles) {
+  EXPECT_THROW(Rows<int>("x\n"), std::runtime_error);
+  EXPECT_THROW((Rows<int, int>("1,2\n3\n")), std::runtime_error);
+  EXPECT_THROW(Rows<string>("\"open\n"), std::runtime_error);
+  EXPECT_THROW(Rows<string>("\"a\"b\n"), std::runtime_error);
+  EXPECT_THROW(ReadDelimited<int>("unused", ',', {0, 1}),
+               std::invalid_argument);
+  EXPECT_THROW((ReadDelimited<int, int>("unused", ',', {0, 0})),
+               std::invalid_argument);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
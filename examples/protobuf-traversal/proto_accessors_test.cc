@@ -7,6 +7,7 @@
 
 #include "../../consumers_and_producers.h"
 #include "../../read_write_filters.h"
+#include "../../splittable.h"
 #include "example.pb.h"
 #include "gtest/gtest.h"
 
@@ -338,6 +339,25 @@ TEST(ProtoAccessors, Basics) {
              "Lone Wolf McQuade"});
 }
 
+TEST(ProtoAccessors, SplittableRepeatedFields) {
+  Team team;
+  for (int i = 0; i < 10; ++i) {
+    team.add_members()->set_name("member " + std::to_string(i));
+  }
+  // A repeated field splits like a vector, so that its elements can be
+  // divided among threads before the work starts.
+  auto members = SplittableRange(team.members());
+  vector<string> names;
+  for (const auto& part : SplitInto(members, 3)) {
+    part([&](const Person& person) {
+      names.push_back(person.name());
+    });
+  }
+  ASSERT_EQ(10u, names.size());
+  EXPECT_EQ("member 0", names.front());
+  EXPECT_EQ("member 9", names.back());
+}
+
 
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,298 @@
+// Repartitioning values between parallel stages.  -*- c++ -*-
+//
+// Parallel stages that group or join by key need every value for a
+// key to reach the same worker. An Exchange takes the values produced
+// by m upstream workers and hash-partitions them by key among n
+// downstream workers, without a lock that all the workers contend on:
+// each pair of upstream and downstream workers has its own
+// single-producer, single-consumer queue, and values are handed over
+// in batches, so that the queues are touched once per batch rather
+// than once per value.
+//
+// ParallelExchange runs the whole thing:
+//
+//   std::vector<std::map<std::string, int>> counts(4);
+//   ParallelExchange<std::string>(
+//       shards, [](const std::string& word) { return word; }, 4,
+//       [&](size_t j) {
+//         return Consumer<std::string>(
+//             [&, j](const std::string& w) { ++counts[j][w]; });
+//       });
+//
+// Each shard is run on its own thread, as is each downstream consumer,
+// and each consumer sees every occurrence of the words it sees.
+
+#ifndef EXCHANGE_H_
+#define EXCHANGE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "consumers_and_producers.h"
+
+// A bounded single-producer, single-consumer queue, whose capacity is
+// a power of two.
+template <typename T>
+class _SpscQueue {
+public:
+  explicit _SpscQueue(size_t capacity)
+      : slots_(RoundUp(capacity)), mask_(slots_.size() - 1),
+        head_(0), tail_(0), closed_(false) {}
+
+  // Called only by the producer.
+  bool TryPush(T* x) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == slots_.size()) {
+      return false;
+    }
+    slots_[head & mask_] = std::move(*x);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called only by the consumer.
+  bool TryPop(T* x) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *x = std::move(slots_[tail & mask_]);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // The producer closes the queue after its last push.
+  void Close() { closed_.store(true, std::memory_order_release); }
+  bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+private:
+  static size_t RoundUp(size_t n) {
+    size_t capacity = 1;
+    while (capacity < n) capacity <<= 1;
+    return capacity;
+  }
+
+  std::vector<T> slots_;
+  const size_t mask_;
+  // The producer's and consumer's indexes are on separate cache lines.
+  alignas(64) std::atomic<size_t> head_;
+  alignas(64) std::atomic<size_t> tail_;
+  std::atomic<bool> closed_;
+};
+
+// Waits with spinning, then yielding, then sleeping, for the spells
+// when a queue is full or every queue is empty.
+class _Backoff {
+public:
+  _Backoff() : spins_(0) {}
+  void Wait() {
+    if (++spins_ < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+  void Reset() { spins_ = 0; }
+
+private:
+  int spins_;
+};
+
+template <typename T>
+class Exchange {
+public:
+  typedef std::vector<T> Batch;
+
+  // Partitions the values of m upstream workers among n downstream
+  // workers by the hash of key_fn(x). Values are handed over in
+  // batches of batch_size, and each queue holds up to queue_batches.
+  // Throws std::invalid_argument if there are no downstream workers.
+  template <typename KeyFn>
+  Exchange(size_t m, const KeyFn& key_fn, size_t n, size_t batch_size = 256,
+           size_t queue_batches = 16)
+      : m_(m), n_(n), batch_size_(std::max<size_t>(batch_size, 1)),
+        cancelled_(false) {
+    typedef typename std::decay<
+        decltype(key_fn(std::declval<const T&>()))>::type Key;
+    if (n == 0) {
+      throw std::invalid_argument("an exchange needs downstream workers");
+    }
+    partition_ = [key_fn, n](const T& x) {
+      // Mix the hash, since std::hash is the identity for integers.
+      uint64_t h = std::hash<Key>()(key_fn(x)) * 0x9e3779b97f4a7c15ull;
+      return static_cast<size_t>((h >> 32) % n);
+    };
+    queues_.reserve(m * n);
+    for (size_t k = 0; k < m * n; ++k) {
+      queues_.emplace_back(new _SpscQueue<Batch>(queue_batches));
+    }
+  }
+  Exchange(const Exchange&) = delete;
+  Exchange& operator=(const Exchange&) = delete;
+
+  size_t upstream() const { return m_; }
+  size_t downstream() const { return n_; }
+
+  // Which downstream worker x goes to.
+  size_t Partition(const T& x) const { return partition_(x); }
+
+  // What upstream worker i sends its values to. Only that worker may
+  // use it, and it must Close it when it is done.
+  class Sender {
+  public:
+    Sender(Exchange* exchange, size_t i)
+        : exchange_(exchange), i_(i), batches_(exchange->n_) {}
+
+    void operator()(const T& x) {
+      size_t j = exchange_->partition_(x);
+      Batch& batch = batches_[j];
+      if (batch.empty()) {
+        batch.reserve(exchange_->batch_size_);
+      }
+      batch.push_back(x);
+      if (batch.size() == exchange_->batch_size_) {
+        Hand(j);
+      }
+    }
+
+    // Hands over what remains, and closes this worker's queues.
+    void Close() {
+      for (size_t j = 0; j < batches_.size(); ++j) {
+        if (!batches_[j].empty()) {
+          Hand(j);
+        }
+        exchange_->Queue(i_, j).Close();
+      }
+    }
+
+  private:
+    void Hand(size_t j) {
+      _SpscQueue<Batch>& queue = exchange_->Queue(i_, j);
+      _Backoff backoff;
+      while (!queue.TryPush(&batches_[j])) {
+        if (exchange_->cancelled()) {
+          throw std::runtime_error("exchange cancelled");
+        }
+        backoff.Wait();
+      }
+      batches_[j].clear();
+    }
+
+    Exchange* const exchange_;
+    const size_t i_;
+    std::vector<Batch> batches_;
+  };
+
+  Sender MakeSender(size_t i) { return Sender(this, i); }
+
+  // Produces the values sent to downstream worker j, until every
+  // upstream worker has closed its sender. Only that worker may run it.
+  void Receive(size_t j, const Consumer<T>& c) {
+    std::vector<bool> done(m_, false);
+    size_t remaining = m_;
+    Batch batch;
+    _Backoff backoff;
+    while (remaining > 0) {
+      bool any = false;
+      for (size_t i = 0; i < m_; ++i) {
+        if (done[i]) {
+          continue;
+        }
+        _SpscQueue<Batch>& queue = Queue(i, j);
+        // Check for closing first, so that a batch pushed just before
+        // the queue closed is not missed.
+        bool closed = queue.closed();
+        if (queue.TryPop(&batch)) {
+          any = true;
+          for (const T& x : batch) {
+            c(x);
+          }
+        } else if (closed) {
+          done[i] = true;
+          --remaining;
+        }
+      }
+      if (any) {
+        backoff.Reset();
+      } else if (remaining > 0) {
+        if (cancelled()) {
+          throw std::runtime_error("exchange cancelled");
+        }
+        backoff.Wait();
+      }
+    }
+  }
+
+  // Stops waiting senders and receivers, which then throw. Used when
+  // a worker fails, so that the others do not wait for it forever.
+  void Cancel() { cancelled_.store(true); }
+  bool cancelled() const { return cancelled_.load(); }
+
+private:
+  _SpscQueue<Batch>& Queue(size_t i, size_t j) { return *queues_[i * n_ + j]; }
+
+  const size_t m_, n_, batch_size_;
+  std::function<size_t(const T&)> partition_;
+  std::vector<std::unique_ptr<_SpscQueue<Batch>>> queues_;
+  std::atomic<bool> cancelled_;
+};
+
+// Runs each upstream producer on its own thread, and feeds the values
+// to make_consumer(j) for j in [0, n), each on its own thread, such
+// that values with equal keys reach the same consumer. Rethrows the
+// first exception any of them throws.
+template <typename T, typename KeyFn, typename MakeConsumer>
+void ParallelExchange(const std::vector<Producer<T>>& upstream,
+                      const KeyFn& key_fn, size_t n,
+                      const MakeConsumer& make_consumer,
+                      size_t batch_size = 256) {
+  Exchange<T> exchange(upstream.size(), key_fn, n, batch_size);
+  std::mutex mu;
+  std::exception_ptr error;
+  auto guard = [&](const std::function<void()>& f) {
+    try {
+      f();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mu);
+      if (!error && !exchange.cancelled()) {
+        error = std::current_exception();
+      }
+      exchange.Cancel();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < upstream.size(); ++i) {
+    threads.emplace_back([&, i] {
+      guard([&] {
+        typename Exchange<T>::Sender sender = exchange.MakeSender(i);
+        upstream[i]([&](const T& x) { sender(x); });
+        sender.Close();
+      });
+    });
+  }
+  for (size_t j = 0; j < n; ++j) {
+    threads.emplace_back([&, j] {
+      guard([&] { exchange.Receive(j, make_consumer(j)); });
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+#endif  // EXCHANGE_H_
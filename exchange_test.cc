@@ -0,0 +1,113 @@
+// Tests for repartitioning between parallel stages.
+
+#include "exchange.h"
+
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Upstream shard i produces the keys i, i + 1, ..., each count times.
+Producer<int> Shard(int i, int keys, int count) {
+  return [=](const Consumer<int>& c) {
+    for (int n = 0; n < count; ++n) {
+      for (int k = 0; k < keys; ++k) c((i + k) % keys);
+    }
+  };
+}
+
+}  // namespace
+
+TEST(SpscQueue, MovesValuesBetweenTwoThreadsInOrder) {
+  _SpscQueue<int> queue(8);
+  std::thread producer([&] {
+    for (int i = 0; i < 100000; ++i) {
+      int x = i;
+      while (!queue.TryPush(&x)) std::this_thread::yield();
+    }
+    queue.Close();
+  });
+  int expected = 0;
+  bool in_order = true;
+  for (;;) {
+    bool closed = queue.closed();
+    int x;
+    if (queue.TryPop(&x)) {
+      in_order = in_order && x == expected++;
+    } else if (closed) {
+      break;
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  EXPECT_EQ(100000, expected);
+  EXPECT_TRUE(in_order);
+}
+
+TEST(Exchange, SendsEveryValueForAKeyToOneWorker) {
+  const int kShards = 3, kWorkers = 4, kKeys = 100, kCount = 50;
+  vector<Producer<int>> shards;
+  for (int i = 0; i < kShards; ++i) shards.push_back(Shard(i, kKeys, kCount));
+  vector<std::map<int, int>> counts(kWorkers);
+  ParallelExchange<int>(shards, [](int x) { return x; }, kWorkers,
+                        [&](size_t j) {
+    return Consumer<int>([&, j](int x) { ++counts[j][x]; });
+  }, 16);
+  std::set<int> keys;
+  for (const auto& worker : counts) {
+    // Every worker gets some of the keys.
+    EXPECT_FALSE(worker.empty());
+    for (const auto& key_count : worker) {
+      EXPECT_TRUE(keys.insert(key_count.first).second)
+          << key_count.first << " reached two workers";
+      EXPECT_EQ(kShards * kCount, key_count.second);
+    }
+  }
+  EXPECT_EQ(static_cast<size_t>(kKeys), keys.size());
+}
+
+TEST(Exchange, PartitionsByKey) {
+  Exchange<string> exchange(1, [](const string& s) { return s.substr(0, 1); },
+                            8);
+  EXPECT_EQ(exchange.Partition("apple"), exchange.Partition("avocado"));
+  EXPECT_LT(exchange.Partition("banana"), 8u);
+  EXPECT_THROW(Exchange<string>(1, [](const string& s) { return s; }, 0),
+               std::invalid_argument);
+}
+
+TEST(Exchange, RethrowsWithoutWaitingForever) {
+  // A downstream worker fails while upstream workers still have far
+  // more to send than the queues can hold.
+  vector<Producer<int>> shards = {Shard(0, 10, 100000), Shard(1, 10, 100000)};
+  EXPECT_THROW(ParallelExchange<int>(shards, [](int x) { return x; }, 2,
+                                     [](size_t j) {
+    return Consumer<int>([j](int) {
+      if (j == 1) throw std::logic_error("worker 1");
+    });
+  }), std::logic_error);
+  // An upstream failure stops the downstream workers.
+  shards.push_back([](const Consumer<int>&) {
+    throw std::logic_error("shard 2");
+  });
+  EXPECT_THROW(ParallelExchange<int>(shards, [](int x) { return x; }, 2,
+                                     [](size_t) {
+    return Consumer<int>([](int) {});
+  }), std::logic_error);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
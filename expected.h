@@ -0,0 +1,251 @@
+// Errors as values, for pipelines that must not throw.  -*- c++ -*-
+//
+// Filters that can fail without throwing return Expected<T, E>, which
+// holds either a value or an error. Two styles of pipeline are
+// supported:
+//
+// (1) Errors as elements. A Producer<Expected<T, E>> carries errors
+//     alongside values, and EFmap and EBind map and chain the values
+//     while passing errors through untouched.
+//
+// (2) Errors on a side channel. An ErrorChannel<E> collects the
+//     errors reported by the stages that share it, while only values
+//     flow down the pipeline. Try and TryMap turn fallible filters
+//     into ordinary ones that report to a channel, and Values splits a
+//     producer of Expected values into values and reported errors.
+//
+// A channel either stops at the first error or collects errors and
+// carries on, for jobs that tolerate partial failure. Once a channel
+// has stopped, every stage attached to it drops whatever reaches it
+// with a single test, without calling its filter; sources made with
+// PUntilError stop producing altogether. Nothing is thrown.
+//
+// For example, to parse numbers, stopping at the first bad one:
+//
+//   ErrorChannel<std::string> errors;
+//   auto numbers = PUntilError(lines, &errors) | TryMap(Parse, &errors);
+//   numbers(sum);
+//   if (!errors.ok()) { ... errors.first() ... }
+
+#ifndef EXPECTED_H_
+#define EXPECTED_H_
+
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "consumers_and_producers.h"
+
+// An error, wrapped to tell it apart from a value when constructing
+// an Expected whose value and error types are the same.
+template <typename E>
+struct Unexpected {
+  E error;
+};
+
+template <typename E>
+Unexpected<typename std::decay<E>::type> MakeUnexpected(E&& e) {
+  return { std::forward<E>(e) };
+}
+
+// Either a value of type T or an error of type E.
+template <typename T, typename E>
+class Expected {
+public:
+  typedef T value_type;
+  typedef E error_type;
+
+  Expected() : v_(std::in_place_index<0>) {}
+  Expected(const T& x) : v_(std::in_place_index<0>, x) {}
+  Expected(T&& x) : v_(std::in_place_index<0>, std::move(x)) {}
+  template <typename G>
+  Expected(Unexpected<G> e)
+      : v_(std::in_place_index<1>, std::move(e.error)) {}
+
+  bool has_value() const { return v_.index() == 0; }
+  explicit operator bool() const { return has_value(); }
+
+  // Must only be called on Expecteds that hold a value.
+  const T& value() const { return *std::get_if<0>(&v_); }
+  T& value() { return *std::get_if<0>(&v_); }
+  const T& operator*() const { return value(); }
+  T& operator*() { return value(); }
+  const T* operator->() const { return &value(); }
+  T* operator->() { return &value(); }
+
+  // Must only be called on Expecteds that hold an error.
+  const E& error() const { return *std::get_if<1>(&v_); }
+  E& error() { return *std::get_if<1>(&v_); }
+
+  T value_or(T otherwise) const {
+    return has_value() ? value() : std::move(otherwise);
+  }
+
+  bool operator==(const Expected& that) const { return v_ == that.v_; }
+  bool operator!=(const Expected& that) const { return v_ != that.v_; }
+
+private:
+  std::variant<T, E> v_;
+};
+
+//==============================================================================
+// ERRORS AS ELEMENTS
+//==============================================================================
+
+// Maps the values of a producer of Expecteds, passing errors through.
+template <typename A, typename B, typename E>
+Producer<Expected<B, E>> EFmap(const Fn<A, B>& f,
+                               const Producer<Expected<A, E>>& p) {
+  return [=](const Consumer<Expected<B, E>>& c) {
+    p([&](const Expected<A, E>& x) {
+      if (x) {
+        c(f(*x));
+      } else {
+        c(MakeUnexpected(x.error()));
+      }
+    });
+  };
+}
+
+// Chains a fallible filter onto the values of a producer of
+// Expecteds, passing errors through.
+template <typename A, typename B, typename E>
+Producer<Expected<B, E>> EBind(const Producer<Expected<A, E>>& p,
+                               const Filter<A, Expected<B, E>>& f) {
+  return [=](const Consumer<Expected<B, E>>& c) {
+    p([&](const Expected<A, E>& x) {
+      if (x) {
+        f(*x)(c);
+      } else {
+        c(MakeUnexpected(x.error()));
+      }
+    });
+  };
+}
+
+//==============================================================================
+// ERRORS ON A SIDE CHANNEL
+//==============================================================================
+
+enum class ErrorMode {
+  kStopOnFirstError,    // Stop the pipeline at the first error.
+  kCollectAndContinue,  // Record every error and keep going.
+};
+
+// Collects the errors reported by the stages of a pipeline. A channel
+// is not thread safe; give each thread's pipeline its own.
+template <typename E>
+class ErrorChannel {
+public:
+  explicit ErrorChannel(ErrorMode mode = ErrorMode::kStopOnFirstError)
+      : mode_(mode), stopped_(false) {}
+
+  void Report(E e) {
+    if (stopped_) {
+      return;
+    }
+    errors_.push_back(std::move(e));
+    stopped_ = mode_ == ErrorMode::kStopOnFirstError;
+  }
+
+  // Whether the stages attached to this channel should stop.
+  bool stopped() const { return stopped_; }
+
+  bool ok() const { return errors_.empty(); }
+  const E& first() const { return errors_.front(); }
+  const std::vector<E>& errors() const { return errors_; }
+  ErrorMode mode() const { return mode_; }
+
+  // Forgets the errors seen so far, so the channel can be reused.
+  void Reset() {
+    errors_.clear();
+    stopped_ = false;
+  }
+
+private:
+  ErrorMode mode_;
+  bool stopped_;
+  std::vector<E> errors_;
+};
+
+// Produces the values of a producer of Expecteds, reporting its errors
+// to a channel.
+template <typename T, typename E>
+Producer<T> Values(const Producer<Expected<T, E>>& p,
+                   ErrorChannel<E>* errors) {
+  return [=](const Consumer<T>& c) {
+    p([&](const Expected<T, E>& x) {
+      if (errors->stopped()) {
+        return;
+      }
+      if (x) {
+        c(*x);
+      } else {
+        errors->Report(x.error());
+      }
+    });
+  };
+}
+
+// Turns a fallible function into a filter that produces its value, or
+// nothing if it fails, in which case the error is reported.
+template <typename A, typename B, typename E>
+Filter<A, B> TryMap(const Fn<A, Expected<B, E>>& f, ErrorChannel<E>* errors) {
+  return [=](A x) -> Producer<B> {
+    if (errors->stopped()) {
+      return PZero<B>();
+    }
+    Expected<B, E> y = f(x);
+    if (!y) {
+      errors->Report(std::move(y.error()));
+      return PZero<B>();
+    }
+    return PUnit(*y);
+  };
+}
+
+template <typename A, typename B, typename E>
+Filter<A, B> TryMap(Expected<B, E> (*f)(A), ErrorChannel<E>* errors) {
+  return TryMap(Fn<A, Expected<B, E>>(f), errors);
+}
+
+// Turns a fallible filter into one that produces only its values,
+// reporting its errors.
+template <typename A, typename B, typename E>
+Filter<A, B> Try(const Filter<A, Expected<B, E>>& f, ErrorChannel<E>* errors) {
+  return [=](A x) -> Producer<B> {
+    if (errors->stopped()) {
+      return PZero<B>();
+    }
+    return Values(f(x), errors);
+  };
+}
+
+// Drops a producer's values once a channel has stopped.
+template <typename T, typename E>
+Producer<T> PUntilError(const Producer<T>& p, ErrorChannel<E>* errors) {
+  return [=](const Consumer<T>& c) {
+    p([&](const T& x) {
+      if (!errors->stopped()) {
+        c(x);
+      }
+    });
+  };
+}
+
+// Produces the elements of a vector until a channel stops. Unlike the
+// producer version, this stops iterating rather than merely dropping
+// the rest of the elements.
+template <typename T, typename E>
+Producer<T> PUntilError(std::vector<T> xs, ErrorChannel<E>* errors) {
+  return [=](const Consumer<T>& c) {
+    for (size_t i = 0; i < xs.size() && !errors->stopped(); ++i) {
+      c(xs[i]);
+    }
+  };
+}
+
+#endif  // EXPECTED_H_
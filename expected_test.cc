@@ -0,0 +1,137 @@
+// Tests for errors as values.
+
+#include "expected.h"
+
+#include <string>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+typedef Expected<int, string> ExpectedInt;
+
+ExpectedInt Parse(string s) {
+  if (s.empty() || s.find_first_not_of("0123456789") != string::npos) {
+    return MakeUnexpected("not a number: " + s);
+  }
+  return std::stoi(s);
+}
+
+template <typename T>
+Producer<T> Produce(vector<T> xs) {
+  return [=](const Consumer<T>& c) {
+    for (const T& x : xs) c(x);
+  };
+}
+
+template <typename T>
+vector<T> Collect(const Producer<T>& p) {
+  vector<T> xs;
+  p([&](const T& x) { xs.push_back(x); });
+  return xs;
+}
+
+}  // namespace
+
+TEST(Expected, HoldsAValueOrAnError) {
+  ExpectedInt x = 42;
+  ASSERT_TRUE(x.has_value());
+  EXPECT_EQ(42, *x);
+  EXPECT_EQ(42, x.value_or(0));
+
+  ExpectedInt e = MakeUnexpected(string("bad"));
+  ASSERT_FALSE(e);
+  EXPECT_EQ("bad", e.error());
+  EXPECT_EQ(7, e.value_or(7));
+
+  // Values and errors of the same type are still told apart.
+  Expected<string, string> s = string("value");
+  Expected<string, string> t = MakeUnexpected(string("value"));
+  EXPECT_TRUE(s.has_value());
+  EXPECT_FALSE(t.has_value());
+  EXPECT_NE(s, t);
+}
+
+TEST(Expected, EFmapAndEBindPassErrorsThrough) {
+  auto p = Produce<ExpectedInt>({1, MakeUnexpected(string("e")), 3});
+  auto doubled = Collect(EFmap(Fn<int, int>([](int x) { return 2 * x; }), p));
+  EXPECT_EQ((vector<ExpectedInt>{2, MakeUnexpected(string("e")), 6}),
+            doubled);
+
+  Filter<int, ExpectedInt> twice_or_fail = [](int x) -> Producer<ExpectedInt> {
+    if (x == 3) return PUnit(ExpectedInt(MakeUnexpected(string("three"))));
+    return PUnit(ExpectedInt(x)) + PUnit(ExpectedInt(x));
+  };
+  EXPECT_EQ((vector<ExpectedInt>{1, 1, MakeUnexpected(string("e")),
+                                 MakeUnexpected(string("three"))}),
+            Collect(EBind(p, twice_or_fail)));
+}
+
+TEST(ErrorChannel, StopsAtTheFirstError) {
+  ErrorChannel<string> errors;
+  int parsed = 0;
+  Fn<string, ExpectedInt> parse = [&](string s) {
+    ++parsed;
+    return Parse(s);
+  };
+  auto numbers = PUntilError(vector<string>{"1", "2", "x", "4", "y"},
+                             &errors) | TryMap(parse, &errors);
+  EXPECT_EQ((vector<int>{1, 2}), Collect(numbers));
+  EXPECT_EQ(3, parsed);  // The source stopped after the error.
+  ASSERT_FALSE(errors.ok());
+  EXPECT_EQ("not a number: x", errors.first());
+  EXPECT_EQ(1u, errors.errors().size());
+  EXPECT_TRUE(errors.stopped());
+
+  errors.Reset();
+  EXPECT_TRUE(errors.ok());
+  EXPECT_FALSE(errors.stopped());
+}
+
+TEST(ErrorChannel, CollectsErrorsAndContinues) {
+  ErrorChannel<string> errors(ErrorMode::kCollectAndContinue);
+  auto numbers = PUntilError(Produce<string>({"1", "x", "3", "y", "5"}),
+                             &errors) | TryMap(Parse, &errors);
+  EXPECT_EQ((vector<int>{1, 3, 5}), Collect(numbers));
+  EXPECT_EQ((vector<string>{"not a number: x", "not a number: y"}),
+            errors.errors());
+  EXPECT_FALSE(errors.stopped());
+}
+
+TEST(ErrorChannel, StopsLaterStagesWithoutCallingThem) {
+  ErrorChannel<string> errors;
+  int calls = 0;
+  Filter<int, ExpectedInt> checked = [&](int x) -> Producer<ExpectedInt> {
+    ++calls;
+    if (x < 0) return PUnit(ExpectedInt(MakeUnexpected(string("negative"))));
+    return PUnit(ExpectedInt(x));
+  };
+  // A source that cannot be stopped still has its values dropped.
+  auto p = Produce<int>({1, -2, 3, 4}) | Try(checked, &errors);
+  EXPECT_EQ((vector<int>{1}), Collect(p));
+  EXPECT_EQ(2, calls);
+  EXPECT_EQ("negative", errors.first());
+}
+
+TEST(ErrorChannel, SplitsValuesFromErrors) {
+  ErrorChannel<string> errors(ErrorMode::kCollectAndContinue);
+  auto p = Produce<ExpectedInt>({1, MakeUnexpected(string("a")), 2,
+                                 MakeUnexpected(string("b"))});
+  EXPECT_EQ((vector<int>{1, 2}), Collect(Values(p, &errors)));
+  EXPECT_EQ((vector<string>{"a", "b"}), errors.errors());
+
+  ErrorChannel<string> first;
+  EXPECT_EQ((vector<int>{1}), Collect(Values(p, &first)));
+  EXPECT_EQ((vector<string>{"a"}), first.errors());
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
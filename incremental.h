@@ -0,0 +1,152 @@
+// Incremental re-evaluation of read-write pipelines.  -*- c++ -*-
+//
+// An Incremental<P, E, F> keeps the output of the read-write pipeline
+// elements * query up to date while a P is being mutated. Here
+// elements is a filter that visits the elements of some repeated
+// field of P, such as a company's teams, and query is a filter that
+// runs on each of those elements, such as the names of a team's
+// members.
+//
+// The output of the query is cached per element. Mutations made
+// through the Modify methods are tracked, and only the elements that
+// a mutation actually changed are re-queried afterward. Thus an edit
+// to one team costs a traversal of that team, not of the company.
+//
+// Mutations made behind the back of the Incremental, and mutations
+// that add or remove elements, are not tracked; call Invalidate()
+// after making them.
+
+#ifndef INCREMENTAL_H_
+#define INCREMENTAL_H_
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "read_write_filters.h"
+
+// Whether values of type T can be compared with ==.
+template <typename T, typename = void>
+struct _EqualityComparable : std::false_type {};
+template <typename T>
+struct _EqualityComparable<T, std::void_t<decltype(
+    std::declval<const T&>() == std::declval<const T&>())>>
+    : std::true_type {};
+
+template <typename P, typename E, typename F>
+class Incremental {
+public:
+  Incremental(const RWFilter<P, E>& elements, const RWFilter<E, F>& query,
+              P* p)
+      : elements_(elements), query_(query), p_(p), count_(0), requeried_(0) {
+    Invalidate();
+  }
+
+  // Re-runs the query on every element.
+  void Invalidate() {
+    elems_.clear();
+    ReadWrite(elements_)(p_)([this](E* e) { elems_.push_back(e); });
+    outputs_.assign(elems_.size(), std::vector<F>());
+    count_ = 0;
+    for (size_t i = 0; i < elems_.size(); ++i) {
+      Requery(i);
+    }
+  }
+
+  // Mutates the fields visited by accessor, in every element, with
+  // mutator. Only the elements in which mutator changed a field are
+  // re-queried afterward. Fields that cannot be compared with == are
+  // taken to have changed whenever mutator was called on them.
+  template <typename G>
+  void Modify(const RWFilter<E, G>& accessor, const Consumer<G*>& mutator) {
+    auto rw_accessor = ReadWrite(accessor);
+    std::vector<size_t> changed;
+    for (size_t i = 0; i < elems_.size(); ++i) {
+      bool changed_i = false;
+      rw_accessor(elems_[i])([&](G* g) {
+        if constexpr (_EqualityComparable<G>::value) {
+          G before = *g;
+          mutator(g);
+          changed_i = changed_i || !(*g == before);
+        } else {
+          mutator(g);
+          changed_i = true;
+        }
+      });
+      if (changed_i) {
+        changed.push_back(i);
+      }
+    }
+    for (size_t i : changed) {
+      Requery(i);
+    }
+  }
+
+  // Mutates the i-th element with mutator and re-queries it.
+  void Modify(size_t i, const Consumer<E*>& mutator) {
+    if (i >= elems_.size()) {
+      throw std::out_of_range("element " + std::to_string(i) + " of " +
+                              std::to_string(elems_.size()));
+    }
+    mutator(elems_[i]);
+    Requery(i);
+  }
+
+  // The number of values the pipeline currently produces.
+  size_t count() const { return count_; }
+
+  // The values the pipeline currently produces, in order.
+  std::vector<F> Collect() const {
+    std::vector<F> values;
+    values.reserve(count_);
+    for (const std::vector<F>& output : outputs_) {
+      values.insert(values.end(), output.begin(), output.end());
+    }
+    return values;
+  }
+
+  // Sends the values the pipeline currently produces to c, in order.
+  void operator()(const Consumer<const F&>& c) const {
+    for (const std::vector<F>& output : outputs_) {
+      for (const F& value : output) {
+        c(value);
+      }
+    }
+  }
+
+  // The number of times an element has been (re-)queried. Useful for
+  // verifying that edits stay cheap.
+  size_t requeried() const { return requeried_; }
+
+private:
+  void Requery(size_t i) {
+    std::vector<F>& output = outputs_[i];
+    count_ -= output.size();
+    output.clear();
+    ReadOnly(query_)(*elems_[i])([&](const F& value) {
+      output.push_back(value);
+    });
+    count_ += output.size();
+    ++requeried_;
+  }
+
+  RWFilter<P, E> elements_;
+  RWFilter<E, F> query_;
+  P* p_;
+  std::vector<E*> elems_;
+  std::vector<std::vector<F>> outputs_;
+  size_t count_;
+  size_t requeried_;
+};
+
+template <typename P, typename E, typename F>
+Incremental<P, E, F> MakeIncremental(const RWFilter<P, E>& elements,
+                                     const RWFilter<E, F>& query, P* p) {
+  return Incremental<P, E, F>(elements, query, p);
+}
+
+#endif  // INCREMENTAL_H_
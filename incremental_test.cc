@@ -0,0 +1,101 @@
+// Tests for incremental re-evaluation of read-write pipelines.
+
+#include "incremental.h"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "read_write_filters.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Team {
+  string name;
+  vector<string> members;
+};
+
+struct Company {
+  vector<Team> teams;
+};
+
+// Read-write filters over the fields of a repeated field.
+template <typename P, typename F>
+RWFilter<P, F> Scan(vector<F> P::*field) {
+  return [=](const RW<P>& rwp) {
+    return Producer<RW<F>>([=](const Consumer<RW<F>>& c) {
+      const vector<F>& ro = rwp.ro.*field;
+      for (size_t i = 0; i < ro.size(); ++i) {
+        c(RW<F>{ro[i], rwp.rw ? &(rwp.rw->*field)[i] : nullptr});
+      }
+    });
+  };
+}
+
+template <typename P, typename F>
+RWFilter<P, F> Field(F P::*field) {
+  return [=](const RW<P>& rwp) {
+    return PUnit(RW<F>{rwp.ro.*field, rwp.rw ? &(rwp.rw->*field) : nullptr});
+  };
+}
+
+}  // namespace
+
+TEST(Incremental, OnlyChangedElementsAreRequeried) {
+  Company company{{{"A", {"a1", "a2"}}, {"B", {"b1"}}, {"C", {}}}};
+  auto teams = Scan(&Company::teams);
+  auto members = Scan(&Team::members);
+  auto team_name = Field(&Team::name);
+
+  auto view = MakeIncremental(teams, members, &company);
+  EXPECT_EQ(3u, view.requeried());
+  EXPECT_EQ(3u, view.count());
+  EXPECT_EQ(vector<string>({"a1", "a2", "b1"}), view.Collect());
+
+  // Rename the members of team B only.
+  view.Modify(members, Consumer<string*>([](string* name) {
+    if (name->at(0) == 'b') {
+      *name += "!";
+    }
+  }));
+  // The mutator visited every member, but changed only team B's, so
+  // only team B is requeried.
+  EXPECT_EQ(4u, view.requeried());
+  EXPECT_EQ(vector<string>({"a1", "a2", "b1!"}), view.Collect());
+
+  // Tracked mutations of a single team requery just that team.
+  view.Modify(2, [](Team* t) { t->members.push_back("c1"); });
+  EXPECT_EQ(5u, view.requeried());
+  EXPECT_EQ(4u, view.count());
+  EXPECT_THROW(view.Modify(3, [](Team*) {}), std::out_of_range);
+  EXPECT_EQ(5u, view.requeried());
+
+  // Mutations of other fields only requery the teams they changed.
+  view.Modify(team_name, Consumer<string*>([](string* name) {
+    *name += " team";
+  }));
+  EXPECT_EQ(8u, view.requeried());
+
+  // The view must agree with a full re-run of the pipeline.
+  vector<string> full;
+  ReadOnly(teams * members)(company)([&](const string& s) {
+    full.push_back(s);
+  });
+  EXPECT_EQ(full, view.Collect());
+
+  // Untracked structural changes require invalidation.
+  company.teams.push_back({"D", {"d1"}});
+  view.Invalidate();
+  EXPECT_EQ(vector<string>({"a1", "a2", "b1!", "c1", "d1"}), view.Collect());
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,527 @@
+// Producers and filters for JSON-lines data.  -*- c++ -*-
+//
+// JSON lines are parsed lazily. A buffer of lines is first scanned
+// for its structural characters -- braces, brackets, colons, commas,
+// quotes, and newlines outside of strings -- with a vectorized
+// classifier, and the positions found are recorded in a structural
+// index. Documents are then exposed as JsonValues: zero-copy views
+// that navigate the index to find the fields asked for. Nothing is
+// decoded until a field is converted to a C++ value, so only the
+// fields a pipeline touches ever cost more than the scan.
+//
+// Navigation is done with filters, in the style of the accessors in
+// read_write_filters.h:
+//
+//   auto names = ReadJsonLines("events.jsonl") |
+//       (JsonPath("user.name") * JsonAs<std::string>());
+//
+// JsonValues, and string_views taken from them, are valid only while
+// the consumer they were passed to is running. The parser is
+// forgiving: malformed documents do not cause errors, but fields that
+// cannot be made sense of are reported as missing.
+
+#ifndef JSON_LINES_H_
+#define JSON_LINES_H_
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "consumers_and_producers.h"
+#include "text_producers.h"
+
+class JsonValue;
+
+// The structural index of a buffer of JSON lines.
+class _JsonIndex {
+public:
+  static constexpr uint32_t kNone = UINT32_MAX;
+
+  // Indexes buffer, which must outlive the index.
+  void Build(std::string_view buffer) {
+    text_ = buffer.data();
+    end_ = buffer.data() + buffer.size();
+    pos_.clear();
+    match_.clear();
+    pos_.reserve(buffer.size() / 8);
+    in_string_ = false;
+    escaped_ = kNone;
+    stack_.clear();
+    const char* p = text_;
+#if defined(__AVX2__)
+    for (; end_ - p >= 32; p += 32) {
+      __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+      __m256i hits = _mm256_setzero_si256();
+      for (char c : kCandidates) {
+        hits = _mm256_or_si256(
+            hits, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(c)));
+      }
+      AddCandidates(p, static_cast<uint32_t>(_mm256_movemask_epi8(hits)));
+    }
+#endif
+#if defined(__SSE2__)
+    for (; end_ - p >= 16; p += 16) {
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      __m128i hits = _mm_setzero_si128();
+      for (char c : kCandidates) {
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+      }
+      AddCandidates(p, static_cast<uint32_t>(_mm_movemask_epi8(hits)));
+    }
+#endif
+    for (; p < end_; ++p) {
+      if (std::memchr(kCandidates, *p, sizeof(kCandidates))) {
+        Add(p);
+      }
+    }
+    Close();
+  }
+
+  // Sends the root values of the indexed documents to c.
+  template <typename F>
+  void ForEachDocument(const F& f) const;
+
+private:
+  friend class JsonValue;
+
+  static constexpr char kCandidates[9] =
+      { '{', '}', '[', ']', ':', ',', '"', '\\', '\n' };
+
+  void AddCandidates(const char* block, uint32_t mask) {
+    while (mask) {
+      Add(block + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+
+  void Add(const char* p) {
+    uint32_t offset = static_cast<uint32_t>(p - text_);
+    if (in_string_) {
+      if (offset == escaped_) {
+        return;  // An escaped quote or backslash.
+      }
+      if (*p == '\\') {
+        escaped_ = offset + 1;
+      } else if (*p == '"') {
+        in_string_ = false;
+        Push(offset);
+      } else if (*p == '\n') {
+        in_string_ = false;  // Strings cannot span lines.
+        Push(offset);
+        Close();
+      }
+      return;
+    }
+    switch (*p) {
+      case '\\':
+        return;
+      case '"':
+        in_string_ = true;
+        break;
+      case '{':
+      case '[':
+        stack_.push_back(static_cast<uint32_t>(pos_.size()));
+        break;
+      case '}':
+      case ']':
+        if (!stack_.empty()) {
+          match_[stack_.back()] = static_cast<uint32_t>(pos_.size());
+          stack_.pop_back();
+        }
+        break;
+      case '\n':
+        Push(offset);
+        Close();
+        return;
+    }
+    Push(offset);
+  }
+
+  void Push(uint32_t offset) {
+    pos_.push_back(offset);
+    match_.push_back(kNone);
+  }
+
+  // Ends a document. Unbalanced brackets are left unmatched.
+  void Close() { stack_.clear(); }
+
+  char At(uint32_t i) const { return text_[pos_[i]]; }
+
+  const char* text_;
+  const char* end_;
+  std::vector<uint32_t> pos_;    // Offsets of structural characters.
+  std::vector<uint32_t> match_;  // For each '{' or '[', its closer's index.
+  bool in_string_;
+  uint32_t escaped_;
+  std::vector<uint32_t> stack_;
+};
+
+// A lazily parsed view of a JSON value.
+class JsonValue {
+public:
+  enum Kind { kMissing, kNull, kBool, kNumber, kString, kArray, kObject };
+
+  JsonValue()
+      : index_(nullptr), kind_(kMissing), begin_(nullptr), end_(nullptr),
+        first_(0), next_(0), doc_end_(0) {}
+
+  Kind kind() const { return kind_; }
+  bool missing() const { return kind_ == kMissing; }
+
+  // The text of the value, e.g., "[1, 2]" or "\"a\\nb\"".
+  std::string_view raw() const {
+    return std::string_view(begin_, end_ - begin_);
+  }
+
+  // Looks up a member of an object. Keys are compared without
+  // decoding their escapes.
+  JsonValue operator[](std::string_view key) const {
+    JsonValue found;
+    ForEachMember([&](std::string_view k, const JsonValue& v) {
+      if (k == key) {
+        found = v;
+        return false;
+      }
+      return true;
+    });
+    return found;
+  }
+
+  // Looks up an element of an array.
+  JsonValue operator[](size_t i) const {
+    JsonValue found;
+    ForEachElement([&](const JsonValue& v) {
+      if (i-- == 0) {
+        found = v;
+        return false;
+      }
+      return true;
+    });
+    return found;
+  }
+
+  // Looks up a dotted path of member names, e.g., "user.name".
+  JsonValue Path(std::string_view path) const {
+    JsonValue v = *this;
+    while (!v.missing()) {
+      size_t dot = path.find('.');
+      v = v[path.substr(0, dot)];
+      if (dot == std::string_view::npos) {
+        break;
+      }
+      path.remove_prefix(dot + 1);
+    }
+    return v;
+  }
+
+  // Calls f(key, value) on each member of an object until f returns false.
+  template <typename F>
+  void ForEachMember(const F& f) const {
+    if (kind_ != kObject) {
+      return;
+    }
+    for (uint32_t j = first_ + 1; j + 2 < doc_end_ && index_->At(j) == '"'; ) {
+      if (index_->At(j + 1) != '"' || index_->At(j + 2) != ':') {
+        return;
+      }
+      std::string_view key(index_->text_ + index_->pos_[j] + 1,
+                           index_->pos_[j + 1] - index_->pos_[j] - 1);
+      JsonValue v = After(j + 2);
+      if (v.missing() || !f(key, v)) {
+        return;
+      }
+      if (v.next_ >= doc_end_ || index_->At(v.next_) != ',') {
+        return;
+      }
+      j = v.next_ + 1;
+    }
+  }
+
+  // Calls f(element) on each element of an array until f returns false.
+  template <typename F>
+  void ForEachElement(const F& f) const {
+    if (kind_ != kArray) {
+      return;
+    }
+    for (uint32_t j = first_; ; ) {
+      JsonValue v = After(j);
+      if (v.missing() || !f(v)) {
+        return;
+      }
+      if (v.next_ >= doc_end_ || index_->At(v.next_) != ',') {
+        return;
+      }
+      j = v.next_;
+    }
+  }
+
+  // Conversions to C++ values. Each returns false, leaving *x
+  // unspecified, if the value is missing or of the wrong kind.
+  bool Get(bool* x) const {
+    *x = raw() == "true";
+    return kind_ == kBool;
+  }
+  bool Get(int64_t* x) const { return GetNumber(x); }
+  bool Get(int* x) const { return GetNumber(x); }
+  bool Get(double* x) const { return GetNumber(x); }
+  // The contents of a string, with its escapes left undecoded.
+  bool Get(std::string_view* x) const {
+    if (kind_ != kString) {
+      return false;
+    }
+    *x = std::string_view(begin_ + 1, end_ - begin_ - 2);
+    return true;
+  }
+  // The contents of a string, decoded.
+  bool Get(std::string* x) const {
+    std::string_view s;
+    if (!Get(&s)) {
+      return false;
+    }
+    x->clear();
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (s[i] != '\\' || i + 1 == s.size()) {
+        x->push_back(s[i]);
+        continue;
+      }
+      switch (char c = s[++i]) {
+        case 'b': x->push_back('\b'); break;
+        case 'f': x->push_back('\f'); break;
+        case 'n': x->push_back('\n'); break;
+        case 'r': x->push_back('\r'); break;
+        case 't': x->push_back('\t'); break;
+        case 'u': {
+          uint32_t cp = 0;
+          if (!Hex4(s, i + 1, &cp)) {
+            return false;
+          }
+          i += 4;
+          uint32_t low = 0;
+          if (cp >= 0xd800 && cp < 0xdc00 && i + 2 < s.size() &&
+              s[i + 1] == '\\' && s[i + 2] == 'u' && Hex4(s, i + 3, &low) &&
+              low >= 0xdc00 && low < 0xe000) {
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            i += 6;
+          }
+          AppendUtf8(cp, x);
+          break;
+        }
+        default: x->push_back(c); break;
+      }
+    }
+    return true;
+  }
+
+private:
+  friend class _JsonIndex;
+
+  // The value that follows the structural character at index i, or
+  // that begins a document if i is kNone.
+  static JsonValue At(const _JsonIndex* index, uint32_t i, uint32_t doc_end,
+                      const char* text_end) {
+    JsonValue v;
+    v.index_ = index;
+    v.doc_end_ = doc_end;
+    uint32_t next = i == _JsonIndex::kNone ? 0 : i + 1;
+    const char* p = i == _JsonIndex::kNone ?
+        index->text_ : index->text_ + index->pos_[i] + 1;
+    const char* stop = next < doc_end ? index->text_ + index->pos_[next] :
+        text_end;
+    while (p < stop && IsSpace(*p)) {
+      ++p;
+    }
+    v.begin_ = p;
+    if (p < stop) {
+      // A scalar, which ends at the next structural character.
+      while (stop > p && IsSpace(stop[-1])) {
+        --stop;
+      }
+      v.end_ = stop;
+      v.next_ = next;
+      v.kind_ = *p == 't' || *p == 'f' ? kBool : *p == 'n' ? kNull : kNumber;
+      return v;
+    }
+    if (next >= doc_end) {
+      return JsonValue();
+    }
+    v.first_ = next;
+    switch (index->At(next)) {
+      case '{':
+      case '[': {
+        uint32_t close = index->match_[next];
+        if (close == _JsonIndex::kNone || close >= doc_end) {
+          return JsonValue();
+        }
+        v.kind_ = index->At(next) == '{' ? kObject : kArray;
+        v.end_ = index->text_ + index->pos_[close] + 1;
+        v.next_ = close + 1;
+        return v;
+      }
+      case '"':
+        if (next + 1 >= doc_end || index->At(next + 1) != '"') {
+          return JsonValue();
+        }
+        v.kind_ = kString;
+        v.end_ = index->text_ + index->pos_[next + 1] + 1;
+        v.next_ = next + 2;
+        return v;
+      default:
+        return JsonValue();  // An empty value, e.g., in "[]" or "[1,,2]".
+    }
+  }
+
+  JsonValue After(uint32_t i) const {
+    return At(index_, i, doc_end_, index_->end_);
+  }
+
+  template <typename T>
+  bool GetNumber(T* x) const {
+    if (kind_ != kNumber) {
+      return false;
+    }
+    std::from_chars_result result = std::from_chars(begin_, end_, *x);
+    return result.ec == std::errc() && result.ptr == end_;
+  }
+
+  static bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  }
+
+  static bool Hex4(std::string_view s, size_t i, uint32_t* cp) {
+    if (i + 4 > s.size()) {
+      return false;
+    }
+    *cp = 0;
+    for (size_t j = i; j < i + 4; ++j) {
+      char c = s[j];
+      int digit = c >= '0' && c <= '9' ? c - '0' :
+          c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+          c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+      if (digit < 0) {
+        return false;
+      }
+      *cp = *cp * 16 + digit;
+    }
+    return true;
+  }
+
+  static void AppendUtf8(uint32_t cp, std::string* x) {
+    if (cp < 0x80) {
+      x->push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+      x->push_back(static_cast<char>(0xc0 | (cp >> 6)));
+      x->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+      x->push_back(static_cast<char>(0xe0 | (cp >> 12)));
+      x->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+      x->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else {
+      x->push_back(static_cast<char>(0xf0 | (cp >> 18)));
+      x->push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+      x->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+      x->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    }
+  }
+
+  const _JsonIndex* index_;
+  Kind kind_;
+  const char* begin_;
+  const char* end_;
+  uint32_t first_;    // Index of the value's opening '{', '[', or '"'.
+  uint32_t next_;     // Index of the structural character after the value.
+  uint32_t doc_end_;  // Index of the newline that ends the document.
+};
+
+template <typename F>
+void _JsonIndex::ForEachDocument(const F& f) const {
+  uint32_t start = kNone;  // The newline before the document.
+  const char* text_end = text_;
+  for (uint32_t i = 0; ; ++i) {
+    while (i < pos_.size() && At(i) != '\n') {
+      ++i;
+    }
+    text_end = i < pos_.size() ? text_ + pos_[i] : end_;
+    JsonValue doc = JsonValue::At(this, start, i, text_end);
+    if (!doc.missing()) {
+      f(doc);
+    }
+    if (i >= pos_.size()) {
+      return;
+    }
+    start = i;
+  }
+}
+
+// Produces the documents of a buffer of JSON lines.
+inline Producer<JsonValue> JsonLines(std::string_view buffer) {
+  return [=](const Consumer<JsonValue>& c) {
+    _JsonIndex index;
+    index.Build(buffer);
+    index.ForEachDocument(c);
+  };
+}
+
+// Produces the documents of a file of JSON lines. The file is mapped,
+// and indexed one buffer of lines at a time.
+inline Producer<JsonValue> ReadJsonLines(const std::string& path,
+                                         size_t buffer_size = 1 << 20) {
+  return [=](const Consumer<JsonValue>& c) {
+    MappedFile file(path);
+    _JsonIndex index;
+    const char* p = file.data();
+    const char* end = p + file.size();
+    while (p < end) {
+      // Buffers end after a newline, unless a line is longer than a buffer.
+      const char* stop = end - p > static_cast<ptrdiff_t>(buffer_size) ?
+          p + buffer_size : end;
+      if (stop < end) {
+        const void* newline = ::memrchr(p, '\n', stop - p);
+        stop = newline ? static_cast<const char*>(newline) + 1 :
+            _FindByte(stop, end, '\n');
+      }
+      index.Build(std::string_view(p, stop - p));
+      index.ForEachDocument(c);
+      p = stop;
+    }
+  };
+}
+
+// A filter that produces the value at a dotted path of member names,
+// if there is one.
+inline Filter<JsonValue, JsonValue> JsonPath(const std::string& path) {
+  return [=](const JsonValue& v) {
+    JsonValue found = v.Path(path);
+    return found.missing() ? PZero<JsonValue>() : PUnit(found);
+  };
+}
+
+// A filter that scans the elements of an array.
+inline Filter<JsonValue, JsonValue> JsonElements() {
+  return [](const JsonValue& v) {
+    return Producer<JsonValue>([v](const Consumer<JsonValue>& c) {
+      v.ForEachElement([&](const JsonValue& e) {
+        c(e);
+        return true;
+      });
+    });
+  };
+}
+
+// A filter that converts values to Ts, if they can be.
+template <typename T>
+Filter<JsonValue, T> JsonAs() {
+  return [](const JsonValue& v) {
+    T x{};
+    return v.Get(&x) ? PUnit(x) : PZero<T>();
+  };
+}
+
+#endif  // JSON_LINES_H_
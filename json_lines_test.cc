@@ -0,0 +1,119 @@
+// Tests for producers and filters for JSON-lines data.
+
+#include "json_lines.h"
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+template <typename T>
+vector<T> Collect(const Producer<T>& p) {
+  vector<T> ts;
+  p([&](const T& t) { ts.push_back(t); });
+  return ts;
+}
+
+vector<string> Raw(const Producer<JsonValue>& p) {
+  vector<string> raws;
+  p([&](const JsonValue& v) { raws.emplace_back(v.raw()); });
+  return raws;
+}
+
+const char kEvents[] =
+    "{\"id\": 1, \"user\": {\"name\": \"Ann\", \"tags\": [\"a\", \"b\"]}}\n"
+    "\n"
+    "  {\"id\":2,\"user\":{\"name\":\"Bo \\\"B\\\" \\u00e9\\ud83d\\ude00\"},"
+    "\"ok\":true}\r\n"
+    "{\"id\": 3, \"skip\": {\"user\": {\"name\": \"no\"}}, \"user\": null}\n"
+    "[1, [2, 3], {\"x\": [4]}, \"}\", 5.5]";
+
+}  // namespace
+
+TEST(JsonLines, ProducesDocuments) {
+  EXPECT_EQ(vector<string>({
+        "{\"id\": 1, \"user\": {\"name\": \"Ann\", \"tags\": [\"a\", \"b\"]}}",
+        "{\"id\":2,\"user\":{\"name\":\"Bo \\\"B\\\" \\u00e9\\ud83d\\ude00\"},"
+        "\"ok\":true}",
+        "{\"id\": 3, \"skip\": {\"user\": {\"name\": \"no\"}}, \"user\": null}",
+        "[1, [2, 3], {\"x\": [4]}, \"}\", 5.5]"}),
+    Raw(JsonLines(kEvents)));
+  EXPECT_EQ(vector<string>({"1", "\"x\"", "null"}),
+            Raw(JsonLines("1\n\"x\"\n\n null ")));
+}
+
+TEST(JsonLines, FiltersNavigateByPath) {
+  auto events = JsonLines(kEvents);
+  EXPECT_EQ(vector<int64_t>({1, 2, 3}),
+            Collect(events | (JsonPath("id") * JsonAs<int64_t>())));
+  EXPECT_EQ(vector<string>({"Ann", "Bo \"B\" é\U0001F600"}),
+            Collect(events | (JsonPath("user.name") * JsonAs<string>())));
+  EXPECT_EQ(vector<string>({"a", "b"}),
+            Collect(events | (JsonPath("user.tags") * JsonElements() *
+                              JsonAs<string>())));
+  EXPECT_EQ(vector<bool>({true}),
+            Collect(events | (JsonPath("ok") * JsonAs<bool>())));
+  // Missing fields and fields of the wrong kind produce nothing.
+  EXPECT_EQ(vector<string>({}),
+            Collect(events | (JsonPath("user.nope") * JsonAs<string>())));
+  EXPECT_EQ(vector<string>({}),
+            Collect(events | (JsonPath("id") * JsonAs<string>())));
+}
+
+TEST(JsonLines, ValuesNavigateArrays) {
+  vector<string> raws;
+  JsonLines(kEvents)([&](const JsonValue& doc) {
+    if (doc.kind() == JsonValue::kArray) {
+      for (size_t i = 0; i < 6; ++i) {
+        raws.emplace_back(doc[i].raw());
+      }
+      raws.emplace_back(doc[2]["x"][0].raw());
+    }
+  });
+  EXPECT_EQ(vector<string>({"1", "[2, 3]", "{\"x\": [4]}", "\"}\"", "5.5", "",
+                            "4"}),
+            raws);
+}
+
+TEST(JsonLines, MalformedDocumentsHaveMissingFields) {
+  auto docs = JsonLines("{\"a\": [1, 2}\n{\"a\": \"open\n{\"a\": 3}\n{,}");
+  EXPECT_EQ(vector<int>({3}), Collect(docs | (JsonPath("a") * JsonAs<int>())));
+}
+
+TEST(JsonLines, ReadsFilesInBuffers) {
+  string contents;
+  for (int i = 0; i < 1000; ++i) {
+    contents += "{\"i\": " + std::to_string(i) + ", \"pad\": \"" +
+        string(i % 50, 'x') + "\"}\n";
+  }
+  string path = ::testing::TempDir() + "json_lines_test." +
+      std::to_string(::getpid());
+  std::FILE* f = std::fopen(path.c_str(), "wb");
+  std::fwrite(contents.data(), 1, contents.size(), f);
+  std::fclose(f);
+  // Small buffers, so that lines straddle buffer boundaries.
+  auto is = Collect(ReadJsonLines(path, 100) |
+                    (JsonPath("i") * JsonAs<int>()));
+  std::remove(path.c_str());
+  ASSERT_EQ(1000u, is.size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(i, is[i]);
+  }
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
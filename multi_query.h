@@ -0,0 +1,109 @@
+// Running many queries over the same input in one pass.  -*- c++ -*-
+//
+// A MultiQuery holds many independently built plans over the same
+// input type, each with its own consumer. The plans are merged into a
+// single traversal tree in which queries that start with the same
+// stages share them: a shared stage runs once per input, and its
+// outputs are routed to the remaining stages of every query that
+// shares it. Thus
+//
+//   MultiQuery<Company, string> mq;
+//   mq.Add(teams * team_name, c1);
+//   mq.Add(teams * members * person_name, c2);
+//
+// visits each of a company's teams once, not twice. Each consumer
+// sees exactly the values, in exactly the order, that it would have
+// seen had its query been run by itself.
+//
+// Stages are shared by identity: two queries share a stage only if
+// they were built from the same Plan object (or, for chains, the same
+// plans for the stages in question). The usual way to arrange that is
+// to build a plan once for every accessor and reuse it in all queries.
+
+#ifndef MULTI_QUERY_H_
+#define MULTI_QUERY_H_
+
+#include <memory>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "pipeline_optimizer.h"
+
+template <typename In, typename Out>
+class MultiQuery {
+public:
+  typedef In argument_type;
+  typedef Out value_type;
+
+  MultiQuery() : root_(new Node(nullptr)) {}
+
+  // Adds a query whose outputs are to be sent to consumer c.
+  void Add(const Plan<In, Out>& query, const Consumer<Out>& c) {
+    const _PlanNode::Ptr& plan = query.node();
+    if (plan->kind == _PlanNode::kZero) {
+      return;
+    }
+    Node* node = root_.get();
+    if (plan->kind == _PlanNode::kChain) {
+      for (const _PlanNode::Ptr& stage : plan->parts) {
+        node = node->Child(stage);
+      }
+    } else {
+      node = node->Child(plan);
+    }
+    node->consumers.push_back(c);
+  }
+
+  // Runs all of the queries on x.
+  void operator()(const In& x) const { root_->Run(&x); }
+
+  // The number of distinct stages in the merged traversal tree.
+  size_t stages() const { return root_->Size() - 1; }
+
+private:
+  struct Node {
+    explicit Node(_PlanNode::Ptr s) : stage(std::move(s)) {}
+
+    Node* Child(const _PlanNode::Ptr& s) {
+      for (const auto& child : children) {
+        if (child->stage == s) {
+          return child.get();
+        }
+      }
+      children.emplace_back(new Node(s));
+      return children.back().get();
+    }
+
+    void Run(const void* in) const {
+      for (const Consumer<Out>& c : consumers) {
+        c(*static_cast<const _PlanValue<Out>*>(in));
+      }
+      for (const auto& child : children) {
+        const Node* next = child.get();
+        next->stage->Run(in, [next](const void* out) { next->Run(out); });
+      }
+    }
+
+    size_t Size() const {
+      size_t size = 1;
+      for (const auto& child : children) {
+        size += child->Size();
+      }
+      return size;
+    }
+
+    _PlanNode::Ptr stage;
+    std::vector<std::unique_ptr<Node>> children;
+    std::vector<Consumer<Out>> consumers;
+  };
+
+  std::shared_ptr<Node> root_;
+};
+
+// A multi-query consumes inputs by running all of its queries on them.
+template <typename In, typename Out>
+Consumer<In> AsConsumer(const MultiQuery<In, Out>& mq) {
+  return [mq](const In& x) { mq(x); };
+}
+
+#endif  // MULTI_QUERY_H_
@@ -0,0 +1,89 @@
+// Tests for running many queries over the same input in one pass.
+
+#include "multi_query.h"
+
+#include <string>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "pipeline_optimizer.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Team {
+  string name;
+  vector<string> members;
+};
+
+struct Company {
+  vector<Team> teams;
+};
+
+template <typename T>
+Consumer<T> Recorder(vector<T>* record) {
+  return [record](T x) { record->push_back(x); };
+}
+
+}  // namespace
+
+TEST(MultiQuery, QueriesShareCommonPrefixes) {
+  Company company{{{"A", {"a1", "a2"}}, {"B", {"b1"}}}};
+
+  // Count how often the company's teams are scanned.
+  int team_scans = 0;
+  auto teams = AsPlan(Filter<Company, Team>{[&](const Company& c) {
+    ++team_scans;
+    return Producer<Team>([&c](const Consumer<Team>& consumer) {
+      for (const Team& t : c.teams) {
+        consumer(t);
+      }
+    });
+  }});
+  auto team_name = AsPlan(Filter<Team, string>{[](const Team& t) {
+    return PUnit(t.name);
+  }});
+  auto members = AsPlan(Filter<Team, string>{[](const Team& t) {
+    return Producer<string>([t](const Consumer<string>& consumer) {
+      for (const string& m : t.members) {
+        consumer(m);
+      }
+    });
+  }});
+
+  vector<string> names, member_names, both;
+  MultiQuery<Company, string> mq;
+  mq.Add(teams * team_name, Recorder(&names));
+  mq.Add(teams * members, Recorder(&member_names));
+  mq.Add(teams * (team_name + members), Recorder(&both));
+  mq.Add(PlanZero<Company, string>(), Recorder(&both));
+  // teams, team_name, members, and the tee.
+  EXPECT_EQ(4u, mq.stages());
+
+  mq(company);
+  EXPECT_EQ(1, team_scans);
+  EXPECT_EQ(vector<string>({"A", "B"}), names);
+  EXPECT_EQ(vector<string>({"a1", "a2", "b1"}), member_names);
+  EXPECT_EQ(vector<string>({"A", "a1", "a2", "B", "b1"}), both);
+
+  // Every consumer must see what it would have seen running its query alone.
+  vector<string> alone;
+  Optimize(teams * (team_name + members))(company)(Recorder(&alone));
+  EXPECT_EQ(both, alone);
+
+  // Multi-queries can be fed by producers.
+  names.clear();
+  team_scans = 0;
+  Fuse(PUnit(company) + PUnit(company), AsConsumer(mq))();
+  EXPECT_EQ(2, team_scans);
+  EXPECT_EQ(vector<string>({"A", "B", "A", "B"}), names);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,366 @@
+// An optimizer for pipelines built from filters.  -*- c++ -*-
+//
+// Filters are opaque closures, so once they have been combined with
+// *, +, FCross, and FFork, nothing can see inside them to simplify
+// them. Plans are the same combinators in an explicit form that
+// remembers the structure of the pipeline. As plans are combined,
+// they are normalized with the algebraic laws from
+// consumers_and_producers.h:
+//
+//   PlanZero() + p          === p                  (zero branches drop out)
+//   p + PlanZero()          === p
+//   PlanZero() * p          === PlanZero()         (zero stages annihilate)
+//   p * PlanZero()          === PlanZero()
+//   (p1 + p2) + p3          === p1 + p2 + p3       (tees are flattened)
+//   (f * g) * h             === f * g * h          (chains are flattened)
+//   PlanFork(f, h) * PlanCross(g, i)  === PlanFork(f * g, h * i)
+//   PlanCross(f, h) * PlanCross(g, i) === PlanCross(f * g, h * i)
+//
+// The last two laws hold up to the order of the outputs, in the same
+// way that * is fully distributive over + only if you don't care
+// about order.
+//
+// When the plan is built, Optimize(plan) compiles it into a regular
+// filter whose chains run as a single loop nest: each stage writes
+// directly into the next one, rather than through the producers that
+// * builds to bind one stage to the next. The leaves are still opaque
+// filters, so each still builds its own producer for every input.
+
+#ifndef PIPELINE_OPTIMIZER_H_
+#define PIPELINE_OPTIMIZER_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "consumers_and_producers.h"
+
+//==============================================================================
+// Type-erased plan nodes. Within a plan, values are passed around as
+// pointers to values that live on the stack of the stage that produced
+// them. The typed Plan<A, B> wrapper below guarantees that every stage
+// only ever receives pointers to values of its own input type.
+//==============================================================================
+
+// A non-owning reference to a callable that accepts a value pointer.
+// Sinks are created for every value that passes through a stage, so
+// they must be cheap: unlike a std::function, a sink never allocates.
+class _PlanSink {
+public:
+  template <typename F, typename = typename std::enable_if<
+                          !std::is_same<F, _PlanSink>::value>::type>
+  _PlanSink(const F& f) : obj_(&f), call_(&Call<F>) {}
+  _PlanSink(const _PlanSink&) = default;
+  void operator()(const void* value) const { call_(obj_, value); }
+private:
+  template <typename F>
+  static void Call(const void* obj, const void* value) {
+    (*static_cast<const F*>(obj))(value);
+  }
+  const void* obj_;
+  void (*call_)(const void*, const void*);
+};
+
+template <typename T>
+using _PlanValue = typename std::decay<T>::type;
+
+struct _PlanNode {
+  enum Kind { kZero, kLeaf, kChain, kTee, kProduct };
+  typedef std::shared_ptr<const _PlanNode> Ptr;
+  typedef std::function<void(const void*, const _PlanSink&)> Stage;
+  typedef const void* (*Selector)(const void*);
+  typedef void (*Crosser)(const _PlanNode&, const void*, const _PlanSink&);
+
+  Kind kind;
+  Stage leaf;                       // kLeaf: the filter itself.
+  std::vector<Ptr> parts;           // kChain, kTee, kProduct: sub-plans.
+  std::vector<Selector> selectors;  // kProduct: tuple element accessors
+                                    // for cross products; empty for forks.
+  Crosser cross;                    // kProduct: emits the output tuples.
+
+  explicit _PlanNode(Kind k) : kind(k), cross(nullptr) {}
+
+  void Run(const void* in, const _PlanSink& out) const {
+    switch (kind) {
+      case kZero:
+        break;
+      case kLeaf:
+        leaf(in, out);
+        break;
+      case kChain:
+        RunChain(0, in, out);
+        break;
+      case kTee:
+        for (const Ptr& part : parts) {
+          part->Run(in, out);
+        }
+        break;
+      case kProduct:
+        cross(*this, in, out);
+        break;
+    }
+  }
+
+  void RunChain(size_t i, const void* in, const _PlanSink& out) const {
+    if (i + 1 == parts.size()) {
+      parts[i]->Run(in, out);
+    } else {
+      parts[i]->Run(in, [&](const void* mid) { RunChain(i + 1, mid, out); });
+    }
+  }
+
+  std::string ToString() const {
+    static const char* const kNames[] =
+        { "Zero", "Leaf", "Chain", "Tee", "Cross" };
+    std::string s = kind == kProduct && selectors.empty() ?
+        "Fork" : kNames[kind];
+    if (!parts.empty()) {
+      s += "(";
+      for (size_t i = 0; i < parts.size(); ++i) {
+        s += (i ? ", " : "") + parts[i]->ToString();
+      }
+      s += ")";
+    }
+    return s;
+  }
+
+  static Ptr Zero() {
+    static const Ptr& zero = *new Ptr(std::make_shared<_PlanNode>(kZero));
+    return zero;
+  }
+
+  // Smart constructors. These apply the laws listed at the top of the file.
+  static Ptr Chain(const Ptr& f, const Ptr& g) {
+    if (f->kind == kZero || g->kind == kZero) {
+      return Zero();
+    }
+    // Chains are associative, so both operands are flattened into one
+    // sequence of stages, however they were nested, and each stage is
+    // fused with the one before it where the laws allow.
+    std::vector<Ptr> parts;
+    auto append = [&parts](const Ptr& p) {
+      if (!parts.empty() && Fusable(*parts.back(), *p)) {
+        parts.back() = Fuse(parts.back(), p);
+      } else {
+        parts.push_back(p);
+      }
+    };
+    for (const Ptr& p : {f, g}) {
+      if (p->kind == kChain) {
+        for (const Ptr& part : p->parts) {
+          append(part);
+        }
+      } else {
+        append(p);
+      }
+    }
+    if (parts.size() == 1) {
+      return parts[0];
+    }
+    auto chain = std::make_shared<_PlanNode>(kChain);
+    chain->parts = std::move(parts);
+    return chain;
+  }
+
+  // Fork/Cross and Cross/Cross fusion. The fused node takes its inputs
+  // like f and builds its output tuples like g.
+  static Ptr Fuse(const Ptr& f, const Ptr& g) {
+    auto fused = std::make_shared<_PlanNode>(*f);
+    for (size_t i = 0; i < f->parts.size(); ++i) {
+      fused->parts[i] = Chain(f->parts[i], g->parts[i]);
+    }
+    fused->cross = g->cross;
+    return fused;
+  }
+
+  static bool Fusable(const _PlanNode& f, const _PlanNode& g) {
+    return f.kind == kProduct && g.kind == kProduct &&
+        !g.selectors.empty() && f.parts.size() == g.parts.size();
+  }
+
+  static Ptr Tee(const Ptr& f, const Ptr& g) {
+    if (f->kind == kZero) {
+      return g;
+    }
+    if (g->kind == kZero) {
+      return f;
+    }
+    auto tee = std::make_shared<_PlanNode>(kTee);
+    for (const Ptr& p : {f, g}) {
+      if (p->kind == kTee) {
+        tee->parts.insert(tee->parts.end(), p->parts.begin(), p->parts.end());
+      } else {
+        tee->parts.push_back(p);
+      }
+    }
+    return tee;
+  }
+
+  static Ptr Product(std::vector<Ptr> parts, std::vector<Selector> selectors,
+                     Crosser cross) {
+    for (const Ptr& p : parts) {
+      if (p->kind == kZero) {
+        return Zero();
+      }
+    }
+    auto product = std::make_shared<_PlanNode>(kProduct);
+    product->parts = std::move(parts);
+    product->selectors = std::move(selectors);
+    product->cross = cross;
+    return product;
+  }
+};
+
+// Emits the cross product of the outputs of a product node's parts as
+// tuples of type std::tuple<Outs...>. The leftmost part varies slowest.
+template <typename... Outs>
+struct _PlanCrosser {
+  static constexpr int N = sizeof...(Outs);
+  typedef std::tuple<Outs...> Out;
+
+  struct Frame {
+    const _PlanNode& node;
+    const void* in;
+    const _PlanSink& out;
+    const void* values[N];
+  };
+
+  static void Cross(const _PlanNode& node, const void* in,
+                    const _PlanSink& out) {
+    Frame frame{node, in, out, {}};
+    Step<0>(&frame);
+  }
+
+  template <int I>
+  static typename std::enable_if<(I < N)>::type Step(Frame* frame) {
+    const _PlanNode& node = *frame->node.parts[I];
+    const void* in = frame->node.selectors.empty() ?
+        frame->in : frame->node.selectors[I](frame->in);
+    node.Run(in, [=](const void* value) {
+      frame->values[I] = value;
+      Step<I + 1>(frame);
+    });
+  }
+
+  template <int I>
+  static typename std::enable_if<I == N>::type Step(Frame* frame) {
+    Emit(typename _TupleHelper::gens<N>::type(), frame);
+  }
+
+  template <int... Indices>
+  static void Emit(_TupleHelper::seq<Indices...>, Frame* frame) {
+    const Out tuple(*static_cast<const _PlanValue<Outs>*>(
+        frame->values[Indices])...);
+    frame->out(&tuple);
+  }
+};
+
+template <typename... Ins>
+struct _PlanSelectors {
+  template <int I>
+  static const void* Select(const void* in) {
+    return &std::get<I>(*static_cast<const std::tuple<Ins...>*>(in));
+  }
+
+  template <int... Indices>
+  static std::vector<_PlanNode::Selector> Make(_TupleHelper::seq<Indices...>) {
+    return { &Select<Indices>... };
+  }
+};
+
+//==============================================================================
+// PLANS
+//==============================================================================
+
+// A plan for a filter that takes an A and from it produces Bs.
+template <typename A, typename B>
+class Plan {
+public:
+  typedef A argument_type;
+  typedef B value_type;
+
+  // Wraps an opaque filter as a single stage of a plan.
+  explicit Plan(const Filter<A, B>& f)
+      : node_(std::make_shared<_PlanNode>(_PlanNode::kLeaf)) {
+    std::const_pointer_cast<_PlanNode>(node_)->leaf =
+        [f](const void* in, const _PlanSink& out) {
+          f(*static_cast<const _PlanValue<A>*>(in))(
+              Consumer<B>([&](B x) { out(&x); }));
+        };
+  }
+
+  explicit Plan(_PlanNode::Ptr node) : node_(std::move(node)) {}
+
+  const _PlanNode::Ptr& node() const { return node_; }
+
+  // Describes the normalized structure of the plan, e.g.,
+  // "Chain(Leaf, Fork(Leaf, Leaf))". Handy for testing.
+  std::string ToString() const { return node_->ToString(); }
+
+private:
+  _PlanNode::Ptr node_;
+};
+
+template <typename A, typename B>
+Plan<A, B> AsPlan(const Filter<A, B>& f) {
+  return Plan<A, B>(f);
+}
+
+// The plan that produces nothing. It is the identity element for +.
+template <typename A, typename B>
+Plan<A, B> PlanZero() {
+  return Plan<A, B>(_PlanNode::Zero());
+}
+
+// Plans combine just like the filters they describe.
+template <typename A, typename B, typename C>
+Plan<A, C> operator*(const Plan<A, B>& f, const Plan<B, C>& g) {
+  return Plan<A, C>(_PlanNode::Chain(f.node(), g.node()));
+}
+
+template <typename A, typename B>
+Plan<A, B> operator+(const Plan<A, B>& f, const Plan<A, B>& g) {
+  return Plan<A, B>(_PlanNode::Tee(f.node(), g.node()));
+}
+
+// The plan equivalent of FCross.
+template <typename... Ins, typename... Outs>
+Plan<std::tuple<Ins...>, std::tuple<Outs...>>
+PlanCross(const Plan<Ins, Outs>&... plans) {
+  static_assert(sizeof...(Ins) > 0, "PlanCross needs at least one plan");
+  return Plan<std::tuple<Ins...>, std::tuple<Outs...>>(_PlanNode::Product(
+      { plans.node()... },
+      _PlanSelectors<Ins...>::Make(
+          typename _TupleHelper::gens<sizeof...(Ins)>::type()),
+      &_PlanCrosser<Outs...>::Cross));
+}
+
+// The plan equivalent of FFork.
+template <typename In, typename... Outs>
+Plan<In, std::tuple<Outs...>> PlanFork(const Plan<In, Outs>&... plans) {
+  static_assert(sizeof...(Outs) > 0, "PlanFork needs at least one plan");
+  return Plan<In, std::tuple<Outs...>>(_PlanNode::Product(
+      { plans.node()... }, {}, &_PlanCrosser<Outs...>::Cross));
+}
+
+// Compiles a plan into a filter.
+template <typename A, typename B>
+Filter<A, B> Optimize(const Plan<A, B>& plan) {
+  _PlanNode::Ptr node = plan.node();
+  if (node->kind == _PlanNode::kZero) {
+    return [](A /*x*/) { return PZero<B>(); };
+  }
+  return [node](A x) {
+    return Producer<B>([node, x](const Consumer<B>& c) {
+      node->Run(&x, [&](const void* out) {
+        c(*static_cast<const _PlanValue<B>*>(out));
+      });
+    });
+  };
+}
+
+#endif  // PIPELINE_OPTIMIZER_H_
@@ -0,0 +1,140 @@
+// Tests for the pipeline optimizer.
+
+#include "pipeline_optimizer.h"
+
+#include <algorithm>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+template <typename T>
+Producer<T> Produce(vector<T> ts) {
+  return {
+    [=](Consumer<T> c) {
+      for (auto& t : ts) {
+        c(t);
+      }
+    }
+  };
+}
+
+// Runs a filter on an input and records its outputs.
+template <typename A, typename B>
+vector<B> Outputs(const Filter<A, B>& f, const A& x) {
+  vector<B> outputs;
+  f(x)([&](B y) { outputs.push_back(y); });
+  return outputs;
+}
+
+template <typename T>
+vector<T> Sorted(vector<T> ts) {
+  std::sort(ts.begin(), ts.end());
+  return ts;
+}
+
+// Some simple filters to build plans from.
+Filter<int, int> digits = [](int x) {
+  return Produce<int>({x % 10, x / 10 % 10});
+};
+Filter<int, int> twice = [](int x) { return Produce<int>({x, x}); };
+Filter<int, string> show = [](int x) { return PUnit(std::to_string(x)); };
+Filter<string, string> shout = [](const string& s) { return PUnit(s + "!"); };
+Filter<std::tuple<string, string>, string> join =
+    [](const std::tuple<string, string>& t) {
+      return PUnit(std::get<0>(t) + std::get<1>(t));
+    };
+
+}  // namespace
+
+TEST(PipelineOptimizer, ZeroBranchesAreDropped) {
+  auto zero = PlanZero<int, int>();
+  auto d = AsPlan(digits);
+  EXPECT_EQ("Leaf", (zero + d).ToString());
+  EXPECT_EQ("Leaf", (d + zero).ToString());
+  EXPECT_EQ("Leaf", (zero + d + zero + zero).ToString());
+  EXPECT_EQ("Zero", (zero + zero).ToString());
+  EXPECT_EQ(Outputs(digits, 42), Outputs(Optimize(zero + d + zero), 42));
+}
+
+TEST(PipelineOptimizer, ZeroStagesAnnihilateChains) {
+  auto zero = PlanZero<int, int>();
+  auto d = AsPlan(digits);
+  EXPECT_EQ("Zero", (d * zero).ToString());
+  EXPECT_EQ("Zero", (zero * d * AsPlan(show)).ToString());
+  EXPECT_EQ(vector<string>{}, Outputs(Optimize(d * zero * AsPlan(show)), 42));
+}
+
+TEST(PipelineOptimizer, TeesAndChainsAreFlattened) {
+  auto d = AsPlan(digits);
+  auto t = AsPlan(twice);
+  EXPECT_EQ("Tee(Leaf, Leaf, Leaf, Leaf)",
+            ((d + t) + (t + d)).ToString());
+  EXPECT_EQ("Chain(Leaf, Leaf, Leaf, Leaf)",
+            ((d * t) * (t * AsPlan(show))).ToString());
+
+  // Optimization must not change the output of the pipeline.
+  auto filter = ((digits + twice) + (twice + digits)) * twice * show;
+  auto plan = ((d + t) + (t + d)) * t * AsPlan(show);
+  EXPECT_EQ(Outputs(filter, 42), Outputs(Optimize(plan), 42));
+}
+
+TEST(PipelineOptimizer, CrossesArePushedIntoForks) {
+  auto d = AsPlan(digits);
+  auto t = AsPlan(twice);
+  auto s = AsPlan(show);
+  auto x = AsPlan(shout);
+
+  // Law: FFork(f, h) * FCross(g, i) === FFork(f * g, h * i).
+  auto fork_cross = PlanFork(d, t) * PlanCross(s, s);
+  EXPECT_EQ("Fork(Chain(Leaf, Leaf), Chain(Leaf, Leaf))",
+            fork_cross.ToString());
+  // Law: FCross(f, h) * FCross(g, i) === FCross(f * g, h * i).
+  auto cross_cross = PlanCross(s, s) * PlanCross(x, x);
+  EXPECT_EQ("Cross(Chain(Leaf, Leaf), Chain(Leaf, Leaf))",
+            cross_cross.ToString());
+  // Since * is left associative, crosses following a chain that ends
+  // in a fork must be pushed into the fork too.
+  auto chain = t * PlanFork(d, t) * PlanCross(s, s) * PlanCross(x, x);
+  EXPECT_EQ("Chain(Leaf, "
+            "Fork(Chain(Leaf, Leaf, Leaf), Chain(Leaf, Leaf, Leaf)))",
+            chain.ToString());
+
+  // Chains are associative, so crosses are pushed into forks however
+  // the chain is nested.
+  auto right_nested = t * (PlanFork(d, t) * (PlanCross(s, s) *
+                                             PlanCross(x, x)));
+  EXPECT_EQ(chain.ToString(), right_nested.ToString());
+  auto fork_cross_leaf = PlanFork(d, t) * (PlanCross(s, s) * AsPlan(join));
+  EXPECT_EQ("Chain(Fork(Chain(Leaf, Leaf), Chain(Leaf, Leaf)), Leaf)",
+            fork_cross_leaf.ToString());
+  EXPECT_EQ(Sorted(Outputs(FFork(digits, twice) * FCross(show, show) * join,
+                           42)),
+            Sorted(Outputs(Optimize(fork_cross_leaf), 42)));
+
+  // The laws hold up to the order of the outputs.
+  auto filter = twice * FFork(digits, twice) * FCross(show, show) *
+      FCross(shout, shout);
+  auto expected = Outputs(filter, 42);
+  EXPECT_EQ(8u, expected.size());
+  EXPECT_EQ(Sorted(expected), Sorted(Outputs(Optimize(chain), 42)));
+}
+
+TEST(PipelineOptimizer, ZeroInAProductAnnihilatesIt) {
+  auto fork = PlanFork(AsPlan(digits), PlanZero<int, int>());
+  EXPECT_EQ("Zero", fork.ToString());
+  EXPECT_EQ("Zero", (AsPlan(twice) * fork).ToString());
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
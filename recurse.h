@@ -0,0 +1,108 @@
+// Recursive traversal of nested structures.  -*- c++ -*-
+//
+// Recurse(step) is the filter that produces a value, then everything
+// step produces from it, then everything step produces from those, and
+// so on, depth first and in order, as though step * step * ... were
+// chained to any depth. For example, if Reports produces a manager's
+// direct reports, Recurse(Reports) produces a manager's whole org,
+// manager first, and Reports * Recurse(Reports) everyone below them.
+//
+// Chaining filters with * recurses through a std::function call for
+// every level, which overflows the stack on deep structures. Recurse
+// instead keeps the values still to be visited on a work stack on the
+// heap, so the depth of a structure is limited only by memory.
+//
+// Structures that are graphs rather than trees, with shared nodes or
+// cycles, are traversed with Recurse(step, key): values whose key has
+// already been seen are skipped, along with everything below them.
+//
+// Values are held on the work stack until they are visited; filters of
+// references must produce references to objects that outlive the
+// traversal, as accessors of an enclosing structure do.
+
+#ifndef RECURSE_H_
+#define RECURSE_H_
+
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "consumers_and_producers.h"
+
+// How a value of type T is held on the work stack: by pointer, if T is
+// a reference, and by value otherwise.
+template <typename T, typename Enable = void>
+struct _RecurseHeld {
+  typedef T type;
+  static type Hold(T x) { return x; }
+  static T Get(const type& x) { return x; }
+};
+
+template <typename T>
+struct _RecurseHeld<T, typename std::enable_if<
+                         std::is_reference<T>::value>::type> {
+  typedef typename std::remove_reference<T>::type* type;
+  static type Hold(T x) { return &x; }
+  static T Get(type x) { return *x; }
+};
+
+// Runs a depth-first traversal from a held value, calling c on every
+// value for which visit returns true.
+template <typename T, typename Visit>
+void _Recurse(const Filter<T, T>& step,
+              const typename _RecurseHeld<T>::type& start,
+              const Visit& visit, const Consumer<T>& c) {
+  typedef _RecurseHeld<T> Held;
+  std::vector<typename Held::type> stack, children;
+  stack.push_back(start);
+  Consumer<T> collect = [&children](T y) {
+    children.push_back(Held::Hold(y));
+  };
+  while (!stack.empty()) {
+    typename Held::type held = stack.back();
+    stack.pop_back();
+    T value = Held::Get(held);
+    if (!visit(value)) {
+      continue;
+    }
+    c(value);
+    step(value)(collect);
+    // Push the children in reverse, so that they are visited in order.
+    stack.insert(stack.end(), children.rbegin(), children.rend());
+    children.clear();
+  }
+}
+
+// Traverses a tree. Cycles would make the traversal run forever.
+template <typename T>
+Filter<T, T> Recurse(const Filter<T, T>& step) {
+  auto step_node = _Share(step);
+  return [=](T x) -> Producer<T> {
+    auto start = _RecurseHeld<T>::Hold(x);
+    return [=](const Consumer<T>& c) {
+      _Recurse<T>(*step_node, start, [](const T&) { return true; }, c);
+    };
+  };
+}
+
+// Traverses a graph, visiting each value once, as identified by its
+// key. The set of keys seen is kept per traversal.
+template <typename T, typename KeyFn>
+Filter<T, T> Recurse(const Filter<T, T>& step, const KeyFn& key) {
+  typedef typename std::decay<
+      decltype(key(std::declval<const T&>()))>::type Key;
+  auto step_node = _Share(step);
+  return [=](T x) -> Producer<T> {
+    auto start = _RecurseHeld<T>::Hold(x);
+    return [=](const Consumer<T>& c) {
+      std::unordered_set<Key> seen;
+      _Recurse<T>(*step_node, start,
+                  [&](const T& y) { return seen.insert(key(y)).second; }, c);
+    };
+  };
+}
+
+#endif  // RECURSE_H_
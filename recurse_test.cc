@@ -0,0 +1,94 @@
+// Tests for recursive traversal.
+
+#include "recurse.h"
+
+#include <string>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+struct Employee {
+  string name;
+  vector<Employee> reports;
+};
+
+Filter<const Employee&, const Employee&> Reports() {
+  return [](const Employee& e) -> Producer<const Employee&> {
+    return [&e](const Consumer<const Employee&>& c) {
+      for (const Employee& r : e.reports) c(r);
+    };
+  };
+}
+
+vector<string> Names(const Producer<const Employee&>& p) {
+  vector<string> names;
+  p([&](const Employee& e) { names.push_back(e.name); });
+  return names;
+}
+
+}  // namespace
+
+TEST(Recurse, TraversesTreesDepthFirstInOrder) {
+  Employee ceo{"ceo", {{"a", {{"a1", {}}, {"a2", {{"a2x", {}}}}}},
+                       {"b", {}},
+                       {"c", {{"c1", {}}}}}};
+  EXPECT_EQ((vector<string>{"ceo", "a", "a1", "a2", "a2x", "b", "c", "c1"}),
+            Names(Recurse(Reports())(ceo)));
+  // Chained after the step, it produces only those below.
+  EXPECT_EQ((vector<string>{"a", "a1", "a2", "a2x", "b", "c", "c1"}),
+            Names((Reports() * Recurse(Reports()))(ceo)));
+  // The references are to the tree's own employees.
+  const Employee* first = nullptr;
+  Recurse(Reports())(ceo)([&](const Employee& e) {
+    if (!first) first = &e;
+  });
+  EXPECT_EQ(&ceo, first);
+}
+
+TEST(Recurse, HandlesDeepTreesWithoutDeepRecursion) {
+  // A chain a million levels deep.
+  Filter<int, int> next = [](int n) {
+    return n < 1000000 ? PUnit(n + 1) : PZero<int>();
+  };
+  long long sum = 0;
+  int count = 0;
+  Recurse(next)(1)([&](int n) {
+    sum += n;
+    ++count;
+  });
+  EXPECT_EQ(1000000, count);
+  EXPECT_EQ(500000500000LL, sum);
+}
+
+TEST(Recurse, VisitsEachNodeOfAGraphOnce) {
+  // 0 -> 1, 2; 1 -> 3; 2 -> 3, 0; 3 -> 1.
+  vector<vector<int>> edges = {{1, 2}, {3}, {3, 0}, {1}};
+  Filter<int, int> neighbours = [&](int n) -> Producer<int> {
+    return [&edges, n](const Consumer<int>& c) {
+      for (int m : edges[n]) c(m);
+    };
+  };
+  vector<int> visited;
+  Recurse(neighbours, [](int n) { return n; })(0)(
+      [&](int n) { visited.push_back(n); });
+  EXPECT_EQ((vector<int>{0, 1, 3, 2}), visited);
+
+  // The set of keys seen is fresh for each traversal.
+  visited.clear();
+  auto reachable = Recurse(neighbours, [](int n) { return n; });
+  reachable(3)([&](int n) { visited.push_back(n); });
+  reachable(3)([&](int n) { visited.push_back(n); });
+  EXPECT_EQ((vector<int>{3, 1, 3, 1}), visited);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -9,7 +9,7 @@
 gtest_flags = $$(gtest-config --cppflags --cxxflags --ldflags --libs)
 test_flags  = $(gtest_flags) -fprofile-arcs -ftest-coverage
 link_flags := $(link_flags) -lgcov -lstdc++
-cxx         = clang --std=c++11
+cxx         = clang --std=c++17
 
 obj_cc_files = $(objects:.o=.cc)
 
@@ -0,0 +1,350 @@
+// Running many small pipelines on a few threads.  -*- c++ -*-
+//
+// An Effect is a blocking std::function<void()>: running one ties up
+// a thread, with its stack, until the effect is done, and a stage that
+// waits for a full Buffer to drain waits with the thread. A server that
+// runs a pipeline for every request thus needs a thread per request.
+//
+// A Scheduler instead runs resumable tasks, many to a thread, on a
+// ThreadPool. A resumable task is a function that does a bounded step
+// of work each time it is called and says whether it is done, whether
+// it merely yields to let other tasks run, or whether it is blocked,
+// waiting for room or values in a buffer. Blocked tasks are set aside,
+// costing no thread: a task blocked on a buffer until that buffer
+// changes, and any other until the next poll. A task's
+// state lives in its closure, so a pipeline costs the few hundred
+// bytes of its tasks and buffers, rather than a thread's stack.
+//
+// Tasks for the stages of buffered pipelines are provided, which yield
+// where a blocking pipeline would wait:
+//
+//   Scheduler scheduler(&pool);
+//   for (const Request& request : requests) {
+//     auto lines = std::make_shared<Buffer<std::string>>(64);
+//     auto records = std::make_shared<Buffer<Record>>(64);
+//     scheduler.Spawn(SourceTask<std::string>(ReadLines(request), lines));
+//     scheduler.Spawn(StageTask<std::string, Record>(lines, parse, records));
+//     scheduler.Spawn(SinkTask<Record>(records, Respond(request)));
+//   }
+//   scheduler.Wait();
+//
+// C++17 has no coroutines, so an existing Effect cannot be suspended
+// in the middle; SpawnBlocking runs one as a single step, holding a
+// worker until it is done.
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "consumers_and_producers.h"
+#include "thread_pool.h"
+
+// What a step of a resumable task leaves it: done, ready to run again,
+// or unable to run again until another task makes progress.
+enum class Step { kDone, kYield, kBlocked };
+
+typedef std::function<Step()> Resumable;
+
+// What a task blocked on a buffer waits for: given a function that
+// resumes the task, it arranges for that to be called, or returns
+// false if the task should be resumed at once.
+typedef std::function<bool(std::function<void()>)> _Wait;
+
+inline _Wait& _CurrentWait() {
+  static thread_local _Wait wait;
+  return wait;
+}
+
+// Returned by a step that cannot push to or pop from buffer, which
+// was at version when it could not, e.g. as reported by TryPush or
+// TryPop: the task is resumed once the buffer changes, rather than
+// polled. Steps that return Step::kBlocked without this are polled.
+template <typename T>
+Step BlockedOn(Buffer<T>* buffer, uint64_t version) {
+  _CurrentWait() = [buffer, version](std::function<void()> wake) {
+    return buffer->Watch(version, std::move(wake));
+  };
+  return Step::kBlocked;
+}
+
+class Scheduler {
+public:
+  // Tasks blocked on a buffer are resumed when it changes. Other
+  // blocked tasks, which wait on something outside the scheduler, are
+  // retried every poll_interval.
+  explicit Scheduler(ThreadPool* pool,
+                     std::chrono::microseconds poll_interval =
+                         std::chrono::microseconds(100))
+      : pool_(pool), poll_interval_(poll_interval), live_(0), queued_(0),
+        last_poll_(std::chrono::steady_clock::now()) {}
+  ~Scheduler() {
+    std::unique_lock<std::mutex> lock(mu_);
+    done_.wait(lock, [this] { return live_ == 0; });
+  }
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  void Spawn(Resumable task) {
+    auto t = std::make_shared<Resumable>(std::move(task));
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      ++live_;
+      ++queued_;
+    }
+    pool_->Submit([this, t] { RunStep(t); });
+  }
+
+  // Runs an effect as a task of a single step. The effect blocks the
+  // worker it runs on until it is done.
+  void SpawnBlocking(const Effect& e) {
+    Spawn([e] {
+      e();
+      return Step::kDone;
+    });
+  }
+
+  // Waits for every task to finish, and rethrows the first exception
+  // any of them threw.
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mu_);
+    done_.wait(lock, [this] { return live_ == 0; });
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+  // How many tasks have not yet finished.
+  size_t live() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return live_;
+  }
+
+private:
+  typedef std::shared_ptr<Resumable> Task;
+
+  void RunStep(const Task& t) {
+    Step step;
+    _Wait wait;
+    try {
+      _CurrentWait() = nullptr;
+      step = (*t)();
+      wait = std::move(_CurrentWait());
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+      step = Step::kDone;
+    }
+    std::vector<Task> ready;
+    if (step == Step::kYield) {
+      ready.push_back(t);
+    } else if (step == Step::kBlocked && wait &&
+               !wait([this, t] { Requeue({t}); })) {
+      // The buffer changed while the step ran.
+      ready.push_back(t);
+    }
+    std::unique_lock<std::mutex> lock(mu_);
+    --queued_;
+    if (step == Step::kBlocked && !wait) {
+      parked_.push_back(t);
+    }
+    if (!parked_.empty()) {
+      auto now = std::chrono::steady_clock::now();
+      if (queued_ == 0 && ready.empty() && now - last_poll_ < poll_interval_) {
+        // Nothing else is running here, so wait out the interval
+        // rather than spin on the polled tasks.
+        lock.unlock();
+        std::this_thread::sleep_for(poll_interval_ - (now - last_poll_));
+        lock.lock();
+        now = std::chrono::steady_clock::now();
+      }
+      if (now - last_poll_ >= poll_interval_) {
+        ready.insert(ready.end(), parked_.begin(), parked_.end());
+        parked_.clear();
+        last_poll_ = now;
+      }
+    }
+    if (step == Step::kDone && --live_ == 0) {
+      done_.notify_all();
+    }
+    lock.unlock();
+    Requeue(std::move(ready));
+  }
+
+  // Resubmitted tasks go to the back of the node's queue, behind the
+  // tasks that are already waiting, rather than onto this worker's.
+  void Requeue(std::vector<Task> ready) {
+    if (ready.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      queued_ += ready.size();
+    }
+    int node = std::max(ThreadPool::CurrentNode(), 0);
+    for (Task& r : ready) {
+      pool_->SubmitToNode(node, [this, r] { RunStep(r); });
+    }
+  }
+
+  ThreadPool* const pool_;
+  const std::chrono::microseconds poll_interval_;
+  mutable std::mutex mu_;
+  std::condition_variable done_;
+  size_t live_;    // Tasks not yet done.
+  size_t queued_;  // Tasks queued on the pool or running.
+  std::chrono::steady_clock::time_point last_poll_;
+  std::vector<Task> parked_;  // Blocked tasks that are polled.
+  std::exception_ptr error_;
+};
+
+//==============================================================================
+// Tasks for buffered pipelines
+//==============================================================================
+
+// Each task handles up to batch values per step. A task that fails
+// closes its buffers, so that the tasks on the other side of them
+// finish rather than wait forever.
+
+// Pushes the values next produces into out, until next returns false,
+// then closes out.
+template <typename T>
+Resumable SourceTask(std::function<bool(T*)> next, std::shared_ptr<Buffer<T>> out,
+                     size_t batch = 64) {
+  struct State {
+    std::function<bool(T*)> next;
+    std::shared_ptr<Buffer<T>> out;
+    std::deque<T> pending;
+  };
+  auto s = std::make_shared<State>(State{std::move(next), std::move(out), {}});
+  return [s, batch] {
+    bool progressed = false;
+    try {
+      for (size_t i = 0; i < batch; ++i) {
+        if (s->pending.empty()) {
+          T x;
+          if (!s->next(&x)) {
+            s->out->Close();
+            return Step::kDone;
+          }
+          s->pending.push_back(std::move(x));
+        }
+        if (s->out->closed()) {
+          return Step::kDone;
+        }
+        uint64_t version;
+        if (!s->out->TryPush(s->pending.front(), &version)) {
+          return progressed ? Step::kYield
+                            : BlockedOn(s->out.get(), version);
+        }
+        s->pending.pop_front();
+        progressed = true;
+      }
+    } catch (...) {
+      s->out->Close();
+      throw;
+    }
+    return Step::kYield;
+  };
+}
+
+// Passes the values from in through f into out, then closes out.
+template <typename A, typename B>
+Resumable StageTask(std::shared_ptr<Buffer<A>> in, StreamFilter<A, B> f,
+                    std::shared_ptr<Buffer<B>> out, size_t batch = 64) {
+  struct State {
+    std::shared_ptr<Buffer<A>> in;
+    StreamFilter<A, B> f;
+    std::shared_ptr<Buffer<B>> out;
+    std::deque<B> pending;  // Made by f but not yet pushed.
+  };
+  auto s = std::make_shared<State>(
+      State{std::move(in), std::move(f), std::move(out), {}});
+  return [s, batch] {
+    bool progressed = false;
+    try {
+      for (size_t i = 0; i < batch; ++i) {
+        while (!s->pending.empty()) {
+          if (s->out->closed()) {
+            s->in->Close();
+            return Step::kDone;
+          }
+          uint64_t version;
+          if (!s->out->TryPush(s->pending.front(), &version)) {
+            return progressed ? Step::kYield
+                              : BlockedOn(s->out.get(), version);
+          }
+          s->pending.pop_front();
+          progressed = true;
+        }
+        typename std::decay<A>::type x;
+        bool closed = s->in->closed();
+        uint64_t version;
+        if (!s->in->TryPop(&x, &version)) {
+          if (closed) {
+            s->out->Close();
+            return Step::kDone;
+          }
+          return progressed ? Step::kYield : BlockedOn(s->in.get(), version);
+        }
+        auto add = [&](B y) { s->pending.push_back(y); };
+        s->f(x, add);
+        progressed = true;
+      }
+    } catch (...) {
+      s->in->Close();
+      s->out->Close();
+      throw;
+    }
+    return Step::kYield;
+  };
+}
+
+// Feeds the values from in to c, until in is closed and empty.
+template <typename T>
+Resumable SinkTask(std::shared_ptr<Buffer<T>> in, Consumer<T> c,
+                   size_t batch = 64) {
+  return [in, c, batch] {
+    bool progressed = false;
+    try {
+      for (size_t i = 0; i < batch; ++i) {
+        typename std::decay<T>::type x;
+        // Check for closing first, so that values pushed just before
+        // the buffer closed are not missed.
+        bool closed = in->closed();
+        uint64_t version;
+        if (!in->TryPop(&x, &version)) {
+          if (closed) {
+            return Step::kDone;
+          }
+          return progressed ? Step::kYield : BlockedOn(in.get(), version);
+        }
+        c(x);
+        progressed = true;
+      }
+    } catch (...) {
+      in->Close();
+      throw;
+    }
+    return Step::kYield;
+  };
+}
+
+#endif  // SCHEDULER_H_
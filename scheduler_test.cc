@@ -0,0 +1,166 @@
+// Tests for the scheduler of resumable tasks.
+
+#include "scheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer.h"
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+#include "thread_pool.h"
+
+using std::vector;
+
+namespace {
+
+// Counts from 1 to n.
+std::function<bool(int*)> Counter(int n) {
+  auto i = std::make_shared<int>(0);
+  return [i, n](int* x) {
+    if (*i == n) return false;
+    *x = ++*i;
+    return true;
+  };
+}
+
+}  // namespace
+
+TEST(Scheduler, RunsManyPipelinesOnAFewThreads) {
+  ThreadPool pool(2);
+  Scheduler scheduler(&pool);
+  const int kPipelines = 1000, kValues = 200;
+  vector<long> sums(kPipelines, 0);
+  StreamFilter<int, int> square_evens = [](int x, ConsumerRef<int> c) {
+    if (x % 2 == 0) c(x * x);
+  };
+  for (int p = 0; p < kPipelines; ++p) {
+    // Buffers far smaller than the streams, so that the tasks must
+    // yield to each other many times.
+    auto numbers = std::make_shared<Buffer<int>>(4);
+    auto squares = std::make_shared<Buffer<int>>(4);
+    scheduler.Spawn(SourceTask<int>(Counter(kValues), numbers, 3));
+    scheduler.Spawn(StageTask<int, int>(numbers, square_evens, squares, 3));
+    scheduler.Spawn(SinkTask<int>(squares, [&sums, p](int x) {
+      sums[p] += x;
+    }, 3));
+  }
+  scheduler.Wait();
+  EXPECT_EQ(0u, scheduler.live());
+  long expected = 0;
+  for (int x = 2; x <= kValues; x += 2) expected += x * x;
+  for (long sum : sums) ASSERT_EQ(expected, sum);
+}
+
+TEST(Scheduler, YieldingTasksTakeTurns) {
+  ThreadPool pool(1);
+  Scheduler scheduler(&pool);
+  std::string order;
+  std::mutex mu;
+  // The tasks idle until both have been spawned.
+  std::atomic<bool> go{false};
+  for (char name : {'a', 'b'}) {
+    auto steps = std::make_shared<int>(0);
+    scheduler.Spawn([&, name, steps] {
+      if (!go) return Step::kYield;
+      std::lock_guard<std::mutex> lock(mu);
+      order += name;
+      return ++*steps == 3 ? Step::kDone : Step::kYield;
+    });
+  }
+  go = true;
+  scheduler.Wait();
+  EXPECT_EQ(6u, order.size());
+  // Neither task ran all its steps before the other started.
+  EXPECT_NE(std::string::npos, order.find("ab"));
+  EXPECT_NE(std::string::npos, order.find("ba"));
+}
+
+TEST(Scheduler, WakesOnlyTheTasksOfTheBufferThatChanged) {
+  ThreadPool pool(2);
+  Scheduler scheduler(&pool);
+  // Many idle pipelines, blocked on buffers that nothing feeds yet.
+  const int kIdle = 1000;
+  std::atomic<int> idle_steps{0};
+  vector<std::shared_ptr<Buffer<int>>> idle;
+  for (int i = 0; i < kIdle; ++i) {
+    idle.push_back(std::make_shared<Buffer<int>>(4));
+    Resumable sink = SinkTask<int>(idle.back(), [](int) {});
+    scheduler.Spawn([sink, &idle_steps] {
+      ++idle_steps;
+      return sink();
+    });
+  }
+  // One busy pipeline alongside them.
+  const int kValues = 2000;
+  std::atomic<int> received{0};
+  auto numbers = std::make_shared<Buffer<int>>(4);
+  scheduler.Spawn(SourceTask<int>(Counter(kValues), numbers, 3));
+  scheduler.Spawn(SinkTask<int>(numbers, [&](int) { ++received; }, 3));
+  while (received < kValues) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  // The busy pipeline's progress woke none of the idle tasks, which
+  // ran once to block, and run once more to finish.
+  EXPECT_EQ(kIdle, idle_steps.load());
+  for (auto& buffer : idle) {
+    buffer->Close();
+  }
+  scheduler.Wait();
+  EXPECT_EQ(2 * kIdle, idle_steps.load());
+}
+
+TEST(Scheduler, BlockedTasksWaitForOutsideEvents) {
+  ThreadPool pool(1);
+  Scheduler scheduler(&pool);
+  auto buffer = std::make_shared<Buffer<int>>(8);
+  int sum = 0;
+  scheduler.Spawn(SinkTask<int>(buffer, [&](int x) { sum += x; }));
+  std::thread outside([&] {
+    for (int i = 1; i <= 10; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      buffer->Push(i);
+    }
+    buffer->Close();
+  });
+  scheduler.Wait();
+  outside.join();
+  EXPECT_EQ(55, sum);
+}
+
+TEST(Scheduler, FailingTasksStopTheirPipelines) {
+  ThreadPool pool(2);
+  Scheduler scheduler(&pool);
+  auto numbers = std::make_shared<Buffer<int>>(2);
+  // The source has far more to push than the sink will take.
+  scheduler.Spawn(SourceTask<int>(Counter(1000000), numbers));
+  scheduler.Spawn(SinkTask<int>(numbers, [](int x) {
+    if (x == 10) throw std::runtime_error("sink failed");
+  }));
+  EXPECT_THROW(scheduler.Wait(), std::runtime_error);
+  // The error is reported once.
+  scheduler.Wait();
+}
+
+TEST(Scheduler, RunsBlockingEffects) {
+  ThreadPool pool(2);
+  Scheduler scheduler(&pool);
+  std::atomic<int> runs{0};
+  for (int i = 0; i < 10; ++i) {
+    scheduler.SpawnBlocking([&] { ++runs; });
+  }
+  scheduler.Wait();
+  EXPECT_EQ(10, runs.load());
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
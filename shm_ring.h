@@ -0,0 +1,467 @@
+// Shared-memory transport between processes.  -*- c++ -*-
+//
+// A ShmRing is a single-producer, single-consumer ring buffer of
+// frames in a POSIX shared-memory object, which lets stages of a
+// pipeline run in separate processes on the same host, so that a
+// stage that crashes does not take the whole pipeline with it. Unlike
+// a pipe, the ring costs no copy through the kernel, and a system call
+// only when one side must wait for the other, which it does on a
+// futex in the shared memory.
+//
+// ShmSink<T> serializes values into a ring with SpillCodec<T>,
+// committing them in batches, and ShmSource<T> produces them in the
+// other process:
+//
+//   // Parent:
+//   ShmRing ring("/normalize." + std::to_string(getpid()), 1 << 22);
+//   if (fork() == 0) {
+//     ShmRing ring_in_child(ring.name());
+//     ShmSink<std::string> sink(&ring_in_child);
+//     (raw * normalize)(input)(sink.consumer());
+//     sink.Close();
+//     _exit(0);
+//   }
+//   ShmSource<std::string>(&ring)(store);
+//
+// The process that creates a ring unlinks its name when the ring is
+// destroyed; the memory lasts until both sides have unmapped it. If
+// either process dies without closing the ring, the other one's next
+// wait on it throws, rather than waiting forever.
+
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "consumers_and_producers.h"
+#include "spill.h"
+
+// The control block at the start of the shared memory. The producer's
+// and consumer's fields are on separate cache lines.
+//
+// Each of the two processes attached to a ring, the one that created it
+// and the one that opened it, holds a robust mutex for as long as it
+// is attached. If a process dies without closing the ring, the kernel
+// marks its mutex as having a dead owner, which the other process sees
+// when it next tries the mutex while waiting, so that it need not wait
+// for a peer that will never come back.
+struct _ShmRingHeader {
+  static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                std::atomic<uint32_t>::is_always_lock_free,
+                "shared-memory atomics must be lock-free");
+
+  // Written by the producer.
+  alignas(64) std::atomic<uint64_t> head;  // Bytes committed.
+  std::atomic<uint32_t> head_seq;          // Futex the consumer waits on.
+  std::atomic<uint32_t> consumer_waiting;
+  // Written by the consumer.
+  alignas(64) std::atomic<uint64_t> tail;  // Bytes released.
+  std::atomic<uint32_t> tail_seq;          // Futex the producer waits on.
+  std::atomic<uint32_t> producer_waiting;
+  // Written by either.
+  alignas(64) std::atomic<uint32_t> closed;
+  uint64_t capacity;
+  // Indexed by whether the process opened, rather than created, the ring.
+  pthread_mutex_t attached_mu[2];
+  std::atomic<uint32_t> attached[2];
+};
+
+// Waits until woken, or until the timeout passes.
+inline void _FutexWait(std::atomic<uint32_t>* word, uint32_t expected,
+                       const timespec* timeout) {
+  ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT,
+            expected, timeout, nullptr, 0);
+}
+
+inline void _FutexWake(std::atomic<uint32_t>* word) {
+  ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE,
+            INT32_MAX, nullptr, nullptr, 0);
+}
+
+class ShmRing {
+public:
+  // Creates a ring with room for capacity bytes of frames, under a
+  // name that must not already exist. Frame lengths are 32 bits, so
+  // the capacity may not exceed 4 GiB.
+  ShmRing(const std::string& name, size_t capacity)
+      : name_(name), owner_(true) {
+    if (capacity > std::numeric_limits<uint32_t>::max()) {
+      throw std::invalid_argument("ring capacity of " +
+                                  std::to_string(capacity) +
+                                  " bytes exceeds 4 GiB");
+    }
+    capacity = (std::max<size_t>(capacity, 64) + 7) & ~size_t(7);
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                        0600);
+    if (fd < 0) {
+      throw std::runtime_error("cannot create " + name + ": " +
+                               std::strerror(errno));
+    }
+    if (::ftruncate(fd, sizeof(_ShmRingHeader) + capacity) != 0) {
+      int error = errno;
+      ::close(fd);
+      ::shm_unlink(name.c_str());
+      throw std::runtime_error("cannot size " + name + ": " +
+                               std::strerror(error));
+    }
+    Map(fd, sizeof(_ShmRingHeader) + capacity);
+    header_ = new (base_) _ShmRingHeader();
+    header_->capacity = capacity;
+    for (pthread_mutex_t& mu : header_->attached_mu) {
+      pthread_mutexattr_t attr;
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+      pthread_mutex_init(&mu, &attr);
+      pthread_mutexattr_destroy(&attr);
+    }
+    Attach();
+  }
+
+  // Opens a ring created, perhaps in another process, under name.
+  explicit ShmRing(const std::string& name) : name_(name), owner_(false) {
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+      throw std::runtime_error("cannot open " + name + ": " +
+                               std::strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(_ShmRingHeader)) {
+      ::close(fd);
+      throw std::runtime_error("not a ring: " + name);
+    }
+    Map(fd, st.st_size);
+    header_ = static_cast<_ShmRingHeader*>(base_);
+    if (sizeof(_ShmRingHeader) + header_->capacity !=
+        static_cast<size_t>(st.st_size)) {
+      ::munmap(base_, size_);
+      throw std::runtime_error("not a ring: " + name);
+    }
+    Attach();
+  }
+
+  // Rings are attached by the thread that creates or opens them, and
+  // must be destroyed by the same thread.
+  ~ShmRing() {
+    pthread_mutex_unlock(&header_->attached_mu[owner_ ? 0 : 1]);
+    ::munmap(base_, size_);
+    if (owner_) {
+      ::shm_unlink(name_.c_str());
+    }
+  }
+  ShmRing(const ShmRing&) = delete;
+  ShmRing& operator=(const ShmRing&) = delete;
+
+  const std::string& name() const { return name_; }
+  size_t capacity() const { return header_->capacity; }
+
+  // The largest frame the ring can hold.
+  size_t max_frame() const { return header_->capacity / 2 - kFrameHeader; }
+
+  // Copies n bytes into the ring as one frame, waiting for room.
+  // Returns false, dropping the frame, if the ring has been closed.
+  // Throws if the other process dies without closing the ring while
+  // this one waits. Only one thread, in one process, may push to a ring.
+  bool Push(const char* data, size_t n) {
+    if (n > max_frame()) {
+      throw std::runtime_error("frame of " + std::to_string(n) +
+                               " bytes does not fit in " + name_);
+    }
+    const uint64_t capacity = header_->capacity;
+    const uint64_t head = header_->head.load(std::memory_order_relaxed);
+    const uint64_t offset = head % capacity;
+    const uint64_t frame = Align(kFrameHeader + n);
+    // A frame that would run past the end of the ring starts again at
+    // the beginning, after a marker that tells the consumer to skip.
+    const uint64_t skip = offset + frame > capacity ? capacity - offset : 0;
+    for (;;) {
+      if (header_->closed.load()) {
+        return false;
+      }
+      if (head + skip + frame - header_->tail.load() <= capacity) {
+        break;
+      }
+      uint32_t seq = header_->tail_seq.load();
+      header_->producer_waiting.store(1);
+      if (head + skip + frame - header_->tail.load() > capacity &&
+          !header_->closed.load()) {
+        _FutexWait(&header_->tail_seq, seq, &kPeerCheckInterval);
+        CheckPeer();
+      }
+    }
+    if (skip) {
+      WriteLength(offset, kSkip);
+    }
+    uint64_t start = (head + skip) % capacity;
+    WriteLength(start, static_cast<uint32_t>(n));
+    std::memcpy(data_ + start + kFrameHeader, data, n);
+    header_->head.store(head + skip + frame);
+    header_->head_seq.fetch_add(1);
+    if (header_->consumer_waiting.exchange(0)) {
+      _FutexWake(&header_->head_seq);
+    }
+    return true;
+  }
+
+  // Removes the oldest frame from the ring into *frame, waiting for one.
+  // Returns false if the ring is empty and has been closed. Throws if
+  // the ring is empty and the other process has died without closing
+  // it. Only one thread, in one process, may pop from a ring.
+  bool Pop(std::string* frame) {
+    const uint64_t capacity = header_->capacity;
+    uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    for (;;) {
+      uint64_t head = header_->head.load();
+      if (head == tail) {
+        if (header_->closed.load()) {
+          // Closing follows the last commit, so check for it again.
+          if (header_->head.load() == tail) {
+            return false;
+          }
+          continue;
+        }
+        uint32_t seq = header_->head_seq.load();
+        header_->consumer_waiting.store(1);
+        if (header_->head.load() == tail && !header_->closed.load()) {
+          _FutexWait(&header_->head_seq, seq, &kPeerCheckInterval);
+          CheckPeer();
+        }
+        continue;
+      }
+      uint64_t offset = tail % capacity;
+      uint32_t n = ReadLength(offset);
+      if (n == kSkip) {
+        tail += capacity - offset;
+        continue;
+      }
+      frame->assign(data_ + offset + kFrameHeader, n);
+      tail += Align(kFrameHeader + n);
+      break;
+    }
+    header_->tail.store(tail);
+    header_->tail_seq.fetch_add(1);
+    if (header_->producer_waiting.exchange(0)) {
+      _FutexWake(&header_->tail_seq);
+    }
+    return true;
+  }
+
+  // Closes the ring. The producer closes it after its last frame; the
+  // consumer may close it to tell the producer to stop.
+  void Close() {
+    header_->closed.store(1);
+    header_->head_seq.fetch_add(1);
+    header_->tail_seq.fetch_add(1);
+    _FutexWake(&header_->head_seq);
+    _FutexWake(&header_->tail_seq);
+  }
+
+  bool closed() const { return header_->closed.load(); }
+
+private:
+  static constexpr size_t kFrameHeader = 4;
+  static constexpr uint32_t kSkip = 0xffffffff;
+
+  static constexpr timespec kPeerCheckInterval = {0, 50 * 1000 * 1000};
+
+  static uint64_t Align(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+
+  // Takes this process's attachment mutex for as long as the ring lives.
+  void Attach() {
+    const int side = owner_ ? 0 : 1;
+    int error = pthread_mutex_lock(&header_->attached_mu[side]);
+    if (error == EOWNERDEAD) {
+      // An earlier process on this side died; take its place.
+      pthread_mutex_consistent(&header_->attached_mu[side]);
+    } else if (error != 0) {
+      ::munmap(base_, size_);
+      if (owner_) {
+        ::shm_unlink(name_.c_str());
+      }
+      throw std::runtime_error("cannot attach to " + name_ + ": " +
+                               std::strerror(error));
+    }
+    header_->attached[side].store(1);
+  }
+
+  // Throws if the other process attached, and has since gone without
+  // closing the ring. A peer that has not yet attached may still come.
+  void CheckPeer() {
+    const int peer = owner_ ? 1 : 0;
+    if (!header_->attached[peer].load() || header_->closed.load()) {
+      return;
+    }
+    pthread_mutex_t* mu = &header_->attached_mu[peer];
+    int error = pthread_mutex_trylock(mu);
+    if (error == EBUSY) {
+      return;
+    }
+    if (error == EOWNERDEAD) {
+      pthread_mutex_consistent(mu);
+    }
+    if (error == 0 || error == EOWNERDEAD) {
+      pthread_mutex_unlock(mu);
+    }
+    if (header_->closed.load()) {
+      return;  // The peer closed the ring before it went.
+    }
+    throw std::runtime_error("the other side of " + name_ +
+                             " went away without closing it");
+  }
+
+  void Map(int fd, size_t size) {
+    void* base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0);
+    int error = errno;
+    ::close(fd);
+    if (base == MAP_FAILED) {
+      if (owner_) {
+        ::shm_unlink(name_.c_str());
+      }
+      throw std::runtime_error("cannot map " + name_ + ": " +
+                               std::strerror(error));
+    }
+    base_ = base;
+    size_ = size;
+    data_ = static_cast<char*>(base) + sizeof(_ShmRingHeader);
+  }
+
+  void WriteLength(uint64_t offset, uint32_t n) {
+    std::memcpy(data_ + offset, &n, sizeof(n));
+  }
+  uint32_t ReadLength(uint64_t offset) const {
+    uint32_t n;
+    std::memcpy(&n, data_ + offset, sizeof(n));
+    return n;
+  }
+
+  const std::string name_;
+  const bool owner_;
+  void* base_;
+  size_t size_;
+  char* data_;
+  _ShmRingHeader* header_;
+};
+
+// Serializes values into a ring. Values are gathered into a batch,
+// which is committed to the ring as one frame when it reaches
+// batch_bytes, and by Flush and Close. Batches are kept to half the
+// largest frame, so that any value that fits in the other half can
+// complete one; a larger value throws.
+template <typename T>
+class ShmSink {
+public:
+  explicit ShmSink(ShmRing* ring, size_t batch_bytes = 64 << 10)
+      : ring_(ring),
+        batch_bytes_(std::min(batch_bytes, ring->max_frame() / 2)),
+        buffer_(nullptr), size_(0), file_(::open_memstream(&buffer_, &size_)) {
+    if (!file_) {
+      throw std::runtime_error("cannot create batch for " + ring->name());
+    }
+  }
+  ~ShmSink() {
+    if (file_) {
+      try {
+        Close();
+      } catch (...) {
+      }
+    }
+    std::free(buffer_);
+  }
+  ShmSink(const ShmSink&) = delete;
+  ShmSink& operator=(const ShmSink&) = delete;
+
+  // Adds x to the batch. Returns false if the ring has been closed.
+  bool operator()(const T& x) {
+    SpillCodec<T>::Write(file_, x);
+    if (static_cast<size_t>(std::ftell(file_)) >= batch_bytes_) {
+      return Flush();
+    }
+    return !ring_->closed();
+  }
+
+  // A consumer that adds to the batch. The sink must outlive it.
+  Consumer<T> consumer() {
+    return [this](const T& x) { (*this)(x); };
+  }
+
+  // Commits the batch. Returns false if the ring has been closed.
+  bool Flush() {
+    std::fflush(file_);
+    size_t n = size_;
+    if (n == 0) {
+      return !ring_->closed();
+    }
+    bool pushed = ring_->Push(buffer_, n);
+    std::rewind(file_);
+    return pushed;
+  }
+
+  // Commits the batch and closes the ring.
+  void Close() {
+    try {
+      Flush();
+    } catch (...) {
+      Finish();
+      throw;
+    }
+    Finish();
+  }
+
+private:
+  void Finish() {
+    std::fclose(file_);
+    file_ = nullptr;
+    ring_->Close();
+  }
+
+  ShmRing* const ring_;
+  const size_t batch_bytes_;
+  char* buffer_;
+  size_t size_;
+  std::FILE* file_;
+};
+
+// Produces the values a ShmSink serialized into a ring, until the sink
+// closes it. The ring must outlive the producer.
+template <typename T>
+Producer<T> ShmSource(ShmRing* ring) {
+  return [ring](const Consumer<T>& c) {
+    std::string frame;
+    T x;
+    while (ring->Pop(&frame)) {
+      std::unique_ptr<std::FILE, int (*)(std::FILE*)> f(
+          ::fmemopen(&frame[0], frame.size(), "r"), std::fclose);
+      if (!f) {
+        throw std::runtime_error("cannot read batch from " + ring->name());
+      }
+      while (SpillCodec<T>::Read(f.get(), &x)) {
+        c(x);
+      }
+    }
+  };
+}
+
+#endif  // SHM_RING_H_
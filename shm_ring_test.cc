@@ -0,0 +1,164 @@
+// Tests for the shared-memory transport.
+
+#include "shm_ring.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+string RingName(const string& test) {
+  return "/shm_ring_test." + test + "." + std::to_string(getpid());
+}
+
+// Runs f in a child process, returning its exit status.
+template <typename F>
+pid_t Fork(const F& f) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    int status = 0;
+    try {
+      f();
+    } catch (...) {
+      status = 1;
+    }
+    _exit(status);
+  }
+  return pid;
+}
+
+int Wait(pid_t pid) {
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+}  // namespace
+
+TEST(ShmRing, MovesFramesInOrderAcrossTheEnd) {
+  ShmRing ring(RingName("frames"), 256);
+  vector<string> sent;
+  for (int i = 0; i < 1000; ++i) {
+    sent.push_back(string(i % 100, static_cast<char>('a' + i % 26)));
+  }
+  pid_t child = Fork([&] {
+    ShmRing ring_in_child(ring.name());
+    for (const string& frame : sent) {
+      if (!ring_in_child.Push(frame.data(), frame.size())) _exit(2);
+    }
+    ring_in_child.Close();
+  });
+  vector<string> received;
+  string frame;
+  while (ring.Pop(&frame)) received.push_back(frame);
+  EXPECT_EQ(0, Wait(child));
+  EXPECT_EQ(sent, received);
+  EXPECT_THROW(ring.Push(nullptr, ring.max_frame() + 1), std::runtime_error);
+}
+
+TEST(ShmRing, ConsumerCanStopTheProducer) {
+  ShmRing ring(RingName("stop"), 1024);
+  pid_t child = Fork([&] {
+    ShmRing ring_in_child(ring.name());
+    string frame(100, 'x');
+    while (ring_in_child.Push(frame.data(), frame.size())) {
+    }
+  });
+  string frame;
+  ASSERT_TRUE(ring.Pop(&frame));
+  ring.Close();
+  EXPECT_EQ(0, Wait(child));
+}
+
+TEST(ShmSink, SerializesValuesBetweenProcesses) {
+  typedef std::tuple<string, int> Row;
+  ShmRing ring(RingName("rows"), 4096);
+  const int kRows = 20000;
+  pid_t child = Fork([&] {
+    ShmRing ring_in_child(ring.name());
+    ShmSink<Row> sink(&ring_in_child, 512);
+    Producer<Row> rows = [&](const Consumer<Row>& c) {
+      for (int i = 0; i < kRows; ++i) c(Row("row " + std::to_string(i), i));
+    };
+    rows(sink.consumer());
+    sink.Close();
+  });
+  int count = 0;
+  bool in_order = true;
+  ShmSource<Row>(&ring)([&](const Row& row) {
+    in_order = in_order && std::get<1>(row) == count &&
+        std::get<0>(row) == "row " + std::to_string(count);
+    ++count;
+  });
+  EXPECT_EQ(0, Wait(child));
+  EXPECT_EQ(kRows, count);
+  EXPECT_TRUE(in_order);
+}
+
+TEST(ShmRing, ConsumerFailsWhenTheProducerDies) {
+  ShmRing ring(RingName("producer_dies"), 1024);
+  pid_t child = Fork([&] {
+    ShmRing ring_in_child(ring.name());
+    string frame(10, 'x');
+    for (;;) {
+      ring_in_child.Push(frame.data(), frame.size());
+      usleep(1000);
+    }
+  });
+  string frame;
+  ASSERT_TRUE(ring.Pop(&frame));
+  ASSERT_TRUE(ring.Pop(&frame));
+  kill(child, SIGKILL);
+  // The child stays a zombie until it is reaped, which must not keep it
+  // looking alive.
+  EXPECT_THROW(while (ring.Pop(&frame)) {}, std::runtime_error);
+  Wait(child);
+}
+
+TEST(ShmRing, ProducerFailsWhenTheConsumerDies) {
+  ShmRing ring(RingName("consumer_dies"), 1024);
+  pid_t child = Fork([&] {
+    ShmRing ring_in_child(ring.name());
+    string frame;
+    ring_in_child.Pop(&frame);
+    pause();
+  });
+  string frame(100, 'x');
+  ASSERT_TRUE(ring.Push(frame.data(), frame.size()));
+  // Let the child take the frame, then kill it; the pushes that follow
+  // fill the ring and then must wait for the dead consumer.
+  usleep(20000);
+  kill(child, SIGKILL);
+  EXPECT_THROW(while (ring.Push(frame.data(), frame.size())) {},
+               std::runtime_error);
+  Wait(child);
+}
+
+TEST(ShmRing, RejectsCapacitiesBeyondFrameLengths) {
+  EXPECT_THROW(ShmRing(RingName("huge"), size_t(1) << 33),
+               std::invalid_argument);
+}
+
+TEST(ShmRing, NamesAreUnlinkedByTheirCreator) {
+  string name = RingName("unlink");
+  { ShmRing ring(name, 64); }
+  EXPECT_THROW(ShmRing ring(name), std::runtime_error);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,437 @@
+// Memory budgets and spilling for stateful pipeline stages.  -*- c++ -*-
+//
+// Most stages are streaming: they hold on to nothing once a value has
+// passed through them. Stateful stages, such as sorting and
+// duplicate elimination, must hold on to values until their input is
+// exhausted. To keep the largest jobs from running out of memory,
+// stateful stages draw the memory they use from a MemoryBudget shared
+// by the whole pipeline. When the budget runs out, a stage spills
+// what it holds to a temporary file and merges the spilled runs back
+// in when it produces its output.
+//
+// Values are spilled in a compact binary format defined by
+// SpillCodec<T>. Codecs are provided for arithmetic types, strings,
+// pairs, and tuples; specialize SpillCodec for your own types.
+
+#ifndef SPILL_H_
+#define SPILL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "consumers_and_producers.h"
+
+// A pipeline-wide budget of bytes that stateful stages may hold.
+// Budgets may be shared by stages running on different threads.
+class MemoryBudget {
+public:
+  explicit MemoryBudget(size_t limit) : limit_(limit), used_(0), spilled_(0) {}
+
+  // Reserves n bytes if doing so does not exceed the limit.
+  bool TryReserve(size_t n) {
+    size_t used = used_.load(std::memory_order_relaxed);
+    do {
+      if (used + n > limit_) {
+        return false;
+      }
+    } while (!used_.compare_exchange_weak(used, used + n,
+                                          std::memory_order_relaxed));
+    return true;
+  }
+
+  // Reserves n bytes even if doing so exceeds the limit. Stages use
+  // this to make progress when a single value exceeds what is left.
+  void Reserve(size_t n) { used_.fetch_add(n, std::memory_order_relaxed); }
+
+  void Release(size_t n) { used_.fetch_sub(n, std::memory_order_relaxed); }
+
+  // Stages report how many bytes they have spilled.
+  void RecordSpill(size_t n) {
+    spilled_.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  size_t limit() const { return limit_; }
+  size_t used() const { return used_.load(std::memory_order_relaxed); }
+  size_t spilled() const { return spilled_.load(std::memory_order_relaxed); }
+
+private:
+  const size_t limit_;
+  std::atomic<size_t> used_;
+  std::atomic<size_t> spilled_;
+};
+
+//==============================================================================
+// SPILL CODECS
+//==============================================================================
+
+// A codec writes values to, and reads them back from, spill files.
+// Size(x) estimates the bytes x occupies in memory. Read returns false
+// at a clean end of the file, before the first byte of a value, and
+// throws std::runtime_error if the file ends, or fails, partway
+// through one. Write errors are left on the file, for ferror to find.
+template <typename T, typename Enable = void>
+struct SpillCodec;
+
+inline void _SpillTruncated() {
+  throw std::runtime_error("spilled value is truncated or corrupt");
+}
+
+template <typename T>
+struct SpillCodec<
+    T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+  static size_t Size(const T& /*x*/) { return sizeof(T); }
+  static size_t Write(std::FILE* f, const T& x) {
+    return std::fwrite(&x, sizeof(x), 1, f) * sizeof(x);
+  }
+  static bool Read(std::FILE* f, T* x) {
+    size_t n = std::fread(x, 1, sizeof(*x), f);
+    if (n == sizeof(*x)) {
+      return true;
+    }
+    if (n != 0 || std::ferror(f)) {
+      _SpillTruncated();
+    }
+    return false;
+  }
+};
+
+// Strings are written as a varint length followed by their bytes.
+template <>
+struct SpillCodec<std::string> {
+  static size_t Size(const std::string& s) {
+    return sizeof(s) + s.capacity();
+  }
+  static size_t Write(std::FILE* f, const std::string& s) {
+    unsigned char len[10];
+    size_t n = 0;
+    for (uint64_t v = s.size(); ; v >>= 7) {
+      len[n++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+      if (v < 0x80) break;
+    }
+    std::fwrite(len, 1, n, f);
+    return n + std::fwrite(s.data(), 1, s.size(), f);
+  }
+  static bool Read(std::FILE* f, std::string* s) {
+    uint64_t size = 0;
+    for (int shift = 0; ; shift += 7) {
+      int byte = std::getc(f);
+      if (byte == EOF && shift == 0 && !std::ferror(f)) {
+        return false;
+      }
+      if (byte == EOF || shift > 63) {
+        _SpillTruncated();
+      }
+      size |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) break;
+    }
+    s->resize(size);
+    if (size != 0 && std::fread(&(*s)[0], 1, size, f) != size) {
+      _SpillTruncated();
+    }
+    return true;
+  }
+};
+
+template <typename A, typename B>
+struct SpillCodec<std::pair<A, B>> {
+  static size_t Size(const std::pair<A, B>& x) {
+    return SpillCodec<A>::Size(x.first) + SpillCodec<B>::Size(x.second);
+  }
+  static size_t Write(std::FILE* f, const std::pair<A, B>& x) {
+    return SpillCodec<A>::Write(f, x.first) + SpillCodec<B>::Write(f, x.second);
+  }
+  static bool Read(std::FILE* f, std::pair<A, B>* x) {
+    if (!SpillCodec<A>::Read(f, &x->first)) {
+      return false;
+    }
+    if (!SpillCodec<B>::Read(f, &x->second)) {
+      _SpillTruncated();
+    }
+    return true;
+  }
+};
+
+template <typename... Types>
+struct SpillCodec<std::tuple<Types...>> {
+  typedef std::tuple<Types...> T;
+  static constexpr int N = sizeof...(Types);
+  typedef typename std::integral_constant<int, N> End;
+
+  template <int I>
+  using Elem = SpillCodec<typename std::tuple_element<I, T>::type>;
+
+  static size_t Size(const T& x) {
+    return Size(x, std::integral_constant<int, 0>());
+  }
+  static size_t Write(std::FILE* f, const T& x) {
+    return Write(f, x, std::integral_constant<int, 0>());
+  }
+  static bool Read(std::FILE* f, T* x) {
+    return Read(f, x, std::integral_constant<int, 0>());
+  }
+
+private:
+  static size_t Size(const T&, End) { return 0; }
+  static size_t Write(std::FILE*, const T&, End) { return 0; }
+  static bool Read(std::FILE*, T*, End) { return true; }
+
+  template <int I>
+  static size_t Size(const T& x, std::integral_constant<int, I>) {
+    return Elem<I>::Size(std::get<I>(x)) +
+        Size(x, std::integral_constant<int, I + 1>());
+  }
+  template <int I>
+  static size_t Write(std::FILE* f, const T& x,
+                      std::integral_constant<int, I>) {
+    return Elem<I>::Write(f, std::get<I>(x)) +
+        Write(f, x, std::integral_constant<int, I + 1>());
+  }
+  template <int I>
+  static bool Read(std::FILE* f, T* x, std::integral_constant<int, I>) {
+    if (!Elem<I>::Read(f, &std::get<I>(*x))) {
+      // Only the first element may find the end of the file.
+      if (I > 0) {
+        _SpillTruncated();
+      }
+      return false;
+    }
+    return Read(f, x, std::integral_constant<int, I + 1>());
+  }
+};
+
+//==============================================================================
+// STATEFUL STAGES
+//==============================================================================
+
+// A run of values spilled to an anonymous temporary file. The file is
+// deleted when the run is destroyed.
+template <typename T>
+class _SpillRun {
+public:
+  _SpillRun() : file_(std::tmpfile()) {
+    if (!file_) {
+      throw std::runtime_error("cannot create spill file");
+    }
+  }
+  ~_SpillRun() { std::fclose(file_); }
+  _SpillRun(const _SpillRun&) = delete;
+  _SpillRun& operator=(const _SpillRun&) = delete;
+
+  size_t Write(const T& x) { return SpillCodec<T>::Write(file_, x); }
+
+  // Flushes the run, and throws if any of it failed to be written, as
+  // when the disk is full, rather than let the values be lost.
+  void Finish() {
+    if (std::fflush(file_) != 0 || std::ferror(file_)) {
+      throw std::runtime_error("cannot write spill file");
+    }
+  }
+
+  void Rewind() { std::rewind(file_); }
+  bool Read(T* x) { return SpillCodec<T>::Read(file_, x); }
+
+private:
+  std::FILE* file_;
+};
+
+// Collects values under a memory budget and emits them in sorted
+// order, spilling sorted runs when the budget runs out and merging
+// them back afterward.
+//
+// Each run holds an open file, so runs are merged at most
+// kMaxMergeFanIn at a time: whenever that many runs of one level have
+// been spilled, they are merged into a single run of the next level,
+// and Emit merges what remains down to that many before the final
+// pass.
+template <typename T, typename Less>
+class _ExternalSorter {
+public:
+  static constexpr size_t kMaxMergeFanIn = 64;
+  static constexpr size_t kMinRunBytes = 1 << 20;
+
+  _ExternalSorter(MemoryBudget* budget, Less less, bool distinct)
+      : budget_(budget), less_(less), distinct_(distinct), reserved_(0),
+        min_run_(std::min<size_t>(kMinRunBytes, budget->limit() / 4)) {}
+  ~_ExternalSorter() { budget_->Release(reserved_); }
+
+  void Add(const T& x) {
+    size_t size = SpillCodec<T>::Size(x);
+    if (!budget_->TryReserve(size)) {
+      // When other stages hold the budget, spilling frees too little
+      // of it to help, so runs smaller than min_run_ are not spilled:
+      // the sorter goes over the budget instead of spilling a run for
+      // every value.
+      if (reserved_ >= min_run_) {
+        Spill();
+      }
+      if (!budget_->TryReserve(size)) {
+        budget_->Reserve(size);
+      }
+    }
+    reserved_ += size;
+    buffer_.push_back(x);
+  }
+
+  void Emit(const Consumer<T>& c) {
+    Sort();
+    if (runs_.empty()) {
+      for (size_t i = 0; i < buffer_.size(); ++i) {
+        if (!distinct_ || i == 0 || less_(buffer_[i - 1], buffer_[i])) {
+          c(buffer_[i]);
+        }
+      }
+      return;
+    }
+    // Leave room for the buffer in the final merge.
+    while (runs_.size() >= kMaxMergeFanIn) {
+      MergeYoungest(kMaxMergeFanIn);
+    }
+    Merge(0, true, c);
+  }
+
+private:
+  void Sort() {
+    if (distinct_) {
+      std::sort(buffer_.begin(), buffer_.end(), less_);
+    } else {
+      std::stable_sort(buffer_.begin(), buffer_.end(), less_);
+    }
+  }
+
+  void Spill() {
+    Sort();
+    std::unique_ptr<_SpillRun<T>> run(new _SpillRun<T>);
+    size_t bytes = 0;
+    for (size_t i = 0; i < buffer_.size(); ++i) {
+      if (!distinct_ || i == 0 || less_(buffer_[i - 1], buffer_[i])) {
+        bytes += run->Write(buffer_[i]);
+      }
+    }
+    run->Finish();
+    runs_.push_back(std::move(run));
+    levels_.push_back(0);
+    budget_->RecordSpill(bytes);
+    budget_->Release(reserved_);
+    reserved_ = 0;
+    std::vector<T>().swap(buffer_);
+    // Levels only decrease from the oldest run to the youngest, so the
+    // youngest kMaxMergeFanIn runs share a level if the first of them
+    // has the youngest's.
+    while (runs_.size() >= kMaxMergeFanIn &&
+           levels_[runs_.size() - kMaxMergeFanIn] == levels_.back()) {
+      MergeYoungest(kMaxMergeFanIn);
+    }
+  }
+
+  // Replaces the youngest k runs with a run of their merged values.
+  void MergeYoungest(size_t k) {
+    const size_t first = runs_.size() - k;
+    const size_t level = levels_.back() + 1;
+    std::unique_ptr<_SpillRun<T>> merged(new _SpillRun<T>);
+    size_t bytes = 0;
+    Merge(first, false, [&](const T& x) { bytes += merged->Write(x); });
+    merged->Finish();
+    budget_->RecordSpill(bytes);
+    runs_.resize(first);
+    levels_.resize(first);
+    runs_.push_back(std::move(merged));
+    levels_.push_back(level);
+  }
+
+  // K-way merge of the runs from first on and, if with_buffer, the
+  // sorted in-memory buffer, into out. A cursor is the index of a run,
+  // or runs_.size() for the buffer.
+  template <typename Out>
+  void Merge(size_t first, bool with_buffer, const Out& out) {
+    std::vector<T> heads(runs_.size() + 1);
+    size_t buffer_pos = 0;
+    auto advance = [&](size_t cursor) {
+      if (cursor < runs_.size()) {
+        return runs_[cursor]->Read(&heads[cursor]);
+      }
+      if (buffer_pos == buffer_.size()) {
+        return false;
+      }
+      heads[cursor] = std::move(buffer_[buffer_pos++]);
+      return true;
+    };
+    auto greater = [&](size_t a, size_t b) {
+      return less_(heads[b], heads[a]);
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)>
+        cursors(greater);
+    for (size_t cursor = first; cursor < runs_.size(); ++cursor) {
+      runs_[cursor]->Rewind();
+      if (advance(cursor)) {
+        cursors.push(cursor);
+      }
+    }
+    if (with_buffer && advance(runs_.size())) {
+      cursors.push(runs_.size());
+    }
+    bool emitted = false;
+    T last{};
+    while (!cursors.empty()) {
+      size_t cursor = cursors.top();
+      cursors.pop();
+      if (!distinct_ || !emitted || less_(last, heads[cursor])) {
+        out(heads[cursor]);
+        if (distinct_) {
+          last = heads[cursor];
+          emitted = true;
+        }
+      }
+      if (advance(cursor)) {
+        cursors.push(cursor);
+      }
+    }
+  }
+
+  MemoryBudget* budget_;
+  Less less_;
+  bool distinct_;
+  size_t reserved_;
+  const size_t min_run_;  // The fewest bytes worth spilling as a run.
+  std::vector<T> buffer_;
+  std::vector<std::unique_ptr<_SpillRun<T>>> runs_;
+  std::vector<size_t> levels_;  // How many merges made each run.
+};
+
+// Sorting a producer produces its values in sorted order. The sort is
+// stable unless runs have been spilled. The budget must outlive the
+// returned producer.
+template <typename T, typename Less = std::less<T>>
+Producer<T> PSort(const Producer<T>& p, MemoryBudget* budget,
+                  Less less = Less()) {
+  return [=](const Consumer<T>& c) {
+    _ExternalSorter<T, Less> sorter(budget, less, false);
+    p([&](const T& x) { sorter.Add(x); });
+    sorter.Emit(c);
+  };
+}
+
+// Eliminating duplicates produces a producer's distinct values in
+// sorted order. The budget must outlive the returned producer.
+template <typename T, typename Less = std::less<T>>
+Producer<T> PDistinct(const Producer<T>& p, MemoryBudget* budget,
+                      Less less = Less()) {
+  return [=](const Consumer<T>& c) {
+    _ExternalSorter<T, Less> sorter(budget, less, true);
+    p([&](const T& x) { sorter.Add(x); });
+    sorter.Emit(c);
+  };
+}
+
+#endif  // SPILL_H_
@@ -0,0 +1,187 @@
+// Tests for memory budgets and spilling stateful stages.
+
+#include "spill.h"
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+template <typename T>
+Producer<T> Produce(vector<T> ts) {
+  return {
+    [=](Consumer<T> c) {
+      for (auto& t : ts) {
+        c(t);
+      }
+    }
+  };
+}
+
+template <typename T>
+vector<T> Collect(const Producer<T>& p) {
+  vector<T> ts;
+  p([&](const T& t) { ts.push_back(t); });
+  return ts;
+}
+
+template <typename T>
+T RoundTrip(const T& x) {
+  std::FILE* f = std::tmpfile();
+  SpillCodec<T>::Write(f, x);
+  std::rewind(f);
+  T y{};
+  EXPECT_TRUE(SpillCodec<T>::Read(f, &y));
+  std::fclose(f);
+  return y;
+}
+
+}  // namespace
+
+TEST(Spill, CodecsMustRoundTrip) {
+  EXPECT_EQ(42, RoundTrip(42));
+  EXPECT_EQ(2.5, RoundTrip(2.5));
+  EXPECT_EQ("", RoundTrip(string()));
+  EXPECT_EQ(string(300, 'x'), RoundTrip(string(300, 'x')));
+  auto tuple = std::make_tuple(1, string("one"), std::make_pair(2.0, 'c'));
+  EXPECT_EQ(tuple, RoundTrip(tuple));
+}
+
+TEST(Spill, SortWithinBudgetMustNotSpill) {
+  MemoryBudget budget(1 << 20);
+  auto sorted = PSort(Produce<int>({3, 1, 2, 1}), &budget);
+  EXPECT_EQ(vector<int>({1, 1, 2, 3}), Collect(sorted));
+  EXPECT_EQ(0u, budget.spilled());
+  EXPECT_EQ(0u, budget.used());
+}
+
+TEST(Spill, SortOverBudgetMustSpillAndMerge) {
+  vector<string> words;
+  for (int i = 0; i < 1000; ++i) {
+    words.push_back(std::to_string(i * 7919 % 1000));
+  }
+  // Room for only a few dozen strings at a time.
+  MemoryBudget budget(40 * sizeof(string));
+  vector<string> expected = words;
+  std::sort(expected.begin(), expected.end());
+  EXPECT_EQ(expected, Collect(PSort(Produce(words), &budget)));
+  EXPECT_LT(0u, budget.spilled());
+  EXPECT_EQ(0u, budget.used());
+
+  // Sort in descending order.
+  std::reverse(expected.begin(), expected.end());
+  EXPECT_EQ(expected,
+            Collect(PSort(Produce(words), &budget, std::greater<string>())));
+}
+
+TEST(Spill, DistinctMustEliminateDuplicatesAcrossRuns) {
+  vector<int> ints;
+  for (int i = 0; i < 500; ++i) {
+    ints.push_back(i % 37);
+  }
+  MemoryBudget budget(16 * sizeof(int));
+  vector<int> expected;
+  for (int i = 0; i < 37; ++i) {
+    expected.push_back(i);
+  }
+  EXPECT_EQ(expected, Collect(PDistinct(Produce(ints), &budget)));
+  EXPECT_LT(0u, budget.spilled());
+  EXPECT_EQ(0u, budget.used());
+}
+
+TEST(Spill, TruncatedValuesMustBeCorruptionNotEnd) {
+  std::FILE* f = std::tmpfile();
+  SpillCodec<std::tuple<int, string>>::Write(
+      f, std::make_tuple(7, string("seven")));
+  long whole = std::ftell(f);
+  std::tuple<int, string> x;
+  // A clean end of the file, at every cut through the value but the
+  // first, is corruption.
+  for (long cut = 0; cut < whole; ++cut) {
+    std::fflush(f);
+    ASSERT_EQ(0, ftruncate(fileno(f), cut));
+    std::rewind(f);
+    if (cut == 0) {
+      EXPECT_FALSE((SpillCodec<std::tuple<int, string>>::Read(f, &x)));
+    } else {
+      EXPECT_THROW((SpillCodec<std::tuple<int, string>>::Read(f, &x)),
+                   std::runtime_error) << "cut at " << cut;
+    }
+    std::fseek(f, 0, SEEK_END);
+    SpillCodec<std::tuple<int, string>>::Write(
+        f, std::make_tuple(7, string("seven")));
+    std::fflush(f);
+    ASSERT_EQ(0, ftruncate(fileno(f), whole));
+  }
+  std::fclose(f);
+}
+
+TEST(Spill, FailedSpillsMustThrow) {
+  // Run in a child, with spill files limited to a few bytes, so that
+  // spilling fails as it would on a full disk.
+  pid_t child = fork();
+  if (child == 0) {
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit limit = {16, 16};
+    setrlimit(RLIMIT_FSIZE, &limit);
+    vector<int> ints(100000);
+    MemoryBudget budget(16 * sizeof(int));
+    try {
+      Collect(PSort(Produce(ints), &budget));
+    } catch (const std::runtime_error&) {
+      _exit(0);
+    }
+    _exit(1);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+}
+
+TEST(Spill, SortsUnderPressureWithoutRunningOutOfFiles) {
+  // Run in a child, with few files to spare, while another stage holds
+  // the whole budget, so that the sort keeps spilling small runs.
+  pid_t child = fork();
+  if (child == 0) {
+    rlimit limit = {256, 256};
+    setrlimit(RLIMIT_NOFILE, &limit);
+    vector<int> ints;
+    for (int i = 0; i < 100000; ++i) {
+      ints.push_back(i * 7919 % 100000);
+    }
+    MemoryBudget budget(16 * sizeof(int));
+    budget.Reserve(budget.limit());
+    try {
+      vector<int> sorted = Collect(PSort(Produce(ints), &budget));
+      std::sort(ints.begin(), ints.end());
+      _exit(sorted == ints && budget.spilled() > 0 ? 0 : 1);
+    } catch (const std::runtime_error&) {
+      _exit(2);
+    }
+  }
+  int status;
+  waitpid(child, &status, 0);
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,395 @@
+// Producers that can split themselves, for parallel execution.  -*- c++ -*-
+//
+// A SplittableProducer<T> is a producer that can divide itself into
+// two independent producers that, between them, produce what it does,
+// in the manner of TBB's ranges. A parallel executor can thus divide
+// the work evenly up front, rather than relying only on stealing:
+//
+//   ThreadPool pool;
+//   std::vector<long> totals(pool.size());
+//   ParallelRun(&pool, SplittableRange(salaries), [&](size_t part) {
+//     return Consumer<const long&>([&, part](long x) { totals[part] += x; });
+//   });
+//
+// Splittable producers are provided for random-access containers such
+// as std::vector and protobuf's RepeatedPtrField (SplittableRange and
+// SplittableIndexed), for record files split by byte offset
+// (SplittableRecords), and for cross products, split along their
+// leading axis (SplitCross).
+
+#ifndef SPLITTABLE_H_
+#define SPLITTABLE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "text_producers.h"
+#include "thread_pool.h"
+
+template <typename T>
+class _Splittable {
+public:
+  typedef std::shared_ptr<const _Splittable> Ptr;
+  virtual ~_Splittable() {}
+  virtual void Run(const Consumer<T>& c) const = 0;
+  // The amount of work, in whatever units suit the producer.
+  virtual size_t size() const = 0;
+  virtual bool divisible() const = 0;
+  // Splits into two non-empty halves. Only called if divisible.
+  virtual std::pair<Ptr, Ptr> Split() const = 0;
+};
+
+template <typename T>
+class SplittableProducer {
+public:
+  typedef T value_type;
+
+  explicit SplittableProducer(typename _Splittable<T>::Ptr node)
+      : node_(std::move(node)) {}
+
+  void operator()(const Consumer<T>& c) const { node_->Run(c); }
+  operator Producer<T>() const {
+    auto node = node_;
+    return [node](const Consumer<T>& c) { node->Run(c); };
+  }
+
+  size_t size() const { return node_->size(); }
+  bool divisible() const { return node_->divisible(); }
+  std::pair<SplittableProducer, SplittableProducer> Split() const {
+    auto halves = node_->Split();
+    return { SplittableProducer(halves.first),
+             SplittableProducer(halves.second) };
+  }
+
+private:
+  typename _Splittable<T>::Ptr node_;
+};
+
+// Splits a producer into up to n parts, by repeatedly halving the
+// largest part that can still be split.
+template <typename T>
+std::vector<SplittableProducer<T>> SplitInto(const SplittableProducer<T>& p,
+                                             size_t n) {
+  std::vector<SplittableProducer<T>> parts{p};
+  while (parts.size() < n) {
+    auto largest = parts.end();
+    for (auto it = parts.begin(); it != parts.end(); ++it) {
+      if (it->divisible() &&
+          (largest == parts.end() || it->size() > largest->size())) {
+        largest = it;
+      }
+    }
+    if (largest == parts.end()) {
+      break;
+    }
+    auto halves = largest->Split();
+    *largest = halves.first;
+    parts.insert(largest + 1, halves.second);
+  }
+  return parts;
+}
+
+// Runs a splittable producer on a pool, split up front into parts
+// (by default, one per worker). Part k is fed to make_consumer(k), and
+// is placed on the node that ParallelFor would place block k on.
+// Waits for all the parts, and rethrows the first exception thrown.
+template <typename T, typename MakeConsumer>
+void ParallelRun(ThreadPool* pool, const SplittableProducer<T>& p,
+                 const MakeConsumer& make_consumer, size_t parts = 0) {
+  auto pieces = SplitInto(p, parts ? parts : pool->size());
+  TaskGroup group(pool);
+  for (size_t k = 0; k < pieces.size(); ++k) {
+    group.Run([&pieces, &make_consumer, k] {
+      Consumer<T> c = make_consumer(k);
+      pieces[k](c);
+    }, static_cast<int>(k * pool->nodes() / pieces.size()));
+  }
+  group.Wait();
+}
+
+//==============================================================================
+// Indexed sources
+//==============================================================================
+
+template <typename T, typename Get>
+class _SplittableIndexed : public _Splittable<T> {
+public:
+  _SplittableIndexed(std::shared_ptr<const Get> get, size_t begin,
+                     size_t end, size_t grain)
+      : get_(std::move(get)), begin_(begin), end_(end), grain_(grain) {}
+
+  void Run(const Consumer<T>& c) const override {
+    for (size_t i = begin_; i < end_; ++i) {
+      c((*get_)(i));
+    }
+  }
+  size_t size() const override { return end_ - begin_; }
+  bool divisible() const override { return end_ - begin_ > grain_; }
+  std::pair<typename _Splittable<T>::Ptr, typename _Splittable<T>::Ptr>
+  Split() const override {
+    size_t middle = begin_ + (end_ - begin_) / 2;
+    return { std::make_shared<_SplittableIndexed>(get_, begin_, middle, grain_),
+             std::make_shared<_SplittableIndexed>(get_, middle, end_, grain_) };
+  }
+
+private:
+  std::shared_ptr<const Get> get_;
+  size_t begin_, end_, grain_;
+};
+
+// Produces get(i) for i in [0, n). Parts of no more than grain indexes
+// are not split further.
+template <typename T, typename Get>
+SplittableProducer<T> SplittableIndexed(size_t n, const Get& get,
+                                        size_t grain = 1) {
+  return SplittableProducer<T>(std::make_shared<_SplittableIndexed<T, Get>>(
+      std::make_shared<const Get>(get), 0, n, std::max<size_t>(grain, 1)));
+}
+
+// Produces references to the elements of a random-access container,
+// which must outlive the producer.
+template <typename C>
+SplittableProducer<const typename C::value_type&> SplittableRange(
+    const C& container, size_t grain = 1) {
+  const C* c = &container;
+  return SplittableIndexed<const typename C::value_type&>(
+      container.size(),
+      [c](size_t i) -> const typename C::value_type& { return (*c)[i]; },
+      grain);
+}
+
+//==============================================================================
+// Record files
+//==============================================================================
+
+// A record file starts with a magic number and a sync marker drawn
+// at random for the file, as in Hadoop's SequenceFiles. Then follows
+// a sequence of records, each the file's sync marker, the length of
+// its payload as four little-endian bytes, and the payload. A reader
+// that starts at an arbitrary byte offset finds its way to the next
+// record by searching for the marker, and checking that what follows
+// is a whole record that ends at the end of the file or at another
+// marker. Since the marker is the file's own, payloads that contain
+// other record files do not lead the reader astray.
+inline constexpr char kRecordMagic[4] = { '\x93', 'R', 'e', 'c' };
+inline constexpr size_t kRecordSyncSize = 16;
+inline constexpr size_t kRecordFileHeader =
+    sizeof(kRecordMagic) + kRecordSyncSize;
+inline constexpr size_t kRecordHeader = kRecordSyncSize + 4;
+
+class RecordWriter {
+public:
+  explicit RecordWriter(const std::string& path)
+      : file_(std::fopen(path.c_str(), "wb")) {
+    if (!file_) {
+      throw std::runtime_error("cannot create " + path + ": " +
+                               std::strerror(errno));
+    }
+    std::random_device random;
+    for (size_t i = 0; i < kRecordSyncSize; i += 4) {
+      uint32_t r = random();
+      std::memcpy(sync_ + i, &r, 4);
+    }
+    if (std::fwrite(kRecordMagic, 1, sizeof(kRecordMagic), file_) !=
+            sizeof(kRecordMagic) ||
+        std::fwrite(sync_, 1, kRecordSyncSize, file_) != kRecordSyncSize) {
+      Close();
+      throw std::runtime_error("cannot write record file header");
+    }
+  }
+  ~RecordWriter() { Close(); }
+  RecordWriter(const RecordWriter&) = delete;
+  RecordWriter& operator=(const RecordWriter&) = delete;
+
+  void Write(std::string_view payload) {
+    uint32_t n = static_cast<uint32_t>(payload.size());
+    unsigned char length[4] = {
+      static_cast<unsigned char>(n), static_cast<unsigned char>(n >> 8),
+      static_cast<unsigned char>(n >> 16), static_cast<unsigned char>(n >> 24) };
+    if (std::fwrite(sync_, 1, kRecordSyncSize, file_) != kRecordSyncSize ||
+        std::fwrite(length, 1, 4, file_) != 4 ||
+        std::fwrite(payload.data(), 1, payload.size(), file_) !=
+            payload.size()) {
+      throw std::runtime_error("cannot write record");
+    }
+  }
+
+  void Close() {
+    if (file_) {
+      std::fclose(file_);
+      file_ = nullptr;
+    }
+  }
+
+private:
+  std::FILE* file_;
+  char sync_[kRecordSyncSize];
+};
+
+class _SplittableRecords : public _Splittable<std::string_view> {
+public:
+  _SplittableRecords(std::shared_ptr<const MappedFile> file, size_t begin,
+                     size_t end)
+      : file_(std::move(file)), begin_(begin), end_(end) {}
+
+  // The whole of a file, whose header is checked.
+  explicit _SplittableRecords(std::shared_ptr<const MappedFile> file)
+      : file_(std::move(file)), begin_(0), end_(file_->size()) {
+    if (file_->size() != 0 &&
+        (file_->size() < kRecordFileHeader ||
+         std::memcmp(file_->data(), kRecordMagic, sizeof(kRecordMagic)))) {
+      throw std::runtime_error("not a record file");
+    }
+  }
+
+  // Produces the records whose markers start in [begin, end).
+  void Run(const Consumer<std::string_view>& c) const override {
+    const char* data = file_->data();
+    size_t p = Sync(begin_);
+    while (p < end_) {
+      size_t n = Length(p);
+      if (n == kNoRecord) {
+        throw std::runtime_error("corrupt record at offset " +
+                                 std::to_string(p));
+      }
+      c(std::string_view(data + p + kRecordHeader, n));
+      p += kRecordHeader + n;
+    }
+  }
+  size_t size() const override { return end_ - begin_; }
+  bool divisible() const override { return end_ - begin_ >= 2; }
+  std::pair<Ptr, Ptr> Split() const override {
+    size_t middle = begin_ + (end_ - begin_) / 2;
+    return { std::make_shared<_SplittableRecords>(file_, begin_, middle),
+             std::make_shared<_SplittableRecords>(file_, middle, end_) };
+  }
+
+private:
+  static const size_t kNoRecord = ~size_t(0);
+
+  const char* sync() const { return file_->data() + sizeof(kRecordMagic); }
+
+  bool MarkerAt(size_t p) const {
+    return p + kRecordHeader <= file_->size() &&
+        std::memcmp(file_->data() + p, sync(), kRecordSyncSize) == 0;
+  }
+
+  // The payload length of the record at p, or kNoRecord if there is
+  // no whole record there.
+  size_t Length(size_t p) const {
+    if (!MarkerAt(p)) {
+      return kNoRecord;
+    }
+    const unsigned char* l = reinterpret_cast<const unsigned char*>(
+        file_->data() + p + kRecordSyncSize);
+    size_t n = l[0] | l[1] << 8 | l[2] << 16 | static_cast<size_t>(l[3]) << 24;
+    if (n > file_->size() - p - kRecordHeader) {
+      return kNoRecord;
+    }
+    return n;
+  }
+
+  // The offset of the first record at or after p.
+  size_t Sync(size_t p) const {
+    const char* data = file_->data();
+    const char* end = data + file_->size();
+    p = std::max(p, kRecordFileHeader);
+    while (p < file_->size()) {
+      const char* q = _FindByte(data + p, end, sync()[0]);
+      p = q - data;
+      size_t n = Length(p);
+      if (n != kNoRecord) {
+        size_t next = p + kRecordHeader + n;
+        if (next == file_->size() || MarkerAt(next)) {
+          return p;
+        }
+      }
+      ++p;
+    }
+    return file_->size();
+  }
+
+  std::shared_ptr<const MappedFile> file_;
+  size_t begin_, end_;
+};
+
+// Produces the payloads of the records in a record file. The payloads
+// are views into the mapped file, valid while the consumer runs.
+inline SplittableProducer<std::string_view> SplittableRecords(
+    const std::string& path) {
+  return SplittableProducer<std::string_view>(
+      std::make_shared<_SplittableRecords>(
+          std::make_shared<const MappedFile>(path)));
+}
+
+//==============================================================================
+// Cross products
+//==============================================================================
+
+// Copies the values of a producer, so that producers of references,
+// such as SplittableRange, can be crossed: PCross builds its tuples
+// from the values it is given, and would keep dangling references.
+template <typename T>
+Producer<typename std::decay<T>::type> _ByValue(const Producer<T>& p) {
+  typedef typename std::decay<T>::type V;
+  return [p](const Consumer<V>& c) { p([&](T x) { c(V(x)); }); };
+}
+
+template <typename A, typename... Bs>
+class _SplitCross : public _Splittable<std::tuple<
+    typename std::decay<A>::type, typename std::decay<Bs>::type...>> {
+public:
+  typedef std::tuple<typename std::decay<A>::type,
+                     typename std::decay<Bs>::type...> Tuple;
+  typedef typename _Splittable<Tuple>::Ptr Ptr;
+
+  _SplitCross(SplittableProducer<A> leading,
+              std::shared_ptr<const std::tuple<Producer<Bs>...>> rest)
+      : leading_(std::move(leading)), rest_(std::move(rest)) {}
+
+  void Run(const Consumer<Tuple>& c) const override {
+    std::apply([&](const Producer<Bs>&... ps) {
+      PCross(_ByValue(Producer<A>(leading_)), _ByValue(ps)...)(c);
+    }, *rest_);
+  }
+  size_t size() const override { return leading_.size(); }
+  bool divisible() const override { return leading_.divisible(); }
+  std::pair<Ptr, Ptr> Split() const override {
+    auto halves = leading_.Split();
+    return { std::make_shared<_SplitCross>(halves.first, rest_),
+             std::make_shared<_SplitCross>(halves.second, rest_) };
+  }
+
+private:
+  SplittableProducer<A> leading_;
+  std::shared_ptr<const std::tuple<Producer<Bs>...>> rest_;
+};
+
+// The cross product PCross(leading, rest...), split along its leading
+// axis. Its tuples hold copies of the values, even of producers of
+// references.
+template <typename A, typename... Bs>
+SplittableProducer<typename _SplitCross<A, Bs...>::Tuple> SplitCross(
+    const SplittableProducer<A>& leading, const Producer<Bs>&... rest) {
+  return SplittableProducer<typename _SplitCross<A, Bs...>::Tuple>(
+      std::make_shared<_SplitCross<A, Bs...>>(
+          leading, std::make_shared<const std::tuple<Producer<Bs>...>>(
+                       rest...)));
+}
+
+#endif  // SPLITTABLE_H_
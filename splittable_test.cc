@@ -0,0 +1,207 @@
+// Tests for splittable producers.
+
+#include "splittable.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+#include "thread_pool.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+template <typename T>
+vector<typename std::decay<T>::type> Collect(const Producer<T>& p) {
+  vector<typename std::decay<T>::type> xs;
+  p([&](T x) { xs.push_back(x); });
+  return xs;
+}
+
+class TempFile {
+public:
+  TempFile() {
+    char name[] = "/tmp/splittable_test.XXXXXX";
+    int fd = mkstemp(name);
+    close(fd);
+    path_ = name;
+  }
+  ~TempFile() { unlink(path_.c_str()); }
+  const string& path() const { return path_; }
+
+private:
+  string path_;
+};
+
+}  // namespace
+
+TEST(SplittableRange, PartsProduceTheWholeInOrder) {
+  vector<int> xs(1000);
+  std::iota(xs.begin(), xs.end(), 0);
+  auto p = SplittableRange(xs);
+  EXPECT_EQ(xs, Collect<const int&>(p));
+  for (size_t n : {1u, 2u, 3u, 7u, 64u}) {
+    auto parts = SplitInto(p, n);
+    EXPECT_EQ(n, parts.size());
+    vector<int> joined;
+    size_t smallest = xs.size(), largest = 0;
+    for (const auto& part : parts) {
+      auto ys = Collect<const int&>(part);
+      joined.insert(joined.end(), ys.begin(), ys.end());
+      smallest = std::min(smallest, ys.size());
+      largest = std::max(largest, ys.size());
+    }
+    EXPECT_EQ(xs, joined);
+    // The parts are as near equal as halving allows.
+    EXPECT_LE(largest, 2 * smallest + 1);
+  }
+  // Parts of no more than grain values are not split.
+  EXPECT_EQ(1u, SplitInto(SplittableRange(xs, 1000), 8).size());
+  EXPECT_EQ(3u, SplitInto(SplittableRange(vector<int>(3)), 8).size());
+}
+
+TEST(SplittableRecords, PartsProduceEveryRecordOnce) {
+  // A record file of its own, to nest in the payloads of the other.
+  TempFile inner;
+  {
+    RecordWriter writer(inner.path());
+    for (int i = 0; i < 20; ++i) {
+      writer.Write(string(i, 'x'));
+    }
+  }
+  string nested;
+  {
+    MappedFile mapped(inner.path());
+    nested.assign(mapped.data(), mapped.size());
+  }
+  TempFile file;
+  vector<string> records;
+  {
+    RecordWriter writer(file.path());
+    for (int i = 0; i < 500; ++i) {
+      // Payloads of varied lengths, some of which contain the magic
+      // number, or a whole record file with records of its own.
+      string payload(i % 37, static_cast<char>('a' + i % 26));
+      if (i % 5 == 0) payload += string(kRecordMagic, sizeof(kRecordMagic));
+      if (i % 50 == 0) payload += nested;
+      records.push_back(payload);
+      writer.Write(payload);
+    }
+    writer.Write("");
+    records.push_back("");
+  }
+  auto p = SplittableRecords(file.path());
+  vector<string> all;
+  p([&](std::string_view r) { all.emplace_back(r); });
+  EXPECT_EQ(records, all);
+  for (size_t n : {2u, 5u, 16u, 1000u}) {
+    vector<string> joined;
+    for (const auto& part : SplitInto(p, n)) {
+      part([&](std::string_view r) { joined.emplace_back(r); });
+    }
+    EXPECT_EQ(records, joined);
+  }
+}
+
+TEST(SplittableRecords, ProducesNothingFromAnEmptyFile) {
+  TempFile file;
+  auto p = SplittableRecords(file.path());
+  EXPECT_FALSE(p.divisible());
+  EXPECT_TRUE(Collect<std::string_view>(p).empty());
+  // Nor from a file with a header but no records.
+  RecordWriter(file.path()).Close();
+  EXPECT_TRUE(
+      Collect<std::string_view>(SplittableRecords(file.path())).empty());
+}
+
+TEST(SplittableRecords, RejectsOtherFiles) {
+  TempFile file;
+  {
+    std::FILE* f = std::fopen(file.path().c_str(), "wb");
+    std::fputs("not a record file at all", f);
+    std::fclose(f);
+  }
+  EXPECT_THROW(SplittableRecords(file.path()), std::runtime_error);
+}
+
+TEST(SplitCross, SplitsTheLeadingAxis) {
+  typedef std::tuple<int, char> Pair;
+  typedef vector<Pair> Pairs;
+  vector<int> xs = {1, 2, 3, 4};
+  Producer<char> ys = [](const Consumer<char>& c) { c('a'); c('b'); };
+  auto p = SplitCross(SplittableIndexed<int>(xs.size(),
+                                             [&](size_t i) { return xs[i]; }),
+                      ys);
+  auto whole = Collect<Pair>(PCross(
+      Producer<int>(SplittableIndexed<int>(xs.size(),
+                                           [&](size_t i) { return xs[i]; })),
+      ys));
+  EXPECT_EQ(whole, Collect<Pair>(p));
+  EXPECT_EQ(8u, whole.size());
+  auto halves = p.Split();
+  auto first = Collect<Pair>(halves.first);
+  auto second = Collect<Pair>(halves.second);
+  EXPECT_EQ(Pairs(whole.begin(), whole.begin() + 4),
+            first);
+  EXPECT_EQ(Pairs(whole.begin() + 4, whole.end()),
+            second);
+}
+
+TEST(SplitCross, CopiesTheValuesOfRanges) {
+  typedef std::tuple<string, int> Pair;
+  vector<string> names = {"ann", "bob", "cy"};
+  vector<int> numbers = {1, 2};
+  Producer<const int&> ns = SplittableRange(numbers);
+  auto p = SplitCross(SplittableRange(names), ns);
+  vector<Pair> expected = {{"ann", 1}, {"ann", 2}, {"bob", 1},
+                           {"bob", 2}, {"cy", 1}, {"cy", 2}};
+  EXPECT_EQ(expected, Collect<Pair>(p));
+  vector<Pair> joined;
+  for (const auto& part : SplitInto(p, 3)) {
+    part([&](const Pair& x) { joined.push_back(x); });
+  }
+  EXPECT_EQ(expected, joined);
+}
+
+TEST(ParallelRun, FeedsEachPartToItsOwnConsumer) {
+  ThreadPool pool(4);
+  vector<long> xs(100000);
+  std::iota(xs.begin(), xs.end(), 1);
+  vector<long> totals(pool.size());
+  std::atomic<int> consumers{0};
+  ParallelRun(&pool, SplittableRange(xs), [&](size_t part) {
+    ++consumers;
+    return Consumer<const long&>([&, part](long x) { totals[part] += x; });
+  });
+  EXPECT_EQ(4, consumers.load());
+  EXPECT_EQ(5000050000L, std::accumulate(totals.begin(), totals.end(), 0L));
+  for (long total : totals) EXPECT_GT(total, 0);
+}
+
+TEST(ParallelRun, RethrowsExceptions) {
+  ThreadPool pool(2);
+  vector<int> xs(100);
+  EXPECT_THROW(ParallelRun(&pool, SplittableRange(xs), [](size_t part) {
+    return Consumer<const int&>([part](int) {
+      if (part == 1) throw std::runtime_error("part 1");
+    });
+  }), std::runtime_error);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
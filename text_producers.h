@@ -0,0 +1,219 @@
+// Producers that read text from files.  -*- c++ -*-
+//
+// Files are memory mapped rather than read, and the producers yield
+// std::string_views into the mapping, so producing a line costs no
+// allocation and no copying. A view is valid only while the consumer
+// it was passed to is running; consumers that want to keep the text
+// must copy it.
+//
+// Text that does not come straight from a file, such as the output
+// of Decompress, arrives as a producer of chunks. SplitLines turns
+// such a producer into a producer of lines.
+
+#ifndef TEXT_PRODUCERS_H_
+#define TEXT_PRODUCERS_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "consumers_and_producers.h"
+
+// A read-only memory mapping of a whole file.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path) : data_(nullptr), size_(0) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("cannot open " + path + ": " +
+                               std::strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      int error = errno;
+      ::close(fd);
+      throw std::runtime_error("cannot stat " + path + ": " +
+                               std::strerror(error));
+    }
+    if (st.st_size > 0) {
+      size_ = static_cast<size_t>(st.st_size);
+      void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        int error = errno;
+        ::close(fd);
+        throw std::runtime_error("cannot map " + path + ": " +
+                                 std::strerror(error));
+      }
+      data_ = static_cast<const char*>(data);
+      ::madvise(data, size_, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+  }
+  ~MappedFile() {
+    if (data_) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  std::string_view view() const { return std::string_view(data_, size_); }
+
+private:
+  const char* data_;
+  size_t size_;
+};
+
+// Returns a pointer to the first occurrence of byte in [p, end), or
+// end if there is none. Scans 32 or 16 bytes at a time when the
+// target supports AVX2 or SSE2.
+inline const char* _FindByte(const char* p, const char* end, char byte) {
+#if defined(__AVX2__)
+  const __m256i needle32 = _mm256_set1_epi8(byte);
+  for (; end - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    unsigned mask = static_cast<unsigned>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle32)));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i needle16 = _mm_set1_epi8(byte);
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    unsigned mask = static_cast<unsigned>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16)));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p == byte) {
+      return p;
+    }
+  }
+  return end;
+}
+
+// Returns a pointer to the first occurrence of either byte a or byte b
+// in [p, end), or end if there is none. Vectorized like _FindByte.
+inline const char* _FindEither(const char* p, const char* end,
+                               char a, char b) {
+#if defined(__AVX2__)
+  const __m256i a32 = _mm256_set1_epi8(a);
+  const __m256i b32 = _mm256_set1_epi8(b);
+  for (; end - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, a32),
+                        _mm256_cmpeq_epi8(chunk, b32))));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i a16 = _mm_set1_epi8(a);
+  const __m128i b16 = _mm_set1_epi8(b);
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, a16),
+                     _mm_cmpeq_epi8(chunk, b16))));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p == a || *p == b) {
+      return p;
+    }
+  }
+  return end;
+}
+
+// Produces the lines of a text file, without their newlines. A final
+// line that lacks a newline is produced too. The file is mapped anew
+// each time the producer runs; if it cannot be, std::runtime_error
+// is thrown.
+inline Producer<std::string_view> ReadLines(const std::string& path) {
+  return [=](const Consumer<std::string_view>& c) {
+    MappedFile file(path);
+    const char* p = file.data();
+    const char* end = p + file.size();
+    while (p < end) {
+      const char* newline = _FindByte(p, end, '\n');
+      c(std::string_view(p, newline - p));
+      p = newline + 1;
+    }
+  };
+}
+
+// Produces the contents of a file in chunks of up to chunk_size bytes.
+inline Producer<std::string_view> ReadChunks(const std::string& path,
+                                             size_t chunk_size = 1 << 20) {
+  return [=](const Consumer<std::string_view>& c) {
+    MappedFile file(path);
+    for (size_t offset = 0; offset < file.size(); offset += chunk_size) {
+      c(file.view().substr(offset, chunk_size));
+    }
+  };
+}
+
+// Splits a producer of chunks of text into a producer of lines, like
+// ReadLines does for files. Lines that lie within a chunk are produced
+// without copying; only lines that straddle chunks are copied.
+inline Producer<std::string_view> SplitLines(
+    const Producer<std::string_view>& chunks) {
+  return [=](const Consumer<std::string_view>& c) {
+    std::string carry;  // The start of a line that straddles chunks.
+    bool carrying = false;
+    chunks([&](std::string_view chunk) {
+      const char* p = chunk.data();
+      const char* end = p + chunk.size();
+      while (p < end) {
+        const char* newline = _FindByte(p, end, '\n');
+        if (newline == end) {
+          if (!carrying) {
+            carry.clear();
+            carrying = true;
+          }
+          carry.append(p, end);
+          return;
+        }
+        if (carrying) {
+          carry.append(p, newline);
+          carrying = false;
+          c(carry);
+        } else {
+          c(std::string_view(p, newline - p));
+        }
+        p = newline + 1;
+      }
+    });
+    if (carrying) {
+      c(carry);
+    }
+  };
+}
+
+#endif  // TEXT_PRODUCERS_H_
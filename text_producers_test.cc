@@ -0,0 +1,74 @@
+// Tests for producers that read text from files.
+
+#include "text_producers.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Writes contents to a fresh temporary file and returns its path.
+string TempFile(const string& contents) {
+  static int n = 0;
+  string path = ::testing::TempDir() + "text_producers_test." +
+      std::to_string(::getpid()) + "." + std::to_string(n++);
+  std::FILE* f = std::fopen(path.c_str(), "wb");
+  std::fwrite(contents.data(), 1, contents.size(), f);
+  std::fclose(f);
+  return path;
+}
+
+vector<string> Lines(const string& contents) {
+  string path = TempFile(contents);
+  vector<string> lines;
+  ReadLines(path)([&](std::string_view line) {
+    lines.emplace_back(line);
+  });
+  std::remove(path.c_str());
+  return lines;
+}
+
+}  // namespace
+
+TEST(ReadLines, SplitsOnNewlines) {
+  EXPECT_EQ(vector<string>({}), Lines(""));
+  EXPECT_EQ(vector<string>({""}), Lines("\n"));
+  EXPECT_EQ(vector<string>({"a"}), Lines("a"));
+  EXPECT_EQ(vector<string>({"a"}), Lines("a\n"));
+  EXPECT_EQ(vector<string>({"a", "", "b"}), Lines("a\n\nb"));
+  EXPECT_EQ(vector<string>({"a\r", "b\r"}), Lines("a\r\nb\r\n"));
+}
+
+TEST(ReadLines, FindsNewlinesAtEveryOffset) {
+  // Exercise the vectorized scanner on lines of every length across
+  // a few vector widths, with newlines at every possible offset.
+  string contents;
+  vector<string> expected;
+  for (int len = 0; len < 100; ++len) {
+    expected.emplace_back(len, static_cast<char>('a' + len % 26));
+    contents += expected.back() + "\n";
+  }
+  EXPECT_EQ(expected, Lines(contents));
+}
+
+TEST(ReadLines, ThrowsOnMissingFiles) {
+  auto lines = ReadLines(::testing::TempDir() + "no/such/file");
+  EXPECT_THROW(lines([](std::string_view) {}), std::runtime_error);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,587 @@
+// A NUMA-aware, work-stealing thread pool.  -*- c++ -*-
+//
+// ThreadPool runs tasks on a fixed set of worker threads, grouped by
+// the NUMA node they are pinned to. A task submitted by a worker goes
+// onto that worker's own queue; idle workers steal from the other
+// workers on their node first, and from other nodes only when their
+// own node has run dry, so that tasks tend to stay near the memory
+// they touch.
+//
+// Linux allocates pages on the node of the thread that first writes
+// them, so buffers that are allocated and filled by pinned workers are
+// node-local without any further effort. NodeLocal<T> uses this to
+// keep one instance of some per-stage state on each node.
+//
+// TaskGroup and ParallelFor build blocking fork-join parallelism on
+// top of the pool; exceptions thrown by tasks are rethrown by Wait.
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// The CPUs of each NUMA node.
+struct NumaTopology {
+  std::vector<std::vector<int>> nodes;
+
+  // Reads the topology from sysfs, keeping only the CPUs this process
+  // may run on. Machines without NUMA information get a single node.
+  static NumaTopology Detect() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_allowed =
+        sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    auto usable = [&](int cpu) {
+      return !have_allowed || CPU_ISSET(cpu, &allowed);
+    };
+    NumaTopology topology;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string nodes;
+    if (online && std::getline(online, nodes)) {
+      for (int node : ParseCpuList(nodes)) {
+        std::ifstream in("/sys/devices/system/node/node" +
+                         std::to_string(node) + "/cpulist");
+        std::string list;
+        std::vector<int> cpus;
+        if (in && std::getline(in, list)) {
+          for (int cpu : ParseCpuList(list)) {
+            if (usable(cpu)) {
+              cpus.push_back(cpu);
+            }
+          }
+        }
+        if (!cpus.empty()) {
+          topology.nodes.push_back(cpus);
+        }
+      }
+    }
+    if (topology.nodes.empty()) {
+      std::vector<int> cpus;
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (have_allowed && CPU_ISSET(cpu, &allowed)) {
+          cpus.push_back(cpu);
+        }
+      }
+      if (cpus.empty()) {
+        unsigned n = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned cpu = 0; cpu < n; ++cpu) {
+          cpus.push_back(static_cast<int>(cpu));
+        }
+      }
+      topology.nodes.push_back(cpus);
+    }
+    return topology;
+  }
+
+  // Parses a list of CPUs or nodes like "0-3,8,10-11".
+  static std::vector<int> ParseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+      if (range.empty()) {
+        continue;
+      }
+      size_t dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ?
+          first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    }
+    return cpus;
+  }
+
+  size_t cpus() const {
+    size_t n = 0;
+    for (const auto& node : nodes) {
+      n += node.size();
+    }
+    return n;
+  }
+};
+
+class ThreadPool {
+public:
+  typedef std::function<void()> Task;
+
+  // Starts the given number of workers, or one per CPU if zero. The
+  // workers are spread over the nodes in proportion to their CPUs and,
+  // if pin is true, each is pinned to one CPU of its node.
+  explicit ThreadPool(size_t threads = 0, bool pin = true,
+                      NumaTopology topology = NumaTopology::Detect())
+      : topology_(std::move(topology)), stop_(false), pending_(0),
+        next_worker_(0), local_steals_(0), remote_steals_(0) {
+    if (topology_.nodes.empty()) {
+      throw std::invalid_argument("a topology needs at least one node");
+    }
+    if (threads == 0) {
+      threads = topology_.cpus();
+    }
+    nodes_.reserve(topology_.nodes.size());
+    for (size_t n = 0; n < topology_.nodes.size(); ++n) {
+      nodes_.emplace_back(new Node);
+    }
+    // Deal the workers out to the nodes in proportion to their CPUs.
+    const size_t cpus = topology_.cpus();
+    for (size_t w = 0; w < threads; ++w) {
+      size_t slot = w * cpus / threads, node = 0;
+      while (slot >= topology_.nodes[node].size()) {
+        slot -= topology_.nodes[node].size();
+        ++node;
+      }
+      workers_.emplace_back(new Worker);
+      workers_.back()->pool = this;
+      workers_.back()->index = w;
+      workers_.back()->node = static_cast<int>(node);
+      workers_.back()->cpu = topology_.nodes[node][slot];
+      nodes_[node]->workers.push_back(w);
+    }
+    for (size_t w = 0; w < threads; ++w) {
+      workers_[w]->thread = std::thread([this, w, pin] { Work(w, pin); });
+    }
+  }
+
+  // Finishes the tasks already submitted, then stops the workers.
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mu_);
+      stop_ = true;
+    }
+    for (auto& node : nodes_) {
+      node->wake.notify_all();
+    }
+    for (auto& worker : workers_) {
+      worker->thread.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Submits a task, which must not throw. From a worker, the task goes
+  // onto the worker's own queue; from elsewhere, the nodes take turns in
+  // proportion to their workers.
+  void Submit(Task task) {
+    Worker* self = CurrentWorker();
+    int node;
+    if (self && self->pool == this) {
+      node = self->node;
+      std::lock_guard<std::mutex> lock(self->mu);
+      self->tasks.push_back(std::move(task));
+    } else {
+      node = workers_[next_worker_++ % workers_.size()]->node;
+      std::lock_guard<std::mutex> lock(nodes_[node]->mu);
+      nodes_[node]->shared.push_back(std::move(task));
+    }
+    Notify(node);
+  }
+
+  // Submits a task to run on a worker of the given node. If strict,
+  // no other node may steal it, and the node must have workers.
+  void SubmitToNode(int node, Task task, bool strict = false) {
+    Node& n = *nodes_.at(static_cast<size_t>(node));
+    if (n.workers.empty()) {
+      if (strict) {
+        throw std::invalid_argument("node " + std::to_string(node) +
+                                    " has no workers");
+      }
+      Submit(std::move(task));
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(n.mu);
+      (strict ? n.pinned : n.shared).push_back(std::move(task));
+    }
+    Notify(node, strict);
+  }
+
+  // Runs one waiting task on the calling thread, if it is a worker of
+  // this pool and there is a task it may take. Returns whether it did.
+  // Lets workers that wait for other tasks help instead of blocking.
+  // Other threads never run tasks, since they are not on any node.
+  bool RunPendingTask() {
+    Worker* self = CurrentWorker();
+    Task task;
+    if (!self || self->pool != this || !Take(self->index, &task)) {
+      return false;
+    }
+    task();
+    return true;
+  }
+
+  size_t size() const { return workers_.size(); }
+  size_t nodes() const { return nodes_.size(); }
+  size_t workers_on(int node) const { return nodes_[node]->workers.size(); }
+  const NumaTopology& topology() const { return topology_; }
+
+  // The node of a worker, and the CPU it is (or would be) pinned to.
+  int node_of(size_t worker) const { return workers_[worker]->node; }
+  int cpu_of(size_t worker) const { return workers_[worker]->cpu; }
+
+  // Which worker, and which node, the calling thread is, or -1 if it
+  // is not a worker of any pool.
+  static int CurrentWorkerIndex() {
+    Worker* self = CurrentWorker();
+    return self ? static_cast<int>(self->index) : -1;
+  }
+  static int CurrentNode() {
+    Worker* self = CurrentWorker();
+    return self ? self->node : -1;
+  }
+
+  // How many tasks were stolen from other workers on the same node,
+  // and from other nodes.
+  size_t local_steals() const { return local_steals_; }
+  size_t remote_steals() const { return remote_steals_; }
+
+private:
+  struct Worker {
+    ThreadPool* pool = nullptr;
+    size_t index = 0;
+    int node = 0;
+    int cpu = 0;
+    std::mutex mu;
+    std::deque<Task> tasks;
+    std::thread thread;
+  };
+
+  struct Node {
+    std::mutex mu;
+    std::deque<Task> pinned;  // Tasks only this node may run.
+    std::deque<Task> shared;  // Tasks submitted to the node as a whole.
+    std::vector<size_t> workers;
+    // Tasks queued on the node or its workers but not yet taken.
+    std::atomic<size_t> pending{0};
+    // Workers running a task taken from their queues.
+    std::atomic<size_t> active{0};
+    // Guarded by sleep_mu_: the workers waiting on wake, and how many
+    // of them have been signalled but have not yet woken.
+    std::condition_variable wake;
+    size_t sleeping = 0;
+    size_t wakeups = 0;
+  };
+
+  static Worker*& CurrentWorker() {
+    static thread_local Worker* current = nullptr;
+    return current;
+  }
+
+  // Wakes a worker for a new task on the given node: one of the node's
+  // own, if it has an idle one, and otherwise, unless the task is
+  // strict, an idle worker of another node, which will steal it.
+  void Notify(int node, bool strict = false) {
+    std::lock_guard<std::mutex> lock(sleep_mu_);
+    ++pending_;
+    Node& n = *nodes_[node];
+    ++n.pending;
+    if (Wake(&n)) {
+      return;
+    }
+    if (strict || !Overloaded(n)) {
+      // The node's idle workers are awake, and will find the task
+      // before they sleep.
+      return;
+    }
+    for (size_t i = 1; i < nodes_.size(); ++i) {
+      if (Wake(nodes_[(node + i) % nodes_.size()].get())) {
+        return;
+      }
+    }
+  }
+
+  // Whether node n has more tasks queued than idle workers to run them.
+  static bool Overloaded(const Node& n) {
+    return n.pending + n.active > n.workers.size();
+  }
+
+  // Signals a sleeping worker of node n that has not been signalled
+  // yet, if there is one. Called with sleep_mu_ held.
+  static bool Wake(Node* n) {
+    if (n->sleeping == n->wakeups) {
+      return false;
+    }
+    ++n->wakeups;
+    n->wake.notify_one();
+    return true;
+  }
+
+  static bool PopFront(std::mutex* mu, std::deque<Task>* tasks, Task* task) {
+    std::lock_guard<std::mutex> lock(*mu);
+    if (tasks->empty()) {
+      return false;
+    }
+    *task = std::move(tasks->front());
+    tasks->pop_front();
+    return true;
+  }
+
+  bool Taken(Node* from) {
+    --from->pending;
+    --pending_;
+    return true;
+  }
+
+  // Finds a task for worker w: its own newest task, then its node's
+  // tasks, then the oldest task of another worker on its node, and
+  // only then the tasks of other nodes that have more than their own
+  // workers can take.
+  bool Take(size_t w, Task* task) {
+    Worker& self = *workers_[w];
+    {
+      std::lock_guard<std::mutex> lock(self.mu);
+      if (!self.tasks.empty()) {
+        *task = std::move(self.tasks.back());
+        self.tasks.pop_back();
+        return Taken(nodes_[self.node].get());
+      }
+    }
+    Node& node = *nodes_[self.node];
+    if (PopFront(&node.mu, &node.pinned, task) ||
+        PopFront(&node.mu, &node.shared, task)) {
+      return Taken(&node);
+    }
+    const size_t local = node.workers.size();
+    for (size_t i = 1; i < local; ++i) {
+      Worker& victim = *workers_[node.workers[(Position(w) + i) % local]];
+      if (PopFront(&victim.mu, &victim.tasks, task)) {
+        ++local_steals_;
+        return Taken(&node);
+      }
+    }
+    for (size_t i = 1; i < nodes_.size(); ++i) {
+      Node& other = *nodes_[(self.node + i) % nodes_.size()];
+      if (!Overloaded(other)) {
+        continue;
+      }
+      bool found = PopFront(&other.mu, &other.shared, task);
+      for (size_t v = 0; !found && v < other.workers.size(); ++v) {
+        Worker& victim = *workers_[other.workers[v]];
+        found = PopFront(&victim.mu, &victim.tasks, task);
+      }
+      if (found) {
+        ++remote_steals_;
+        return Taken(&other);
+      }
+    }
+    return false;
+  }
+
+  // The position of worker w among its node's workers.
+  size_t Position(size_t w) const {
+    const auto& local = nodes_[workers_[w]->node]->workers;
+    return std::find(local.begin(), local.end(), w) - local.begin();
+  }
+
+  void Work(size_t w, bool pin) {
+    Worker& self = *workers_[w];
+    CurrentWorker() = &self;
+    if (pin) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(self.cpu, &cpus);
+      // Pinning is only a hint; carry on unpinned if it is refused.
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    Node& node = *nodes_[self.node];
+    Task task;
+    for (;;) {
+      if (Take(w, &task)) {
+        ++node.active;
+        task();
+        task = nullptr;
+        --node.active;
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mu_);
+      if (stop_ && pending_ == 0) {
+        return;
+      }
+      if (node.pending > 0) {
+        // A task of this node is being queued or taken; look again.
+        continue;
+      }
+      if (stop_) {
+        // Tasks remain that this worker may not take, e.g. pinned to
+        // another node. Back off briefly rather than spin.
+        node.wake.wait_for(lock, std::chrono::microseconds(100));
+        continue;
+      }
+      ++node.sleeping;
+      node.wake.wait(lock, [&] { return stop_ || node.wakeups > 0; });
+      if (node.wakeups > 0) {
+        --node.wakeups;
+      }
+      --node.sleeping;
+    }
+  }
+
+  NumaTopology topology_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::mutex sleep_mu_;
+  bool stop_;
+  std::atomic<size_t> pending_;  // Tasks submitted but not yet taken.
+  std::atomic<size_t> next_worker_;
+  std::atomic<size_t> local_steals_;
+  std::atomic<size_t> remote_steals_;
+};
+
+// A set of tasks to wait for together. The first exception thrown by
+// any of them is rethrown by Wait.
+class TaskGroup {
+public:
+  explicit TaskGroup(ThreadPool* pool) : pool_(pool), running_(0) {}
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+  ~TaskGroup() {
+    try {
+      Wait();
+    } catch (...) {
+    }
+  }
+
+  // Runs f on the pool, on the given node if node is non-negative.
+  void Run(std::function<void()> f, int node = -1, bool strict = false) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      ++running_;
+    }
+    ThreadPool::Task task = [this, f] {
+      try {
+        f();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+      }
+      std::lock_guard<std::mutex> lock(mu_);
+      if (--running_ == 0) {
+        done_.notify_all();
+      }
+    };
+    if (node < 0) {
+      pool_->Submit(std::move(task));
+    } else {
+      pool_->SubmitToNode(node, std::move(task), strict);
+    }
+  }
+
+  // Waits for all the tasks to finish. Workers of the pool help to run
+  // tasks meanwhile, so that nested groups cannot deadlock.
+  void Wait() {
+    const bool worker = ThreadPool::CurrentWorkerIndex() >= 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (!worker) {
+          done_.wait(lock, [this] { return running_ == 0; });
+        }
+        if (running_ == 0) {
+          break;
+        }
+      }
+      if (!pool_->RunPendingTask()) {
+        std::unique_lock<std::mutex> lock(mu_);
+        done_.wait_for(lock, std::chrono::microseconds(200),
+                       [this] { return running_ == 0; });
+      }
+    }
+    std::exception_ptr error;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      std::swap(error, error_);
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  ThreadPool* pool_;
+  std::mutex mu_;
+  std::condition_variable done_;
+  size_t running_;
+  std::exception_ptr error_;
+};
+
+// Calls f(i) for every i in [begin, end) on the pool, in contiguous
+// blocks of at least grain indices, and waits for all of them. The
+// blocks are striped contiguously over the nodes: block k of b is
+// submitted to node k * nodes / b, so that each node gets one run of
+// neighbouring indices, and whatever data they touch first.
+template <typename F>
+void ParallelFor(ThreadPool* pool, size_t begin, size_t end, const F& f,
+                 size_t grain = 1) {
+  if (begin >= end) {
+    return;
+  }
+  const size_t n = end - begin;
+  const size_t blocks = std::max<size_t>(
+      1, std::min(n / std::max<size_t>(grain, 1), 4 * pool->size()));
+  TaskGroup group(pool);
+  for (size_t k = 0; k < blocks; ++k) {
+    size_t first = begin + n * k / blocks, last = begin + n * (k + 1) / blocks;
+    group.Run([&f, first, last] {
+      for (size_t i = first; i < last; ++i) {
+        f(i);
+      }
+    }, static_cast<int>(k * pool->nodes() / blocks));
+  }
+  group.Wait();
+}
+
+// One instance of T per node, each constructed (and so first touched)
+// by a worker on its node. Stage buffers and other per-stage state kept
+// in a NodeLocal are thus in memory local to the workers that use them.
+template <typename T>
+class NodeLocal {
+public:
+  template <typename... Args>
+  explicit NodeLocal(ThreadPool* pool, const Args&... args)
+      : values_(pool->nodes()) {
+    TaskGroup group(pool);
+    for (size_t n = 0; n < values_.size(); ++n) {
+      if (pool->workers_on(static_cast<int>(n)) == 0) {
+        values_[n].reset(new T(args...));  // No worker will touch it.
+        continue;
+      }
+      group.Run([this, n, &args...] { values_[n].reset(new T(args...)); },
+                static_cast<int>(n), true);
+    }
+    group.Wait();
+  }
+
+  // The instance for the calling worker's node, or node 0's for
+  // threads outside the pool.
+  T& Local() { return *values_[std::max(ThreadPool::CurrentNode(), 0)]; }
+
+  T& operator[](size_t node) { return *values_[node]; }
+  size_t size() const { return values_.size(); }
+
+private:
+  std::vector<std::unique_ptr<T>> values_;
+};
+
+#endif  // THREAD_POOL_H_
@@ -0,0 +1,198 @@
+// Tests for the NUMA-aware thread pool.
+
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using std::vector;
+
+namespace {
+
+// Two nodes whose CPUs are all CPU 0, which every machine has, so that
+// pinning works wherever the tests run.
+NumaTopology TwoNodes(size_t cpus_per_node) {
+  NumaTopology topology;
+  topology.nodes.assign(2, vector<int>(cpus_per_node, 0));
+  return topology;
+}
+
+}  // namespace
+
+TEST(NumaTopology, ParsesCpuLists) {
+  EXPECT_EQ((vector<int>{0, 1, 2, 3, 8, 10, 11}),
+            NumaTopology::ParseCpuList("0-3,8,10-11"));
+  EXPECT_EQ((vector<int>{5}), NumaTopology::ParseCpuList("5"));
+  EXPECT_EQ(vector<int>(), NumaTopology::ParseCpuList(""));
+}
+
+TEST(NumaTopology, DetectsAtLeastOneCpu) {
+  NumaTopology topology = NumaTopology::Detect();
+  ASSERT_FALSE(topology.nodes.empty());
+  EXPECT_GE(topology.cpus(), 1u);
+}
+
+TEST(ThreadPool, SpreadsWorkersOverNodes) {
+  ThreadPool pool(4, true, TwoNodes(2));
+  EXPECT_EQ(4u, pool.size());
+  EXPECT_EQ(2u, pool.nodes());
+  EXPECT_EQ(0, pool.node_of(0));
+  EXPECT_EQ(0, pool.node_of(1));
+  EXPECT_EQ(1, pool.node_of(2));
+  EXPECT_EQ(1, pool.node_of(3));
+  EXPECT_EQ(2u, pool.workers_on(0));
+  EXPECT_EQ(2u, pool.workers_on(1));
+}
+
+TEST(ThreadPool, RunsEverySubmittedTask) {
+  std::atomic<int> sum(0);
+  {
+    ThreadPool pool(3);
+    for (int i = 1; i <= 1000; ++i) {
+      pool.Submit([&sum, i] { sum += i; });
+    }
+  }  // The destructor finishes the tasks.
+  EXPECT_EQ(500500, sum);
+}
+
+TEST(ThreadPool, RunsStrictTasksOnTheirNode) {
+  ThreadPool pool(4, true, TwoNodes(2));
+  TaskGroup group(&pool);
+  std::mutex mu;
+  std::set<int> nodes[2];
+  for (int i = 0; i < 200; ++i) {
+    int node = i % 2;
+    group.Run([&, node] {
+      std::lock_guard<std::mutex> lock(mu);
+      nodes[node].insert(ThreadPool::CurrentNode());
+    }, node, true);
+  }
+  group.Wait();
+  EXPECT_EQ(std::set<int>{0}, nodes[0]);
+  EXPECT_EQ(std::set<int>{1}, nodes[1]);
+  EXPECT_EQ(-1, ThreadPool::CurrentNode());
+}
+
+TEST(ThreadPool, StealsAcrossNodesOnlyWhenNeeded) {
+  ThreadPool pool(4, true, TwoNodes(2));
+  // All the work is on node 0, so node 1 has to steal some of it.
+  TaskGroup group(&pool);
+  std::atomic<int> on_node[2] = {{0}, {0}};
+  for (int i = 0; i < 64; ++i) {
+    group.Run([&] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ++on_node[ThreadPool::CurrentNode()];
+    }, 0);
+  }
+  group.Wait();
+  EXPECT_EQ(64, on_node[0] + on_node[1]);
+  EXPECT_GT(pool.remote_steals(), 0u);
+}
+
+TEST(ThreadPool, KeepsTasksOnTheirNodeWhileItHasIdleWorkers) {
+  ThreadPool pool(2, true, TwoNodes(1));
+  // Each task finds the pool idle, so node 0's worker is free for it.
+  for (int i = 0; i < 200; ++i) {
+    std::atomic<int> node(-1);
+    pool.SubmitToNode(0, [&node] { node = ThreadPool::CurrentNode(); });
+    while (node < 0) {
+      std::this_thread::yield();
+    }
+    ASSERT_EQ(0, node);
+    // Let the worker go back to sleep.
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+  EXPECT_EQ(0u, pool.remote_steals());
+}
+
+TEST(ThreadPool, StealsFromWorkersOnTheSameNode) {
+  ThreadPool pool(2, true, NumaTopology{{{0, 0}}});
+  // Tasks submitted by a worker go onto its own queue, from which its
+  // idle neighbour has to steal them.
+  TaskGroup outer(&pool);
+  outer.Run([&] {
+    TaskGroup inner(&pool);
+    for (int i = 0; i < 16; ++i) {
+      inner.Run([] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      });
+    }
+    inner.Wait();
+  });
+  outer.Wait();
+  EXPECT_GT(pool.local_steals(), 0u);
+  EXPECT_EQ(0u, pool.remote_steals());
+}
+
+TEST(TaskGroup, RethrowsTheFirstException) {
+  ThreadPool pool(2);
+  TaskGroup group(&pool);
+  std::atomic<int> ran(0);
+  for (int i = 0; i < 10; ++i) {
+    group.Run([&ran, i] {
+      ++ran;
+      if (i == 3) throw std::runtime_error("task failed");
+    });
+  }
+  EXPECT_THROW(group.Wait(), std::runtime_error);
+  EXPECT_EQ(10, ran);
+  group.Wait();  // The exception is reported only once.
+}
+
+TEST(ParallelFor, VisitsEveryIndexOnce) {
+  ThreadPool pool(4, true, TwoNodes(2));
+  vector<std::atomic<int>> visits(10000);
+  ParallelFor(&pool, 0, visits.size(), [&](size_t i) { ++visits[i]; }, 16);
+  for (const auto& v : visits) {
+    ASSERT_EQ(1, v);
+  }
+  ParallelFor(&pool, 5, 5, [&](size_t) { FAIL(); });
+}
+
+TEST(ParallelFor, NestsWithoutDeadlocking) {
+  ThreadPool pool(2);
+  std::atomic<int> n(0);
+  ParallelFor(&pool, 0, 8, [&](size_t) {
+    ParallelFor(&pool, 0, 8, [&](size_t) { ++n; });
+  });
+  EXPECT_EQ(64, n);
+}
+
+TEST(NodeLocal, ConstructsOneInstancePerNodeOnThatNode) {
+  ThreadPool pool(4, true, TwoNodes(2));
+  struct State {
+    explicit State(int size) : node(ThreadPool::CurrentNode()),
+                               buffer(size) {}
+    int node;
+    vector<char> buffer;
+  };
+  NodeLocal<State> states(&pool, 1 << 16);
+  ASSERT_EQ(2u, states.size());
+  EXPECT_EQ(0, states[0].node);
+  EXPECT_EQ(1, states[1].node);
+  EXPECT_EQ(size_t(1 << 16), states[1].buffer.size());
+
+  TaskGroup group(&pool);
+  std::atomic<int> mismatches(0);
+  for (int i = 0; i < 100; ++i) {
+    group.Run([&] {
+      mismatches += states.Local().node != ThreadPool::CurrentNode();
+    });
+  }
+  group.Wait();
+  EXPECT_EQ(0, mismatches);
+  EXPECT_EQ(0, states.Local().node);  // Outside the pool, node 0's.
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
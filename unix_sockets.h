@@ -0,0 +1,352 @@
+// Streaming values over Unix-domain sockets.  -*- c++ -*-
+//
+// SocketSink<T> and SocketSource<T> carry a stream of values from one
+// process to another over a Unix-domain socket, which lets one logical
+// pipeline be spread across several worker processes on a host, and
+// stands in for a network connection in tests of distributed
+// pipelines. Values are serialized with SpillCodec<T>:
+//
+//   // Worker:
+//   UnixSocket socket = UnixSocket::Connect("/run/pipeline/collector");
+//   SocketSink<Record> sink(&socket);
+//   (shard * parse)(input)(sink.consumer());
+//   sink.Close();
+//
+//   // Collector:
+//   UnixSocket listener = UnixSocket::Listen("/run/pipeline/collector");
+//   UnixSocket socket = listener.Accept();
+//   SocketSource<Record>(&socket)(store);
+//
+// The sink gathers values into batches and sends each batch with one
+// vectored write: a header, the lengths of the values, and the values
+// themselves. The source grants the sink credit for a window of
+// batches, and grants more, in one acknowledgement for half a window
+// at a time, as it consumes them, so that a slow consumer holds back
+// its producer rather than letting batches pile up in the socket.
+
+#ifndef UNIX_SOCKETS_H_
+#define UNIX_SOCKETS_H_
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "spill.h"
+
+class UnixSocket {
+public:
+  UnixSocket() : fd_(-1) {}
+  explicit UnixSocket(int fd) : fd_(fd) {}
+  ~UnixSocket() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+  UnixSocket(UnixSocket&& other) : fd_(other.fd_) { other.fd_ = -1; }
+  UnixSocket& operator=(UnixSocket&& other) {
+    std::swap(fd_, other.fd_);
+    return *this;
+  }
+  UnixSocket(const UnixSocket&) = delete;
+  UnixSocket& operator=(const UnixSocket&) = delete;
+
+  // Listens on path, replacing any socket already there.
+  static UnixSocket Listen(const std::string& path, int backlog = 16) {
+    UnixSocket socket = Stream();
+    sockaddr_un address = Address(path);
+    ::unlink(path.c_str());
+    if (::bind(socket.fd_, reinterpret_cast<sockaddr*>(&address),
+               sizeof(address)) != 0 ||
+        ::listen(socket.fd_, backlog) != 0) {
+      throw Error("cannot listen on " + path);
+    }
+    return socket;
+  }
+
+  static UnixSocket Connect(const std::string& path) {
+    UnixSocket socket = Stream();
+    sockaddr_un address = Address(path);
+    if (::connect(socket.fd_, reinterpret_cast<sockaddr*>(&address),
+                  sizeof(address)) != 0) {
+      throw Error("cannot connect to " + path);
+    }
+    return socket;
+  }
+
+  // A connected pair of sockets, as for a parent and a forked child.
+  static std::pair<UnixSocket, UnixSocket> Pair() {
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+      throw Error("cannot create socket pair");
+    }
+    return { UnixSocket(fds[0]), UnixSocket(fds[1]) };
+  }
+
+  UnixSocket Accept() const {
+    int fd;
+    do {
+      fd = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+      throw Error("cannot accept");
+    }
+    return UnixSocket(fd);
+  }
+
+  int fd() const { return fd_; }
+
+  // Sends all of the buffers, retrying short writes.
+  void Send(iovec* iov, int iovcnt) const {
+    msghdr message = {};
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt;
+    while (message.msg_iovlen > 0) {
+      ssize_t n = ::sendmsg(fd_, &message, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        throw Error("cannot send");
+      }
+      // Skip what was sent.
+      while (message.msg_iovlen > 0 &&
+             static_cast<size_t>(n) >= message.msg_iov->iov_len) {
+        n -= message.msg_iov->iov_len;
+        ++message.msg_iov;
+        --message.msg_iovlen;
+      }
+      if (message.msg_iovlen > 0) {
+        message.msg_iov->iov_base =
+            static_cast<char*>(message.msg_iov->iov_base) + n;
+        message.msg_iov->iov_len -= n;
+      }
+    }
+  }
+
+  // Receives exactly n bytes. Returns false if the peer closed the
+  // socket before any of them arrived.
+  bool Receive(void* buf, size_t n) const {
+    char* p = static_cast<char*>(buf);
+    size_t received = 0;
+    while (received < n) {
+      ssize_t r = ::recv(fd_, p + received, n - received, 0);
+      if (r < 0) {
+        if (errno == EINTR) continue;
+        throw Error("cannot receive");
+      }
+      if (r == 0) {
+        if (received == 0) {
+          return false;
+        }
+        throw std::runtime_error("connection closed mid-message");
+      }
+      received += static_cast<size_t>(r);
+    }
+    return true;
+  }
+
+  // Tells the peer that nothing more will be sent.
+  void ShutdownWrite() const { ::shutdown(fd_, SHUT_WR); }
+
+private:
+  static std::runtime_error Error(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+  }
+
+  static UnixSocket Stream() {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throw Error("cannot create socket");
+    }
+    return UnixSocket(fd);
+  }
+
+  static sockaddr_un Address(const std::string& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+      throw std::runtime_error("socket path too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+    return address;
+  }
+
+  int fd_;
+};
+
+// Each batch starts with a header giving the number of values and the
+// sizes of the two parts that follow: the varint lengths of the
+// values, then the values.
+struct _SocketBatchHeader {
+  uint32_t count;
+  uint32_t lengths_bytes;
+  uint32_t values_bytes;
+};
+
+// Sends values to a SocketSource. Values are gathered into a batch,
+// which is sent when it reaches batch_bytes, and by Flush and Close.
+// Sending waits for credit from the source.
+template <typename T>
+class SocketSink {
+public:
+  explicit SocketSink(const UnixSocket* socket, size_t batch_bytes = 64 << 10)
+      : socket_(socket), batch_bytes_(batch_bytes), count_(0),
+        credits_(0), buffer_(nullptr), size_(0),
+        file_(::open_memstream(&buffer_, &size_)) {
+    if (!file_) {
+      throw std::runtime_error("cannot create batch");
+    }
+  }
+  ~SocketSink() {
+    if (file_) {
+      try {
+        Close();
+      } catch (...) {
+      }
+    }
+    std::free(buffer_);
+  }
+  SocketSink(const SocketSink&) = delete;
+  SocketSink& operator=(const SocketSink&) = delete;
+
+  // Adds x to the batch.
+  void operator()(const T& x) {
+    long start = std::ftell(file_);
+    SpillCodec<T>::Write(file_, x);
+    long end = std::ftell(file_);
+    for (uint64_t v = end - start; ; v >>= 7) {
+      lengths_ += static_cast<char>((v & 0x7f) | (v >= 0x80 ? 0x80 : 0));
+      if (v < 0x80) break;
+    }
+    ++count_;
+    if (static_cast<size_t>(end) >= batch_bytes_) {
+      Flush();
+    }
+  }
+
+  // A consumer that adds to the batch. The sink must outlive it.
+  Consumer<T> consumer() {
+    return [this](const T& x) { (*this)(x); };
+  }
+
+  // Sends the batch, first waiting for credit if there is none.
+  void Flush() {
+    if (count_ == 0) {
+      return;
+    }
+    while (credits_ == 0) {
+      uint32_t grant;
+      if (!socket_->Receive(&grant, sizeof(grant))) {
+        throw std::runtime_error("source closed the connection");
+      }
+      credits_ += grant;
+    }
+    std::fflush(file_);
+    _SocketBatchHeader header = {
+      count_, static_cast<uint32_t>(lengths_.size()),
+      static_cast<uint32_t>(size_) };
+    iovec iov[3] = {
+      { &header, sizeof(header) },
+      { &lengths_[0], lengths_.size() },
+      { buffer_, size_ } };
+    socket_->Send(iov, 3);
+    --credits_;
+    std::rewind(file_);
+    lengths_.clear();
+    count_ = 0;
+  }
+
+  // Sends the batch, and tells the source that there are no more.
+  void Close() {
+    try {
+      Flush();
+    } catch (...) {
+      Finish();
+      throw;
+    }
+    Finish();
+  }
+
+private:
+  void Finish() {
+    std::fclose(file_);
+    file_ = nullptr;
+    socket_->ShutdownWrite();
+  }
+
+  const UnixSocket* const socket_;
+  const size_t batch_bytes_;
+  std::string lengths_;
+  uint32_t count_;
+  uint32_t credits_;
+  char* buffer_;
+  size_t size_;
+  std::FILE* file_;
+};
+
+// Produces the values a SocketSink sends, until the sink closes. The
+// source grants the sink credit for window batches at a time. The
+// socket must outlive the producer.
+template <typename T>
+Producer<T> SocketSource(const UnixSocket* socket, uint32_t window = 8) {
+  window = std::max<uint32_t>(window, 1);
+  return [=](const Consumer<T>& c) {
+    const uint32_t ack_every = std::max<uint32_t>(window / 2, 1);
+    // Grants are best effort: a sink that has gone away needs none.
+    auto grant = [socket](uint32_t n) {
+      ::send(socket->fd(), &n, sizeof(n), MSG_NOSIGNAL);
+    };
+    grant(window);
+    std::string lengths, values;
+    uint32_t consumed = 0;
+    T x;
+    _SocketBatchHeader header;
+    while (socket->Receive(&header, sizeof(header))) {
+      lengths.resize(header.lengths_bytes);
+      values.resize(header.values_bytes);
+      if (!socket->Receive(&lengths[0], lengths.size()) ||
+          !socket->Receive(&values[0], values.size())) {
+        throw std::runtime_error("connection closed mid-batch");
+      }
+      std::unique_ptr<std::FILE, int (*)(std::FILE*)> f(
+          ::fmemopen(&values[0], values.size(), "r"), std::fclose);
+      if (!f) {
+        throw std::runtime_error("cannot read batch");
+      }
+      size_t l = 0;
+      uint64_t end = 0;
+      for (uint32_t i = 0; i < header.count; ++i) {
+        uint64_t length = 0;
+        for (int shift = 0; l < lengths.size(); shift += 7) {
+          unsigned char byte = lengths[l++];
+          length |= static_cast<uint64_t>(byte & 0x7f) << shift;
+          if (!(byte & 0x80)) break;
+        }
+        end += length;
+        if (!SpillCodec<T>::Read(f.get(), &x) ||
+            static_cast<uint64_t>(std::ftell(f.get())) != end) {
+          throw std::runtime_error("corrupt batch");
+        }
+        c(x);
+      }
+      // Acknowledge consumed batches half a window at a time.
+      if (++consumed == ack_every) {
+        grant(consumed);
+        consumed = 0;
+      }
+    }
+  };
+}
+
+#endif  // UNIX_SOCKETS_H_
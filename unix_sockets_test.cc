@@ -0,0 +1,111 @@
+// Tests for streaming values over Unix-domain sockets.
+
+#include "unix_sockets.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+typedef std::tuple<string, int> Row;
+
+Row MakeRow(int i) { return Row(string(i % 50, 'r'), i); }
+
+void SendRows(const UnixSocket* socket, int n, size_t batch_bytes) {
+  SocketSink<Row> sink(socket, batch_bytes);
+  for (int i = 0; i < n; ++i) sink(MakeRow(i));
+  sink.Close();
+}
+
+}  // namespace
+
+TEST(UnixSockets, StreamsValuesBetweenProcesses) {
+  string path = "/tmp/unix_sockets_test." + std::to_string(getpid());
+  UnixSocket listener = UnixSocket::Listen(path);
+  pid_t child = fork();
+  if (child == 0) {
+    int status = 0;
+    try {
+      UnixSocket socket = UnixSocket::Connect(path);
+      SendRows(&socket, 10000, 1024);
+    } catch (...) {
+      status = 1;
+    }
+    _exit(status);
+  }
+  UnixSocket socket = listener.Accept();
+  vector<Row> rows;
+  SocketSource<Row>(&socket)([&](const Row& row) { rows.push_back(row); });
+  int status;
+  waitpid(child, &status, 0);
+  unlink(path.c_str());
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ASSERT_EQ(10000u, rows.size());
+  for (int i = 0; i < 10000; ++i) EXPECT_EQ(MakeRow(i), rows[i]);
+}
+
+TEST(UnixSockets, SinkWaitsForCredit) {
+  auto sockets = UnixSocket::Pair();
+  // Batches of one value, and a window of two.
+  std::atomic<int> sent{0};
+  std::thread sender([&] {
+    SocketSink<int> sink(&sockets.first, 1);
+    for (int i = 0; i < 100; ++i) {
+      sink(i);
+      ++sent;
+    }
+    sink.Close();
+  });
+  // Before the source runs, the sink has no credit to send anything.
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(0, sent.load());
+  vector<int> received;
+  int most_ahead = 0;
+  SocketSource<int>(&sockets.second, 2)([&](int x) {
+    received.push_back(x);
+    most_ahead = std::max(most_ahead, sent.load() - x);
+  });
+  sender.join();
+  EXPECT_EQ(100u, received.size());
+  // The sink never runs more than a window, and the batch it is
+  // waiting to send, ahead of the source.
+  EXPECT_LE(most_ahead, 3);
+}
+
+TEST(UnixSockets, SinkFailsWhenTheSourceGoesAway) {
+  auto sockets = UnixSocket::Pair();
+  std::thread sender([&] {
+    EXPECT_THROW(SendRows(&sockets.first, 1000000, 256), std::runtime_error);
+  });
+  int seen = 0;
+  try {
+    SocketSource<Row>(&sockets.second)([&](const Row&) {
+      if (++seen == 100) throw std::runtime_error("done");
+    });
+  } catch (const std::runtime_error&) {
+  }
+  sockets.second = UnixSocket();
+  sender.join();
+  EXPECT_EQ(100, seen);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
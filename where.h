@@ -0,0 +1,180 @@
+// Predicate stages, with adaptive ordering of conjunctions.  -*- c++ -*-
+//
+// Where(pred) is the filter that passes on the values that satisfy a
+// predicate and drops the rest. WhereAll(preds) passes on the values
+// that satisfy every one of several predicates. The order in which
+// the predicates of a conjunction are tried does not change which
+// values pass, but it can change the cost greatly: it is best to try
+// first the predicates that are cheap and that reject many values.
+// Since the best order depends on the data, WhereAll measures, as it
+// goes, how often each predicate passes and how long it takes, and
+// every so often reorders the predicates by their expected cost per
+// value rejected.
+//
+// For example:
+//
+//   auto audited = people * WhereAll<const Person&>({
+//       [](const Person& p) { return p.age() >= 18; },
+//       [](const Person& p) { return HasSuspiciousHistory(p); },
+//       [](const Person& p) { return p.email().empty(); }});
+//
+// A conjunction's statistics are shared by all copies of its filter.
+// They are not synchronized, so a conjunction should not be run from
+// several threads at once; give each thread its own.
+
+#ifndef WHERE_H_
+#define WHERE_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <numeric>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "consumers_and_producers.h"
+
+template <typename T>
+using Predicate = std::function<bool(const typename std::decay<T>::type&)>;
+
+template <typename T>
+Filter<T, T> Where(const Predicate<T>& pred) {
+  auto pred_node = _Share(pred);
+  return [=](T x) { return (*pred_node)(x) ? PUnit<T>(x) : PZero<T>(); };
+}
+
+// The streaming form of Where allocates nothing per value.
+template <typename T>
+StreamFilter<T, T> StreamWhere(const Predicate<T>& pred) {
+  auto pred_node = _Share(pred);
+  return [=](T x, ConsumerRef<T> c) {
+    if ((*pred_node)(x)) {
+      c(x);
+    }
+  };
+}
+
+// A conjunction of predicates that reorders itself as it learns which
+// of them are cheap and selective.
+template <typename T>
+class AdaptiveConjunction {
+public:
+  typedef typename std::decay<T>::type Value;
+
+  // Reorders the predicates after every period values. The costs of
+  // one in every sample_every evaluations are timed.
+  explicit AdaptiveConjunction(std::vector<Predicate<T>> preds,
+                               size_t period = 1024,
+                               size_t sample_every = 16)
+      : preds_(std::move(preds)), stats_(preds_.size()),
+        order_(preds_.size()), period_(std::max<size_t>(period, 1)),
+        sample_every_(std::max<size_t>(sample_every, 1)), seen_(0),
+        reorders_(0) {
+    std::iota(order_.begin(), order_.end(), 0);
+  }
+
+  // Whether x satisfies every predicate.
+  bool operator()(const Value& x) {
+    bool pass = true;
+    for (size_t i : order_) {
+      Stats& s = stats_[i];
+      bool result;
+      if (++s.evaluated % sample_every_ == 0) {
+        auto start = std::chrono::steady_clock::now();
+        result = preds_[i](x);
+        s.timed_nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        ++s.timed;
+      } else {
+        result = preds_[i](x);
+      }
+      if (!result) {
+        pass = false;
+        break;
+      }
+      ++s.passed;
+    }
+    if (++seen_ % period_ == 0) {
+      Reorder();
+    }
+    return pass;
+  }
+
+  // The order in which the predicates are currently tried, as indexes
+  // into the predicates the conjunction was made with.
+  const std::vector<size_t>& order() const { return order_; }
+
+  // How many times the predicates have been reordered.
+  size_t reorders() const { return reorders_; }
+
+private:
+  struct Stats {
+    uint64_t evaluated = 0;
+    uint64_t passed = 0;
+    uint64_t timed = 0;
+    uint64_t timed_nanos = 0;
+  };
+
+  // Sorts the predicates by their cost per value rejected, the order
+  // that minimizes the expected cost of a conjunction of independent
+  // predicates. The statistics are then halved, so that they follow
+  // changes in the data.
+  void Reorder() {
+    std::vector<double> rank(preds_.size());
+    for (size_t i = 0; i < preds_.size(); ++i) {
+      const Stats& s = stats_[i];
+      if (s.evaluated == 0) {
+        rank[i] = 0.0;  // Try predicates that have never run early.
+        continue;
+      }
+      double cost = s.timed ?
+          static_cast<double>(s.timed_nanos) / s.timed + 1.0 : 1.0;
+      double reject = 1.0 - static_cast<double>(s.passed) / s.evaluated;
+      rank[i] = cost / std::max(reject, 1e-6);
+    }
+    std::stable_sort(order_.begin(), order_.end(),
+                     [&](size_t a, size_t b) { return rank[a] < rank[b]; });
+    for (Stats& s : stats_) {
+      s.evaluated /= 2;
+      s.passed /= 2;
+      s.timed /= 2;
+      s.timed_nanos /= 2;
+    }
+    ++reorders_;
+  }
+
+  std::vector<Predicate<T>> preds_;
+  std::vector<Stats> stats_;
+  std::vector<size_t> order_;
+  const size_t period_;
+  const size_t sample_every_;
+  size_t seen_;
+  size_t reorders_;
+};
+
+template <typename T>
+Filter<T, T> Where(std::shared_ptr<AdaptiveConjunction<T>> conjunction) {
+  return [=](T x) { return (*conjunction)(x) ? PUnit<T>(x) : PZero<T>(); };
+}
+
+template <typename T>
+StreamFilter<T, T> StreamWhere(
+    std::shared_ptr<AdaptiveConjunction<T>> conjunction) {
+  return [=](T x, ConsumerRef<T> c) {
+    if ((*conjunction)(x)) {
+      c(x);
+    }
+  };
+}
+
+template <typename T>
+Filter<T, T> WhereAll(std::vector<Predicate<T>> preds, size_t period = 1024) {
+  return Where<T>(std::make_shared<AdaptiveConjunction<T>>(std::move(preds),
+                                                           period));
+}
+
+#endif  // WHERE_H_
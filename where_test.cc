@@ -0,0 +1,96 @@
+// Tests for predicate stages.
+
+#include "where.h"
+
+#include <memory>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::vector;
+
+namespace {
+
+Producer<int> Count(int n) {
+  return [=](const Consumer<int>& c) {
+    for (int i = 0; i < n; ++i) c(i);
+  };
+}
+
+vector<int> Collect(const Producer<int>& p) {
+  vector<int> xs;
+  p([&](int x) { xs.push_back(x); });
+  return xs;
+}
+
+// A predicate that passes everything, slowly.
+bool Slow(const int& x) {
+  volatile int sink = 0;
+  for (int i = 0; i < 2000; ++i) sink += i ^ x;
+  return true;
+}
+
+}  // namespace
+
+TEST(Where, PassesValuesThatSatisfyThePredicate) {
+  Predicate<int> even = [](const int& x) { return x % 2 == 0; };
+  EXPECT_EQ((vector<int>{0, 2, 4}), Collect(Count(6) | Where<int>(even)));
+  EXPECT_EQ((vector<int>{0, 2, 4}),
+            Collect(Count(6) | StreamWhere<int>(even)));
+}
+
+TEST(WhereAll, PassesValuesThatSatisfyEveryPredicate) {
+  vector<Predicate<int>> preds = {
+      [](const int& x) { return x % 2 == 0; },
+      [](const int& x) { return x % 3 == 0; },
+      [](const int& x) { return x > 10; }};
+  vector<int> expected;
+  for (int i = 0; i < 10000; ++i) {
+    if (i % 6 == 0 && i > 10) expected.push_back(i);
+  }
+  // Reordering, however often, never changes the result.
+  for (size_t period : {1u, 7u, 1024u}) {
+    EXPECT_EQ(expected, Collect(Count(10000) | WhereAll<int>(preds, period)));
+  }
+  EXPECT_EQ(Collect(Count(100)),
+            Collect(Count(100) | WhereAll<int>(vector<Predicate<int>>())));
+}
+
+TEST(AdaptiveConjunction, TriesCheapSelectivePredicatesFirst) {
+  int slow_calls = 0;
+  auto conjunction = std::make_shared<AdaptiveConjunction<int>>(
+      vector<Predicate<int>>{
+          [&](const int& x) { ++slow_calls; return Slow(x); },
+          [](const int& x) { return x % 10 == 0; }},
+      100, 1);
+  EXPECT_EQ((vector<size_t>{0, 1}), conjunction->order());
+  vector<int> passed = Collect(Count(1000) | StreamWhere<int>(conjunction));
+  EXPECT_EQ(100u, passed.size());
+  EXPECT_EQ((vector<size_t>{1, 0}), conjunction->order());
+  EXPECT_EQ(10u, conjunction->reorders());
+  // After the first reordering, the slow predicate only sees the tenth
+  // of the values that pass the cheap one.
+  EXPECT_LT(slow_calls, 100 + 100);
+}
+
+TEST(AdaptiveConjunction, FollowsChangesInTheData) {
+  bool first_phase = true;
+  auto conjunction = std::make_shared<AdaptiveConjunction<int>>(
+      vector<Predicate<int>>{
+          [&](const int& x) { return !first_phase || x % 10 == 0; },
+          [&](const int& x) { return first_phase || x % 10 == 0; }},
+      100, 1);
+  auto where = Where<int>(conjunction);
+  Collect(Count(1000) | where);
+  EXPECT_EQ(0u, conjunction->order()[0]);
+  first_phase = false;
+  Collect(Count(2000) | where);
+  EXPECT_EQ(1u, conjunction->order()[0]);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
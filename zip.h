@@ -0,0 +1,152 @@
+// Zipping producers together.  -*- c++ -*-
+//
+// Where PCross(p1, p2) pairs every value of p1 with every value of p2,
+// PZip(p1, p2) pairs them positionally: the first value of each, then
+// the second of each, and so on. For example, to pair a team's
+// managers with a parallel list of their reports' counts:
+//
+//   PZip(managers, report_counts)(
+//       [](const std::string& name, int reports) { ... });
+//
+// Producers push their values and cannot be paused, so all but the
+// first producer are run on threads of their own, a batch of values
+// at a time, and their values are buffered until the first producer
+// catches up. Zipped values are thus copied, and must stay valid after
+// the consumer they were passed to has returned (e.g., they must not
+// be string_views from a line producer).
+//
+// By default, zipping stops at the end of the shortest producer. With
+// ZipPolicy::kPad, it continues to the end of the longest, padding the
+// producers that have run out with value-initialized values.
+
+#ifndef ZIP_H_
+#define ZIP_H_
+
+#include <cstddef>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "consumers_and_producers.h"
+
+enum class ZipPolicy {
+  kShortest,  // Stop when any producer runs out.
+  kPad,       // Stop when all have; pad the others with T() meanwhile.
+};
+
+// One zipped producer, running on its own thread and feeding batches
+// of its values through a buffer.
+template <typename T>
+class _ZipSource {
+public:
+  _ZipSource(const Producer<T>& p, size_t batch_size)
+      : buffer_(4), index_(0), done_(false),
+        feeder_([this, p, batch_size] {
+          std::vector<T> batch;
+          batch.reserve(batch_size);
+          bool open = true;
+          p([&](const T& x) {
+            if (!open) {
+              return;  // Nobody wants the rest.
+            }
+            batch.push_back(x);
+            if (batch.size() == batch_size) {
+              open = buffer_.Push(std::move(batch));
+              batch.clear();
+              batch.reserve(batch_size);
+            }
+          });
+          if (open && !batch.empty()) {
+            buffer_.Push(std::move(batch));
+          }
+        }, &buffer_) {}
+
+  // Closes the buffer before the feeder is joined, so that it stops.
+  ~_ZipSource() { buffer_.Close(); }
+
+  // Moves the next value into *x, or returns false if there are no
+  // more. Rethrows anything the producer threw.
+  bool Next(T* x) {
+    if (index_ == batch_.size()) {
+      if (done_ || !buffer_.Pop(&batch_)) {
+        if (!done_) {
+          done_ = true;
+          feeder_.Join();
+        }
+        return false;
+      }
+      index_ = 0;
+    }
+    *x = std::move(batch_[index_++]);
+    return true;
+  }
+
+private:
+  Buffer<std::vector<T>> buffer_;
+  std::vector<T> batch_;
+  size_t index_;
+  bool done_;
+  _Feeder feeder_;
+};
+
+// Sets each element I + 1 of *row from the next value of sources[I],
+// or value-initializes it if that source has run out. Returns the
+// number of sources that had a value.
+template <typename Sources, typename Row, size_t... Is>
+size_t _ZipNext(Sources* sources, Row* row, std::index_sequence<Is...>) {
+  size_t n = 0;
+  auto next = [&n](auto& source, auto* x) {
+    typedef typename std::remove_pointer<decltype(x)>::type T;
+    if (source->Next(x)) {
+      ++n;
+    } else {
+      *x = T();
+    }
+  };
+  (void)next;
+  (next(std::get<Is>(*sources), &std::get<Is + 1>(*row)), ...);
+  return n;
+}
+
+template <typename T0, typename... Ts>
+Producer<std::tuple<T0, Ts...>> PZip(ZipPolicy policy, Producer<T0> p0,
+                                     Producer<Ts>... ps) {
+  typedef std::tuple<T0, Ts...> Row;
+  const size_t batch_size = 256;
+  return [=](const Consumer<Row>& c) {
+    std::tuple<std::unique_ptr<_ZipSource<Ts>>...> sources(
+        std::unique_ptr<_ZipSource<Ts>>(
+            new _ZipSource<Ts>(ps, batch_size))...);
+    const auto indexes = std::index_sequence_for<Ts...>();
+    bool stopped = false;
+    Row row;
+    p0([&](const T0& x) {
+      if (stopped) {
+        return;
+      }
+      std::get<0>(row) = x;
+      if (_ZipNext(&sources, &row, indexes) < sizeof...(Ts) &&
+          policy == ZipPolicy::kShortest) {
+        stopped = true;
+        return;
+      }
+      c(row);
+    });
+    if (policy == ZipPolicy::kPad && !stopped) {
+      std::get<0>(row) = T0();
+      while (_ZipNext(&sources, &row, indexes) > 0) {
+        c(row);
+      }
+    }
+  };
+}
+
+template <typename T0, typename... Ts>
+Producer<std::tuple<T0, Ts...>> PZip(Producer<T0> p0, Producer<Ts>... ps) {
+  return PZip(ZipPolicy::kShortest, p0, ps...);
+}
+
+#endif  // ZIP_H_
@@ -0,0 +1,97 @@
+// Tests for zipping producers.
+
+#include "zip.h"
+
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "consumers_and_producers.h"
+#include "gtest/gtest.h"
+
+using std::string;
+using std::tuple;
+using std::vector;
+
+namespace {
+
+template <typename T>
+Producer<T> Produce(vector<T> xs) {
+  return [=](const Consumer<T>& c) {
+    for (const T& x : xs) c(x);
+  };
+}
+
+template <typename T>
+vector<T> Collect(const Producer<T>& p) {
+  vector<T> xs;
+  p([&](const T& x) { xs.push_back(x); });
+  return xs;
+}
+
+Producer<int> Count(int n) {
+  return [=](const Consumer<int>& c) {
+    for (int i = 0; i < n; ++i) c(i);
+  };
+}
+
+}  // namespace
+
+TEST(PZip, PairsValuesPositionally) {
+  auto names = Produce<string>({"ann", "bob", "cat"});
+  auto counts = Produce<int>({3, 1, 4});
+  EXPECT_EQ((vector<tuple<string, int>>{
+                {"ann", 3}, {"bob", 1}, {"cat", 4}}),
+            Collect(PZip(names, counts)));
+}
+
+TEST(PZip, ConsumesElementwise) {
+  vector<string> seen;
+  PZip(Produce<string>({"a", "b"}), Produce<int>({1, 2}))(
+      [&](const string& s, int n) { seen.push_back(s + std::to_string(n)); });
+  EXPECT_EQ((vector<string>{"a1", "b2"}), seen);
+}
+
+TEST(PZip, StopsAtTheShortestProducer) {
+  EXPECT_EQ((vector<tuple<int, int, int>>{{0, 0, 0}, {1, 1, 1}}),
+            Collect(PZip(Count(5), Count(2), Count(1000000))));
+  EXPECT_EQ((vector<tuple<int, int>>{{0, 0}}),
+            Collect(PZip(Count(1), Count(1000))));
+  EXPECT_TRUE(Collect(PZip(Count(0), Count(10))).empty());
+}
+
+TEST(PZip, PadsToTheLongestProducer) {
+  EXPECT_EQ((vector<tuple<int, string>>{{0, "x"}, {1, ""}, {2, ""}}),
+            Collect(PZip(ZipPolicy::kPad, Count(3),
+                         Produce<string>({"x"}))));
+  EXPECT_EQ((vector<tuple<int, int>>{{0, 0}, {0, 1}, {0, 2}}),
+            Collect(PZip(ZipPolicy::kPad, Count(1), Count(3))));
+}
+
+TEST(PZip, ZipsLongProducersAcrossBatches) {
+  int n = 0;
+  PZip(Count(100000), Count(100000))([&](int a, int b) {
+    EXPECT_EQ(a, b);
+    EXPECT_EQ(n++, a);
+  });
+  EXPECT_EQ(100000, n);
+}
+
+TEST(PZip, PropagatesExceptions) {
+  Producer<int> failing = [](const Consumer<int>& c) {
+    c(1);
+    throw std::runtime_error("producer failed");
+  };
+  EXPECT_THROW(Collect(PZip(Count(10), failing)), std::runtime_error);
+  EXPECT_THROW(PZip(Count(1000), Count(1000))([](int a, int) {
+                 if (a == 700) throw std::logic_error("consumer failed");
+               }),
+               std::logic_error);
+}
+
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}